@@ -1,475 +1,6035 @@
-// NOTE: Almost all the operations in the AES encryption algorithm are done with byte operations, so even though the whole thing is done over a 128-bit input the internals act on bytes only.
-// Due to this the key is taken as an array of 16 chars (128 bits) instead of any other combination of data types like array of 2 uint64_t and so on.
-
-#include<stdio.h>
-#include<stdlib.h>
-#include<string.h>
-#include<inttypes.h>
-
-// A check to see if we have 128 bit type available or not
-// The check128 variable can be printed to see if we have the type or not
-#ifdef __SIZEOF_INT128__
-uint8_t const check128 = 1;
-#else
-uint8_t const check128 = 0;
-#endif
-
-// We will define 10 round constants as follows
-// These will be needed in performing the key scheduling function implemented afterwards.
-const uint32_t Rcon[10] = {
-                                // Each individual number in below sequence is a hexadecimal or of 4 bits
-    (uint32_t)1 << 24,          // 0100 0000
-    (uint32_t)2 << 24,          // 0200 0000
-    (uint32_t)4 << 24,          // 0400 0000
-    (uint32_t)8 << 24,          // 0800 0000
-    (uint32_t)1 << 28,          // 1000 0000
-    (uint32_t)2 << 28,          // 2000 0000
-    (uint32_t)4 << 28,          // 4000 0000
-    (uint32_t)8 << 28,          // 8000 0000
-    ((uint32_t)1 << 28) | ((uint32_t)11 << 24),     // 1B00 0000
-    ((uint32_t)3 << 28) | ((uint32_t)6 << 24)       // 3600 0000
-};
-
-const uint8_t S_BOX[16][16] =  {
-                                { 0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76 },
-                                { 0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0 },
-                                { 0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15 },
-                                { 0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75 },
-                                { 0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84 },
-                                { 0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf },
-                                { 0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8 },
-                                { 0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2 },
-                                { 0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73 },
-                                { 0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb },
-                                { 0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79 },
-                                { 0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08 },
-                                { 0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a },
-                                { 0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e },
-                                { 0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf },
-                                { 0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16 }
-                            };
-
-const uint8_t INV_S_BOX[16][16] = {
-                                { 0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb },
-                                { 0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb },
-                                { 0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e },
-                                { 0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25 },
-                                { 0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92 },
-                                { 0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84 },
-                                { 0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06 },
-                                { 0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b },
-                                { 0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73 },
-                                { 0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e },
-                                { 0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b },
-                                { 0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4 },
-                                { 0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f },
-                                { 0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef },
-                                { 0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61 },
-                                { 0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d }
-                                  };
-
-// A small utility function to print an array of 16, with given indentation(idt) and a message for starting
-void print(char *start, uint8_t *arr, char *idt)
-{
-    printf("%s\n%s", start, idt);
-    for (uint8_t  itr = 0; itr < 16; itr++)
-        printf("%02X ", arr[itr]);
-    printf("\n");
-}
-
-// This is the subbytes function which is used in the key scheduling function as well as the encryption algo.
-uint8_t subbytes(uint8_t val)
-{
-    uint8_t row, col;
-    uint8_t separator = (1 << 4) - 1;
-    col = val & separator;
-    val >>= 4;
-    row = val & separator;
-    return S_BOX[row][col];
-}
-
-// The rotword function for the key scheduling algorithm
-uint32_t rotword(uint32_t val)
-{
-    uint32_t separator = UINT8_MAX;
-    uint8_t bytes[4];
-    uint32_t temp;
-    for (uint8_t itr = 0; itr < 4; itr++)
-    {
-        temp = val & (separator << (8 * itr));
-        temp >>= 8 * itr;
-        bytes[3 - itr] = temp;
-    }
-    uint32_t new_val = bytes[0];
-    new_val |= (uint32_t)bytes[1] << 24;
-    new_val |= (uint32_t)bytes[2] << 16;
-    new_val |= (uint32_t)bytes[3] << 8;
-
-    return new_val;
-}
-
-// The subword function for the key scheduling algorithm
-uint32_t subword(uint32_t val)
-{
-    uint32_t separator = UINT8_MAX;
-    uint8_t bytes[4];
-    uint32_t temp;
-    for (uint8_t itr = 0; itr < 4; itr++)
-    {
-        temp = val & (separator << (8 * itr));
-        temp >>= 8 * itr;
-        bytes[3 - itr] = temp;
-    }
-    uint8_t new_bytes[4] = {};
-    for (uint8_t itr = 0; itr < 4; itr++)
-        new_bytes[itr] = subbytes(bytes[itr]);
-    uint32_t final_val = new_bytes[3];
-    final_val |= ((uint32_t)new_bytes[0]) << 24;
-    final_val |= ((uint32_t)new_bytes[1]) << 16;
-    final_val |= ((uint32_t)new_bytes[2]) << 8;
-    
-    return final_val;
-}
-
-// This is the key scheduling function of the AES
-// Input  : 128 bit key
-// Output : 11 round keys, where length of each round key is 128 bit.
-// We will generate 44 words denoted by w[0], w[1], w[2], ..., w[43] where size of each word is 32 bit.
-// This function will call other functions as well namely ROTWORD and SUBWORD
-// Since we do not have a 128 bit unsigned data type in C, we will return a doubly array of 11 x 16 size. We have 11 rows corressponding to 11 keys and 16 bytes in each row to incorporate the 128-bit key.
-uint8_t (*key_scheduling_fun(char const *secret_key)) [16]
-{
-    uint8_t key[16];
-    for (uint8_t itr = 0; itr < 16; itr++)
-        key[itr] = (uint8_t)secret_key[itr];
-
-    uint32_t words[44] = {};
-    for (uint8_t itr = 0; itr < 4; itr++)
-        words[itr] = ((uint32_t)key[4*itr] << 24) | ((uint32_t)key[4*itr + 1] << 16) | ((uint32_t)key[4*itr + 2] << 8) | ((uint32_t)key[4*itr + 3]);
-    
-    uint32_t temp;
-    for (uint8_t itr = 4; itr < 44; itr++)
-    {
-        temp = words[itr - 1];
-        if (itr % 4 == 0)
-            temp = subword(rotword(temp)) ^ Rcon[(itr / 4) - 1];
-        words[itr] = words[itr - 4] ^ temp;
-    }
-    
-    // Since we don't have any 128 bit data type in C so the round keys cannot be formed like w[i] || w[i+1] || w[i+2] || w[i+3]
-    // Instead we will store the keys in a doubly array of 11x16
-    uint8_t (*round_keys) [16] = calloc(sizeof(uint8_t), 11*16);
-    uint8_t word_no;        // This will be used to select the current word on which the operation has to be performed
-    for (uint8_t itr = 0; itr < 11; itr++)
-    {
-        for (uint8_t itr2 = 0; itr2 < 16; itr2++)
-        {
-            word_no = 4 * itr + itr2 / 4;
-            round_keys[itr][itr2] = (uint8_t)(words[word_no] >> ((3 - (itr2 % 4)) * 8));
-        }
-    }
-    return round_keys;
-}
-
-// This is a small utility function to evaluate (val * x)mod(x^8 + x^4 + x^3 + x + 1) which is used in mixcolumn approach
-uint8_t multiply(uint8_t val)
-{
-    if (val & 128)
-        return (val << 1) ^ 27;
-    else
-        return val << 1;
-}
-
-// This is a small utility function which right shifts an array
-void right(uint8_t *arr)
-{
-    uint8_t temp = arr[3];
-    for (uint8_t itr = 3; itr > 0; itr--)
-        arr[itr] = arr[itr - 1];
-    arr[0] = temp;
-}
-
-// This is the implementation of mixcolumn operatior
-void mixcolumn(uint8_t *column)
-{
-    uint8_t temp_column[4];
-    for (uint8_t itr = 0; itr < 4; itr++)
-        temp_column[itr] = column[itr];
-    
-    uint8_t mult[] = {1, 2, 0, 0};       // represents {x, x+1, 1, 1} which are used for multiplication
-    for (uint8_t itr = 0; itr < 4; itr++)
-    {
-        uint8_t temp = 0;
-        for (uint8_t itr2 = 0; itr2 < 4; itr2++)
-        {
-            if (mult[itr2] == 0)
-                temp ^= temp_column[itr2];
-            else if (mult[itr2] == 1)
-                temp ^= multiply(temp_column[itr2]);
-            else
-                temp ^= multiply(temp_column[itr2]) ^ temp_column[itr2];
-        }
-        // The main thing is here, in mix column
-        // first row -  x*t0 + (x+1)*t1 + t2 + t3
-        // second row - x*t1 + (x+1)*t2 + t3 + t0 or t0 + x*t1 + (x+1)*t2 + t3
-        // On observing we multiplied [x, x+1, 1, 1] for first row and [1, x, x+1, 1] for second row
-        // So for each row we right shift the multiplication array by one
-        right(mult);
-        column[itr] = temp;
-    }
-}
-
-// This is a small utility function that will swap two values at index1(idx1) and index2(idx2) in the given array(arr)
-void swap(uint8_t idx1, uint8_t idx2, uint8_t *arr)
-{
-    uint8_t temp = arr[idx1];
-    arr[idx1] = arr[idx2];
-    arr[idx2] = temp;
-}
-
-// The plaintext is a char array of 17 bytes with 16 bytes for the message and one for the NULL character.
-// Then we have the round keys, they are passed in 8-bit format because all the operations are performed byte wise only.
-char* aes(char const *plaintext, uint8_t const (*round_keys) [16])
-{
-    uint8_t *temp = calloc(sizeof(char), 16);
-    for (uint8_t itr = 0; itr < 16; itr++)
-        temp[itr] = (uint8_t)plaintext[itr];
-    
-    // Start here
-    printf("\nGenerating the output for the 11 processes\n");
-    // 11 rounds loop
-    for (uint8_t round = 0; round < 10; round++)
-    {
-        printf("Round %d\n", round);
-
-        // XORing with round key
-        for (uint8_t itr = 0; itr < 16; itr++)
-            temp[itr] ^= round_keys[round][itr];
-        print("   After XOR with round Key", temp, "\t");
-        
-        // Subbytes
-        for (uint8_t itr = 0; itr < 16; itr++)
-            temp[itr] = subbytes(temp[itr]);
-        print("   After Subbytes", temp, "\t");
-
-        // Shiftrows
-        // Here we will shift each row by its index no. of times so row0 will be shifted 0 times, row2 will be shifted 2 times and so on.
-        // So itr is used as the count for shifting
-        for (uint8_t itr = 1; itr < 4; itr++)
-        {
-            // Since the columns are filled up first while filling the 4x4 matrix we have to get the index of the row elements for each row.
-            // Example - 
-            // Let 16 character input be = "Something Great!"
-            // So it will be filled in the 4x4 matrix as shown below
-            // -------
-            // S t g e
-            // o h   a
-            // m i G t
-            // e n r !
-            // -------
-            // So indexes in the string for the elements of first(count starting from zero) row are 1,5,9,13 => 1, 4+1, 8+1, 12+1
-            // This is what is represented by the row_idx array below
-            uint8_t row_idx[4] = {itr, 4 + itr, 8 + itr, 12 + itr};
-            // Now we have to left shift the row itr no. of times or simply saying its index no. of times which is done by the following loop
-            for(uint8_t itr2 = 1; itr2 <= itr; itr2++)
-            {
-                // To left shift a row we can simple swap each pair of elements starting from the first pair
-                // i.e. swap(0th element and 1st element), the swap(1st element and second element) and so on.
-                swap(row_idx[0], row_idx[1], temp);
-                swap(row_idx[1], row_idx[2], temp);
-                swap(row_idx[2], row_idx[3], temp);
-            }
-        }
-        print("   After Shiftrows", temp, "\t");
-
-        // Mixcolumn
-        // A simple check to remove the mixcolumn at round 10 (here round 9 since we started with zero)
-        if (round == 9)
-            continue;
-        for (uint8_t itr = 0; itr < 4; itr++)
-        {
-            // Here we are passing each column in the array of text
-            // first column starts from index 0, second start from index 4 and so on
-            // temp is the array of text
-            mixcolumn(temp + 4*itr);
-        }
-        print("   After Mixcolumn", temp, "\t");
-    }
-
-    // The output after final XOR with 11th round key
-    for (uint8_t itr = 0; itr < 16; itr++)
-            temp[itr] ^= round_keys[10][itr];
-    print("\n   Final XOR with 11th Key", temp, "\t");
-    
-    // Just some errands to print correct output
-    // Adding NULL character so that the returned character array is printed correctly
-    temp = realloc(temp, sizeof(uint8_t) * 17);
-    temp[16] = '\0';
-    return (char*)temp;
-}
-
-// This is a small utility function that multiplies val with x count no. of times
-// It is similar to the multiply defined above just with the change that x is multiplied given no. of times
-uint8_t multiply_2(uint8_t val, uint8_t count)
-{
-    uint8_t temp = val;
-    for (uint8_t itr = 0; itr < count; itr++)
-    {
-        if (temp & 128)
-            temp = (temp << 1) ^ 27;
-        else
-            temp <<= 1;
-    }
-    return temp;
-}
-
-uint8_t inverse_subbytes(uint8_t val)
-{
-    uint8_t row, col;
-    uint8_t separator = (1 << 4) - 1;
-    col = val & separator;
-    val >>= 4;
-    row = val & separator;
-    return INV_S_BOX[row][col];
-}
-
-void inverse_mixcolumn(uint8_t *column)
-{
-    uint8_t temp_column[4];
-    for(uint8_t itr = 0; itr < 4; itr++)
-        temp_column[itr] = column[itr];
-    
-    uint8_t mult[4] = {14, 11, 13, 9};     // These represent the operation to be performed like 14 - x^3 + x^2 + x
-    for(uint8_t itr = 0; itr < 4; itr++)
-    {
-        uint8_t temp = 0;
-        for (uint8_t itr2 = 0; itr2 < 4; itr2++)
-        {
-            if (mult[itr2] == 14)
-                temp ^= multiply_2(temp_column[itr2], 3) ^ multiply_2(temp_column[itr2], 2) ^ multiply_2(temp_column[itr2], 1);
-            else if (mult[itr2] == 11)
-                temp ^= multiply_2(temp_column[itr2], 3) ^ multiply_2(temp_column[itr2], 1) ^ temp_column[itr2];
-            else if (mult[itr2] == 13)
-                temp ^= multiply_2(temp_column[itr2], 3) ^ multiply_2(temp_column[itr2], 2) ^ temp_column[itr2];
-            else
-                temp ^= multiply_2(temp_column[itr2], 3) ^ temp_column[itr2];
-        }
-        column[itr] = temp;
-        right(mult);
-    }
-}
-
-char* aes_decrypt(char const *ciphertext, uint8_t const (*round_keys) [16])
-{
-    uint8_t *temp = calloc(sizeof(uint8_t), 16);
-    for (uint8_t itr = 0; itr < 16; itr++)
-        temp[itr] = ciphertext[itr];
-
-    for (uint8_t round = 10; round > 0; round--)
-    {
-        // Printing round
-        printf("Round %d\n", round);
-
-        // XORing with round key
-        for(uint8_t itr = 0; itr < 16; itr++)
-            temp[itr] ^= round_keys[round][itr];
-        print("   After XOR with round key", temp, "\t");
-
-        // Inverse Mixcolumn
-        if (round != 10)     // A simple check to avoid mixcolumn for the 10th round (here 9th)
-        {
-            for (uint8_t itr = 0; itr < 4; itr++)
-            {
-                // Here we are again passing the head of the column or simply a pointer to the start of column
-                // Like column1 starts at index 0, column2 starts at index 4 and so on.
-                // Temp is the text array
-                inverse_mixcolumn(temp + 4*itr);
-            }
-            print("   After Inverse Mixcolumn", temp, "\t");
-        }
-
-        // Inverse Shiftrows
-        // For inversing shiftrows either we could left shift row1 1 time or right shift it 3 times, here I have done the latter
-        // The count starts from 0 and we are starting with row 2 because there is no need to shift row1 in any direction
-        for (uint8_t itr = 1; itr < 4; itr++)
-        {
-            // First we calculate the row indexes as calculated in the normal shiftrows
-            // The reason for the calculation for row indexes is written in aes function shiftrows part, do check out if not knowing
-            uint8_t row_idx[4] = {itr, 4 + itr, 8 + itr, 12 + itr};
-            
-            // We have to right shift row1 3 times so row(n) by 4 - n times
-            for (uint8_t itr2 = 4 - itr; itr2 > 0; itr2--)
-            {
-                swap(row_idx[0], row_idx[1], temp);
-                swap(row_idx[1], row_idx[2], temp);
-                swap(row_idx[2], row_idx[3], temp);
-            }
-        }
-        print("   After Inverse Shiftrows", temp, "\t");
-
-        // Inverse Subbytes
-        for(uint8_t itr = 0; itr < 16; itr++)
-            temp[itr] = inverse_subbytes(temp[itr]);
-        print("   After Inverse Subbytes", temp, "\t");
-    }
-
-    // Final XOR with 1st key(here 0th key)
-    for (uint8_t itr = 0; itr < 16; itr++)
-        temp[itr] ^= round_keys[0][itr];
-    print("   Final XOR with key", temp, "\t");
-    
-
-    // Just some errands to print correct output
-    // Adding NULL character so that the returned character array is printed correctly
-    temp = realloc(temp, sizeof(uint8_t) * 17);
-    temp[16] = '\0';
-    return (char*)temp;
-}
-
-void main()
-{   
-    // This line can be uncommented to see if 128 bit is defined in the system or not.
-    // Since its not defined in my system it printed zero.
-    // printf("%" PRIu8 "\n", check128);
-
-    // Since C doesn't have 128-bit data type, the secret key is first scanned as a string.
-    printf("Enter secret key in chars like - \"This is cool\", \nAlso restrict string length to 16\n");
-    // Since we cannot have 128bit integers, we will instead divide 128-bit into 16 8-bit parts which are stored in the char array.
-    // The array size is 17 to include the NULL character.
-    char secret_key[17]; // = "Thats my Kung Fu";
-    scanf("%16[^\n]", secret_key);
-    printf("Enter plaintext similar to secret_key\n");
-    char plaintext[17]; // = "Two One Nine Two";
-    scanf(" %16[^\n]", plaintext);
-    uint8_t (*round_keys) [16] = key_scheduling_fun(secret_key);
-    printf("Round Keys - \n");
-    for (uint8_t itr = 0; itr < 11; itr++)
-    {
-        printf("Round %2d - ",itr);
-        for (uint8_t itr2 = 0; itr2 < 16; itr2++)
-        {
-            printf("%02X ",round_keys[itr][itr2]);
-        }
-        printf("\n");
-    }
-
-    // Encryption       ------------------------------------------------------
-    char *ciphertext = aes(plaintext, round_keys);
-    print("\nCiphertext", ciphertext, "   ");
-
-    // Decrytpion       ------------------------------------------------------
-    char *decrypttext = aes_decrypt(ciphertext, round_keys);
-
-    // Just printing
-    print("\nCiphertext", ciphertext, "   ");
-    printf("\n\t\t\t OR \n\n");
-    printf("\t\t  %s\n",ciphertext);
-    print("\nDecrypted text", decrypttext, "   ");
-    printf("\n\t\t\t OR \n\n");
-    printf("\t\t  %s\n",decrypttext);
-
-    // freeing memory
-    free(round_keys);
-    free(ciphertext);
-    free(decrypttext);
-}
\ No newline at end of file
+// NOTE: Almost all the operations in the AES encryption algorithm are done with byte operations, so even though the whole thing is done over a 128-bit input the internals act on bytes only.
+// Due to this the key is taken as an array of 16 chars (128 bits) instead of any other combination of data types like array of 2 uint64_t and so on.
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<inttypes.h>
+#include<time.h>
+#include<pthread.h>
+#include<sched.h>
+#include<stdatomic.h>
+#include<unistd.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/wait.h>
+
+// The hardware AES instructions are only there on x86, everywhere else the software implementation is used
+#if defined(__x86_64__) || defined(__i386__)
+#include<cpuid.h>
+#include<immintrin.h>
+#define AES_X86
+#endif
+
+// A check to see if we have 128 bit type available or not
+// The check128 variable can be printed to see if we have the type or not
+#ifdef __SIZEOF_INT128__
+uint8_t const check128 = 1;
+#else
+uint8_t const check128 = 0;
+#endif
+
+// We will define 10 round constants as follows
+// These will be needed in performing the key scheduling function implemented afterwards.
+// 10 are enough for every key size, a 128-bit key uses all of them, a 192-bit key 8 and a 256-bit key 7.
+const uint32_t Rcon[10] = {
+                                // Each individual number in below sequence is a hexadecimal or of 4 bits
+    (uint32_t)1 << 24,          // 0100 0000
+    (uint32_t)2 << 24,          // 0200 0000
+    (uint32_t)4 << 24,          // 0400 0000
+    (uint32_t)8 << 24,          // 0800 0000
+    (uint32_t)1 << 28,          // 1000 0000
+    (uint32_t)2 << 28,          // 2000 0000
+    (uint32_t)4 << 28,          // 4000 0000
+    (uint32_t)8 << 28,          // 8000 0000
+    ((uint32_t)1 << 28) | ((uint32_t)11 << 24),     // 1B00 0000
+    ((uint32_t)3 << 28) | ((uint32_t)6 << 24)       // 3600 0000
+};
+
+const uint8_t S_BOX[16][16] =  {
+                                { 0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76 },
+                                { 0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0 },
+                                { 0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15 },
+                                { 0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75 },
+                                { 0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84 },
+                                { 0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf },
+                                { 0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8 },
+                                { 0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2 },
+                                { 0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73 },
+                                { 0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb },
+                                { 0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79 },
+                                { 0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08 },
+                                { 0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a },
+                                { 0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e },
+                                { 0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf },
+                                { 0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16 }
+                            };
+
+const uint8_t INV_S_BOX[16][16] = {
+                                { 0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb },
+                                { 0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb },
+                                { 0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e },
+                                { 0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25 },
+                                { 0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92 },
+                                { 0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84 },
+                                { 0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06 },
+                                { 0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b },
+                                { 0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73 },
+                                { 0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e },
+                                { 0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b },
+                                { 0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4 },
+                                { 0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f },
+                                { 0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef },
+                                { 0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61 },
+                                { 0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d }
+                                  };
+
+// A small utility function to print an array of 16, with given indentation(idt) and a message for starting
+void print(char *start, uint8_t *arr, char *idt)
+{
+    printf("%s\n%s", start, idt);
+    for (uint8_t  itr = 0; itr < 16; itr++)
+        printf("%02X ", arr[itr]);
+    printf("\n");
+}
+
+// Tracing
+// aes() and aes_decrypt() can print the state after every step of every round, which is great for learning how AES works
+// but makes stdout the slowest part of the cipher. So the trace is only compiled in when building with -DAES_TRACE.
+#ifdef AES_TRACE
+#define TRACE(...) printf(__VA_ARGS__)
+#define TRACE_STATE(start, arr, idt) print(start, arr, idt)
+#else
+#define TRACE(...)
+#define TRACE_STATE(start, arr, idt)
+#endif
+
+// Profiling
+// When building with -DAES_PROFILE the time spent in every stage (key expansion, subbytes, shiftrows, mixcolumn and the XOR with
+// the round key) is added up per thread, and profile_report() prints it. The time is read from the time stamp counter on x86 and
+// from clock_gettime() elsewhere. Only the byte wise functions have separate stages, the fast ones do all of them in one go.
+// Without -DAES_PROFILE profile_begin() and profile_end() are empty and the compiler removes them.
+enum { STAGE_KEY_EXPANSION, STAGE_SUBBYTES, STAGE_SHIFTROWS, STAGE_MIXCOLUMN, STAGE_ADD_ROUND_KEY, STAGE_COUNT };
+char const *const STAGE_NAMES[STAGE_COUNT] = { "Key expansion", "Subbytes", "Shiftrows", "Mixcolumn", "XOR with round key" };
+
+// The ticks are CPU cycles on x86 and nanoseconds elsewhere, the benchmark uses them as well
+#ifdef AES_X86
+#define TICK_UNIT "cycles"
+#else
+#define TICK_UNIT "ns"
+#endif
+
+static inline uint64_t read_ticks()
+{
+#ifdef AES_X86
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+#ifdef AES_PROFILE
+// The counters of the current thread
+_Thread_local struct
+{
+    uint64_t ticks[STAGE_COUNT];
+    uint64_t calls[STAGE_COUNT];
+} stage_profile;
+#endif
+
+static inline uint64_t profile_begin()
+{
+#ifdef AES_PROFILE
+    return read_ticks();
+#else
+    return 0;
+#endif
+}
+
+static inline void profile_end(uint8_t stage, uint64_t start)
+{
+#ifdef AES_PROFILE
+    stage_profile.ticks[stage] += read_ticks() - start;
+    stage_profile.calls[stage]++;
+#else
+    (void)stage, (void)start;
+#endif
+}
+
+// Prints the counters of the calling thread, and clears them if reset is set
+void profile_report(FILE *out, uint8_t reset)
+{
+#ifdef AES_PROFILE
+    uint64_t total = 0;
+    for (uint8_t stage = 0; stage < STAGE_COUNT; stage++)
+        total += stage_profile.ticks[stage];
+    fprintf(out, "%-20s %12s %16s %14s %8s\n", "Stage", "Calls", "Total " TICK_UNIT, "Per call", "Share");
+    for (uint8_t stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        uint64_t calls = stage_profile.calls[stage];
+        uint64_t ticks = stage_profile.ticks[stage];
+        fprintf(out, "%-20s %12" PRIu64 " %16" PRIu64 " %14.1f %7.1f%%\n", STAGE_NAMES[stage], calls, ticks,
+                calls ? (double)ticks / calls : 0.0, total ? 100.0 * ticks / total : 0.0);
+    }
+    if (reset)
+        memset(&stage_profile, 0, sizeof(stage_profile));
+#else
+    (void)reset;
+    fprintf(out, "Profiling is not compiled in, build with -DAES_PROFILE\n");
+#endif
+}
+
+// This is the subbytes function which is used in the key scheduling function as well as the encryption algo.
+uint8_t subbytes(uint8_t val)
+{
+    uint8_t row, col;
+    uint8_t separator = (1 << 4) - 1;
+    col = val & separator;
+    val >>= 4;
+    row = val & separator;
+    return S_BOX[row][col];
+}
+
+// The rotword function for the key scheduling algorithm
+uint32_t rotword(uint32_t val)
+{
+    uint32_t separator = UINT8_MAX;
+    uint8_t bytes[4];
+    uint32_t temp;
+    for (uint8_t itr = 0; itr < 4; itr++)
+    {
+        temp = val & (separator << (8 * itr));
+        temp >>= 8 * itr;
+        bytes[3 - itr] = temp;
+    }
+    uint32_t new_val = bytes[0];
+    new_val |= (uint32_t)bytes[1] << 24;
+    new_val |= (uint32_t)bytes[2] << 16;
+    new_val |= (uint32_t)bytes[3] << 8;
+
+    return new_val;
+}
+
+// The subword function for the key scheduling algorithm
+uint32_t subword(uint32_t val)
+{
+    uint32_t separator = UINT8_MAX;
+    uint8_t bytes[4];
+    uint32_t temp;
+    for (uint8_t itr = 0; itr < 4; itr++)
+    {
+        temp = val & (separator << (8 * itr));
+        temp >>= 8 * itr;
+        bytes[3 - itr] = temp;
+    }
+    uint8_t new_bytes[4] = {};
+    for (uint8_t itr = 0; itr < 4; itr++)
+        new_bytes[itr] = subbytes(bytes[itr]);
+    uint32_t final_val = new_bytes[3];
+    final_val |= ((uint32_t)new_bytes[0]) << 24;
+    final_val |= ((uint32_t)new_bytes[1]) << 16;
+    final_val |= ((uint32_t)new_bytes[2]) << 8;
+    
+    return final_val;
+}
+
+// This is the key scheduling function of the AES
+// Input  : 128, 192 or 256 bit key (key_length of 16, 24 or 32 bytes)
+// Output : rounds + 1 round keys, where length of each round key is 128 bit. There are 10 rounds for a 128-bit key, 12 for 192 and 14 for 256.
+// With Nk = key_length / 4 key words we will generate 4 * (rounds + 1) words, so 44, 52 or 60 words where size of each word is 32 bit.
+// This function will call other functions as well namely ROTWORD and SUBWORD
+// Since we do not have a 128 bit unsigned data type in C, we will return a doubly array of 30 x 16 size. The first rows corresspond to the round keys and 16 bytes in each row to incorporate the 128-bit key.
+// From row DEC_KEYS (15, after room for the 15 round keys of AES-256) on they are followed by the keys for decryption in the order they are used (see inverse_key_scheduling below), so they are prepared only once per key.
+// The work is done by key_expansion() which writes into any 30 x 16 array given to it and returns the no. of rounds, key_scheduling_fun() only allocates that array.
+#define AES_MAX_ROUNDS 14
+#define DEC_KEYS (AES_MAX_ROUNDS + 1)
+#define SCHEDULE_ROWS (2 * DEC_KEYS)
+
+// The kernels are unrolled for 10, 12 and 14 rounds only, any other no. means the context was never set up or was overwritten.
+// This is not an error the caller could handle, so it stops the program instead of encrypting with garbage.
+__attribute__((noreturn, cold)) void bad_rounds(uint8_t rounds)
+{
+    fprintf(stderr, "aes: %u rounds, the key schedule was not set up\n", rounds);
+    abort();
+}
+
+void inverse_key_scheduling(uint8_t const (*round_keys) [16], uint8_t (*dec_keys) [16], uint8_t rounds);
+uint8_t key_expansion(uint8_t const *key, uint8_t key_length, uint8_t (*round_keys) [16]);
+
+uint8_t (*key_scheduling_fun(char const *secret_key, uint8_t key_length)) [16]
+{
+    uint8_t (*round_keys) [16] = calloc(sizeof(uint8_t), SCHEDULE_ROWS*16);
+    key_expansion((uint8_t const*)secret_key, key_length, round_keys);
+    return round_keys;
+}
+
+// The no. of rounds for a key of key_length bytes, 0 if there is no such AES
+uint8_t aes_rounds(size_t key_length)
+{
+    return key_length == 16 || key_length == 24 || key_length == 32 ? key_length / 4 + 6 : 0;
+}
+
+uint8_t key_expansion(uint8_t const *key, uint8_t key_length, uint8_t (*round_keys) [16])
+{
+    uint64_t stage_start = profile_begin();
+    uint8_t nk = key_length / 4;
+    uint8_t rounds = aes_rounds(key_length);
+    uint8_t word_count = 4 * (rounds + 1);
+    uint32_t words[4 * (AES_MAX_ROUNDS + 1)] = {};
+    for (uint8_t itr = 0; itr < nk; itr++)
+        words[itr] = ((uint32_t)key[4*itr] << 24) | ((uint32_t)key[4*itr + 1] << 16) | ((uint32_t)key[4*itr + 2] << 8) | ((uint32_t)key[4*itr + 3]);
+    
+    uint32_t temp;
+    for (uint8_t itr = nk; itr < word_count; itr++)
+    {
+        temp = words[itr - 1];
+        if (itr % nk == 0)
+            temp = subword(rotword(temp)) ^ Rcon[(itr / nk) - 1];
+        // A 256-bit key has 8 words per step, and the word in the middle of each step goes through SUBWORD as well
+        else if (nk == 8 && itr % nk == 4)
+            temp = subword(temp);
+        words[itr] = words[itr - nk] ^ temp;
+    }
+    
+    // Since we don't have any 128 bit data type in C so the round keys cannot be formed like w[i] || w[i+1] || w[i+2] || w[i+3]
+    // Instead we will store the keys in a doubly array of (rounds + 1)x16 (followed by the decryption keys)
+    uint8_t word_no;        // This will be used to select the current word on which the operation has to be performed
+    for (uint8_t itr = 0; itr <= rounds; itr++)
+    {
+        for (uint8_t itr2 = 0; itr2 < 16; itr2++)
+        {
+            word_no = 4 * itr + itr2 / 4;
+            round_keys[itr][itr2] = (uint8_t)(words[word_no] >> ((3 - (itr2 % 4)) * 8));
+        }
+    }
+    inverse_key_scheduling((uint8_t const (*)[16])round_keys, round_keys + DEC_KEYS, rounds);
+    profile_end(STAGE_KEY_EXPANSION, stage_start);
+    return rounds;
+}
+
+// This is a small utility function to evaluate (val * x)mod(x^8 + x^4 + x^3 + x + 1) which is used in mixcolumn approach
+uint8_t multiply(uint8_t val)
+{
+    if (val & 128)
+        return (val << 1) ^ 27;
+    else
+        return val << 1;
+}
+
+// This is a small utility function which right shifts an array
+void right(uint8_t *arr)
+{
+    uint8_t temp = arr[3];
+    for (uint8_t itr = 3; itr > 0; itr--)
+        arr[itr] = arr[itr - 1];
+    arr[0] = temp;
+}
+
+// This is the implementation of mixcolumn operatior
+void mixcolumn(uint8_t *column)
+{
+    uint8_t temp_column[4];
+    for (uint8_t itr = 0; itr < 4; itr++)
+        temp_column[itr] = column[itr];
+    
+    uint8_t mult[] = {1, 2, 0, 0};       // represents {x, x+1, 1, 1} which are used for multiplication
+    for (uint8_t itr = 0; itr < 4; itr++)
+    {
+        uint8_t temp = 0;
+        for (uint8_t itr2 = 0; itr2 < 4; itr2++)
+        {
+            if (mult[itr2] == 0)
+                temp ^= temp_column[itr2];
+            else if (mult[itr2] == 1)
+                temp ^= multiply(temp_column[itr2]);
+            else
+                temp ^= multiply(temp_column[itr2]) ^ temp_column[itr2];
+        }
+        // The main thing is here, in mix column
+        // first row -  x*t0 + (x+1)*t1 + t2 + t3
+        // second row - x*t1 + (x+1)*t2 + t3 + t0 or t0 + x*t1 + (x+1)*t2 + t3
+        // On observing we multiplied [x, x+1, 1, 1] for first row and [1, x, x+1, 1] for second row
+        // So for each row we right shift the multiplication array by one
+        right(mult);
+        column[itr] = temp;
+    }
+}
+
+// This is a small utility function that will swap two values at index1(idx1) and index2(idx2) in the given array(arr)
+void swap(uint8_t idx1, uint8_t idx2, uint8_t *arr)
+{
+    uint8_t temp = arr[idx1];
+    arr[idx1] = arr[idx2];
+    arr[idx2] = temp;
+}
+
+// The plaintext is a char array of 17 bytes with 16 bytes for the message and one for the NULL character.
+// Then we have the round keys, they are passed in 8-bit format because all the operations are performed byte wise only.
+// The no. of rounds (10, 12 or 14) is the one key_expansion() returned for the key.
+char* aes(char const *plaintext, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    uint8_t *temp = calloc(sizeof(char), 16);
+    for (uint8_t itr = 0; itr < 16; itr++)
+        temp[itr] = (uint8_t)plaintext[itr];
+    
+    // Start here
+    uint64_t stage_start;       // Only used when profiling
+    TRACE("\nGenerating the output for the %d processes\n", rounds + 1);
+    // rounds + 1 processes loop
+    for (uint8_t round = 0; round < rounds; round++)
+    {
+        TRACE("Round %d\n", round);
+
+        // XORing with round key
+        stage_start = profile_begin();
+        for (uint8_t itr = 0; itr < 16; itr++)
+            temp[itr] ^= round_keys[round][itr];
+        profile_end(STAGE_ADD_ROUND_KEY, stage_start);
+        TRACE_STATE("   After XOR with round Key", temp, "\t");
+        
+        // Subbytes
+        stage_start = profile_begin();
+        for (uint8_t itr = 0; itr < 16; itr++)
+            temp[itr] = subbytes(temp[itr]);
+        profile_end(STAGE_SUBBYTES, stage_start);
+        TRACE_STATE("   After Subbytes", temp, "\t");
+
+        // Shiftrows
+        // Here we will shift each row by its index no. of times so row0 will be shifted 0 times, row2 will be shifted 2 times and so on.
+        // So itr is used as the count for shifting
+        stage_start = profile_begin();
+        for (uint8_t itr = 1; itr < 4; itr++)
+        {
+            // Since the columns are filled up first while filling the 4x4 matrix we have to get the index of the row elements for each row.
+            // Example - 
+            // Let 16 character input be = "Something Great!"
+            // So it will be filled in the 4x4 matrix as shown below
+            // -------
+            // S t g e
+            // o h   a
+            // m i G t
+            // e n r !
+            // -------
+            // So indexes in the string for the elements of first(count starting from zero) row are 1,5,9,13 => 1, 4+1, 8+1, 12+1
+            // This is what is represented by the row_idx array below
+            uint8_t row_idx[4] = {itr, 4 + itr, 8 + itr, 12 + itr};
+            // Now we have to left shift the row itr no. of times or simply saying its index no. of times which is done by the following loop
+            for(uint8_t itr2 = 1; itr2 <= itr; itr2++)
+            {
+                // To left shift a row we can simple swap each pair of elements starting from the first pair
+                // i.e. swap(0th element and 1st element), the swap(1st element and second element) and so on.
+                swap(row_idx[0], row_idx[1], temp);
+                swap(row_idx[1], row_idx[2], temp);
+                swap(row_idx[2], row_idx[3], temp);
+            }
+        }
+        profile_end(STAGE_SHIFTROWS, stage_start);
+        TRACE_STATE("   After Shiftrows", temp, "\t");
+
+        // Mixcolumn
+        // A simple check to remove the mixcolumn at the last round (here rounds - 1 since we started with zero)
+        if (round == rounds - 1)
+            continue;
+        stage_start = profile_begin();
+        for (uint8_t itr = 0; itr < 4; itr++)
+        {
+            // Here we are passing each column in the array of text
+            // first column starts from index 0, second start from index 4 and so on
+            // temp is the array of text
+            mixcolumn(temp + 4*itr);
+        }
+        profile_end(STAGE_MIXCOLUMN, stage_start);
+        TRACE_STATE("   After Mixcolumn", temp, "\t");
+    }
+
+    // The output after final XOR with the last round key
+    stage_start = profile_begin();
+    for (uint8_t itr = 0; itr < 16; itr++)
+            temp[itr] ^= round_keys[rounds][itr];
+    profile_end(STAGE_ADD_ROUND_KEY, stage_start);
+    TRACE_STATE("\n   Final XOR with last Key", temp, "\t");
+    
+    // Just some errands to print correct output
+    // Adding NULL character so that the returned character array is printed correctly
+    temp = realloc(temp, sizeof(uint8_t) * 17);
+    temp[16] = '\0';
+    return (char*)temp;
+}
+
+// T-tables for the word oriented encryption
+// Every column coming out of a round is Mixcolumn(Subbytes(a0), Subbytes(a1), Subbytes(a2), Subbytes(a3)) where a0..a3 are the
+// bytes that Shiftrows moved into that column. Mixcolumn is linear, so the column is the XOR of four columns each depending on one byte only
+//      a0 -> (2s, s, s, 3s)     a1 -> (3s, 2s, s, s)     a2 -> (s, 3s, 2s, s)     a3 -> (s, s, 3s, 2s)         where s = Subbytes(a)
+// ENC_TABLE[row][a] holds the column for the byte a coming from the given row, packed in a 32-bit word with row 0 in the top byte
+// (the same packing as the words of the key scheduling function). These are filled once by generate_enc_tables().
+uint32_t ENC_TABLE[4][256];
+
+void generate_enc_tables()
+{
+    for (uint16_t val = 0; val < 256; val++)
+    {
+        uint8_t s = subbytes(val);
+        uint8_t s2 = multiply(s);       // x * s
+        uint8_t s3 = s2 ^ s;            // (x + 1) * s
+        uint32_t word = ((uint32_t)s2 << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | s3;
+        // Each next row is the same column rotated down by one byte, exactly like the right() shift of the mult array in mixcolumn
+        for (uint8_t row = 0; row < 4; row++)
+        {
+            ENC_TABLE[row][val] = word;
+            word = (word >> 8) | (word << 24);
+        }
+    }
+}
+
+// Small utility functions to move between 4 bytes of a column and the 32-bit word holding it (first byte in the top 8 bits)
+static inline uint32_t load_word(uint8_t const *bytes)
+{
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+}
+
+static inline void store_word(uint8_t *bytes, uint32_t word)
+{
+    bytes[0] = (uint8_t)(word >> 24);
+    bytes[1] = (uint8_t)(word >> 16);
+    bytes[2] = (uint8_t)(word >> 8);
+    bytes[3] = (uint8_t)word;
+}
+
+// This is the same encryption as aes() but done on four 32-bit column words with the T-tables.
+// Each round but the last is 16 table lookups and XORs, the last round (which has no mixcolumn) uses the S_BOX directly.
+// The input and output are 16 byte blocks, they are allowed to be the same buffer.
+// ttable_rounds() is only ever called with a constant no. of rounds, so the compiler makes a fully unrolled copy for each key size and
+// aes_ttable() picks one with a switch, once per block instead of a check in every round.
+static inline __attribute__((always_inline)) void ttable_rounds(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t const rounds)
+{
+    // The S_BOX is stored row by row, so seen as a flat array of 256 it is indexed by the byte directly
+    uint8_t const *sbox = &S_BOX[0][0];
+
+    uint32_t s0 = load_word(input) ^ load_word(round_keys[0]);
+    uint32_t s1 = load_word(input + 4) ^ load_word(round_keys[0] + 4);
+    uint32_t s2 = load_word(input + 8) ^ load_word(round_keys[0] + 8);
+    uint32_t s3 = load_word(input + 12) ^ load_word(round_keys[0] + 12);
+    uint32_t t0, t1, t2, t3;
+
+#pragma GCC unroll 14
+    for (uint8_t round = 1; round < rounds; round++)
+    {
+        // Shiftrows moves row r of column (c + r) into column c, so column c takes its row r byte from word s(c + r)
+        t0 = ENC_TABLE[0][s0 >> 24] ^ ENC_TABLE[1][(s1 >> 16) & 0xff] ^ ENC_TABLE[2][(s2 >> 8) & 0xff] ^ ENC_TABLE[3][s3 & 0xff] ^ load_word(round_keys[round]);
+        t1 = ENC_TABLE[0][s1 >> 24] ^ ENC_TABLE[1][(s2 >> 16) & 0xff] ^ ENC_TABLE[2][(s3 >> 8) & 0xff] ^ ENC_TABLE[3][s0 & 0xff] ^ load_word(round_keys[round] + 4);
+        t2 = ENC_TABLE[0][s2 >> 24] ^ ENC_TABLE[1][(s3 >> 16) & 0xff] ^ ENC_TABLE[2][(s0 >> 8) & 0xff] ^ ENC_TABLE[3][s1 & 0xff] ^ load_word(round_keys[round] + 8);
+        t3 = ENC_TABLE[0][s3 >> 24] ^ ENC_TABLE[1][(s0 >> 16) & 0xff] ^ ENC_TABLE[2][(s1 >> 8) & 0xff] ^ ENC_TABLE[3][s2 & 0xff] ^ load_word(round_keys[round] + 12);
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+
+    // Last round - Subbytes and Shiftrows only
+    t0 = ((uint32_t)sbox[s0 >> 24] << 24) | ((uint32_t)sbox[(s1 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s2 >> 8) & 0xff] << 8) | sbox[s3 & 0xff];
+    t1 = ((uint32_t)sbox[s1 >> 24] << 24) | ((uint32_t)sbox[(s2 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s3 >> 8) & 0xff] << 8) | sbox[s0 & 0xff];
+    t2 = ((uint32_t)sbox[s2 >> 24] << 24) | ((uint32_t)sbox[(s3 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s0 >> 8) & 0xff] << 8) | sbox[s1 & 0xff];
+    t3 = ((uint32_t)sbox[s3 >> 24] << 24) | ((uint32_t)sbox[(s0 >> 16) & 0xff] << 16) | ((uint32_t)sbox[(s1 >> 8) & 0xff] << 8) | sbox[s2 & 0xff];
+
+    store_word(output, t0 ^ load_word(round_keys[rounds]));
+    store_word(output + 4, t1 ^ load_word(round_keys[rounds] + 4));
+    store_word(output + 8, t2 ^ load_word(round_keys[rounds] + 8));
+    store_word(output + 12, t3 ^ load_word(round_keys[rounds] + 12));
+}
+
+void aes_ttable(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    switch (rounds)
+    {
+    case 10: ttable_rounds(input, output, round_keys, 10); break;
+    case 12: ttable_rounds(input, output, round_keys, 12); break;
+    case 14: ttable_rounds(input, output, round_keys, 14); break;
+    default: bad_rounds(rounds);
+    }
+}
+
+uint8_t inverse_subbytes(uint8_t val)
+{
+    uint8_t row, col;
+    uint8_t separator = (1 << 4) - 1;
+    col = val & separator;
+    val >>= 4;
+    row = val & separator;
+    return INV_S_BOX[row][col];
+}
+
+// Inverse mixcolumn multiplies the column with the matrix rows (14, 11, 13, 9), (9, 14, 11, 13) and so on.
+// 14, 11, 13 and 9 are all sums of 1, x, x^2 and x^3, so three multiply() calls per byte give every product that is needed.
+void inverse_mixcolumn(uint8_t *column)
+{
+    uint8_t times14[4], times11[4], times13[4], times9[4];
+    for (uint8_t itr = 0; itr < 4; itr++)
+    {
+        uint8_t x1 = multiply(column[itr]);     // x * a
+        uint8_t x2 = multiply(x1);              // x^2 * a
+        uint8_t x3 = multiply(x2);              // x^3 * a
+        times14[itr] = x3 ^ x2 ^ x1;
+        times11[itr] = x3 ^ x1 ^ column[itr];
+        times13[itr] = x3 ^ x2 ^ column[itr];
+        times9[itr] = x3 ^ column[itr];
+    }
+
+    // Row itr starts with 14 on its own byte, and the rest of the matrix row follows the next bytes around the column
+    for (uint8_t itr = 0; itr < 4; itr++)
+        column[itr] = times14[itr] ^ times11[(itr + 1) & 3] ^ times13[(itr + 2) & 3] ^ times9[(itr + 3) & 3];
+}
+
+// This prepares the keys for the "equivalent inverse cipher" of FIPS-197 (section 5.3.5) which is what the AESDEC instruction and the
+// decryption T-tables implement.
+// There inverse mixcolumn is done before the XOR with the round key, and since inverse mixcolumn is linear this is the same as the normal
+// order if the round key itself went through inverse mixcolumn. So the decryption keys are the round keys in reverse order,
+// with inverse mixcolumn applied on all of them except the first and the last one.
+void inverse_key_scheduling(uint8_t const (*round_keys) [16], uint8_t (*dec_keys) [16], uint8_t rounds)
+{
+    for (uint8_t itr = 0; itr <= rounds; itr++)
+    {
+        memcpy(dec_keys[itr], round_keys[rounds - itr], 16);
+        if (itr == 0 || itr == rounds)
+            continue;
+        for (uint8_t col = 0; col < 4; col++)
+            inverse_mixcolumn(dec_keys[itr] + 4*col);
+    }
+}
+
+char* aes_decrypt(char const *ciphertext, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    uint8_t *temp = calloc(sizeof(uint8_t), 16);
+    for (uint8_t itr = 0; itr < 16; itr++)
+        temp[itr] = ciphertext[itr];
+
+    uint64_t stage_start;       // Only used when profiling
+    for (uint8_t round = rounds; round > 0; round--)
+    {
+        // Printing round
+        TRACE("Round %d\n", round);
+
+        // XORing with round key
+        stage_start = profile_begin();
+        for(uint8_t itr = 0; itr < 16; itr++)
+            temp[itr] ^= round_keys[round][itr];
+        profile_end(STAGE_ADD_ROUND_KEY, stage_start);
+        TRACE_STATE("   After XOR with round key", temp, "\t");
+
+        // Inverse Mixcolumn
+        if (round != rounds)     // A simple check to avoid mixcolumn for the last round
+        {
+            stage_start = profile_begin();
+            for (uint8_t itr = 0; itr < 4; itr++)
+            {
+                // Here we are again passing the head of the column or simply a pointer to the start of column
+                // Like column1 starts at index 0, column2 starts at index 4 and so on.
+                // Temp is the text array
+                inverse_mixcolumn(temp + 4*itr);
+            }
+            profile_end(STAGE_MIXCOLUMN, stage_start);
+            TRACE_STATE("   After Inverse Mixcolumn", temp, "\t");
+        }
+
+        // Inverse Shiftrows
+        // For inversing shiftrows either we could left shift row1 1 time or right shift it 3 times, here I have done the latter
+        // The count starts from 0 and we are starting with row 2 because there is no need to shift row1 in any direction
+        stage_start = profile_begin();
+        for (uint8_t itr = 1; itr < 4; itr++)
+        {
+            // First we calculate the row indexes as calculated in the normal shiftrows
+            // The reason for the calculation for row indexes is written in aes function shiftrows part, do check out if not knowing
+            uint8_t row_idx[4] = {itr, 4 + itr, 8 + itr, 12 + itr};
+            
+            // We have to right shift row1 3 times so row(n) by 4 - n times
+            for (uint8_t itr2 = 4 - itr; itr2 > 0; itr2--)
+            {
+                swap(row_idx[0], row_idx[1], temp);
+                swap(row_idx[1], row_idx[2], temp);
+                swap(row_idx[2], row_idx[3], temp);
+            }
+        }
+        profile_end(STAGE_SHIFTROWS, stage_start);
+        TRACE_STATE("   After Inverse Shiftrows", temp, "\t");
+
+        // Inverse Subbytes
+        stage_start = profile_begin();
+        for(uint8_t itr = 0; itr < 16; itr++)
+            temp[itr] = inverse_subbytes(temp[itr]);
+        profile_end(STAGE_SUBBYTES, stage_start);
+        TRACE_STATE("   After Inverse Subbytes", temp, "\t");
+    }
+
+    // Final XOR with 1st key(here 0th key)
+    stage_start = profile_begin();
+    for (uint8_t itr = 0; itr < 16; itr++)
+        temp[itr] ^= round_keys[0][itr];
+    profile_end(STAGE_ADD_ROUND_KEY, stage_start);
+    TRACE_STATE("   Final XOR with key", temp, "\t");
+    
+
+    // Just some errands to print correct output
+    // Adding NULL character so that the returned character array is printed correctly
+    temp = realloc(temp, sizeof(uint8_t) * 17);
+    temp[16] = '\0';
+    return (char*)temp;
+}
+
+// T-tables for the word oriented decryption
+// With the equivalent inverse cipher a decryption round has the same shape as an encryption round: inverse subbytes, inverse shiftrows,
+// inverse mixcolumn and then the XOR with a decryption key. So the same trick works, every column coming out of a round is the XOR of
+//      a0 -> (14s, 9s, 13s, 11s)     a1 -> (11s, 14s, 9s, 13s)     a2 -> (13s, 11s, 14s, 9s)     a3 -> (9s, 13s, 11s, 14s)     where s = Inverse_Subbytes(a)
+// and a0..a3 are the bytes inverse shiftrows moved into the column. DEC_TABLE[row][a] is packed like ENC_TABLE and filled once by
+// generate_dec_tables().
+uint32_t DEC_TABLE[4][256];
+
+void generate_dec_tables()
+{
+    for (uint16_t val = 0; val < 256; val++)
+    {
+        // The column for a byte in row 0 is inverse mixcolumn of (s, 0, 0, 0)
+        uint8_t column[4] = {inverse_subbytes(val), 0, 0, 0};
+        inverse_mixcolumn(column);
+        uint32_t word = load_word(column);
+        for (uint8_t row = 0; row < 4; row++)
+        {
+            DEC_TABLE[row][val] = word;
+            word = (word >> 8) | (word << 24);
+        }
+    }
+}
+
+// The same decryption as aes_decrypt() with the decryption T-tables and the decryption keys from row DEC_KEYS of the schedule,
+// which already went through inverse mixcolumn in key_expansion(). It is specialised for each key size like aes_ttable().
+static inline __attribute__((always_inline)) void ttable_decrypt_rounds(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t const rounds)
+{
+    uint8_t const *inv_sbox = &INV_S_BOX[0][0];
+    uint8_t const (*dec_keys) [16] = round_keys + DEC_KEYS;
+
+    uint32_t s0 = load_word(input) ^ load_word(dec_keys[0]);
+    uint32_t s1 = load_word(input + 4) ^ load_word(dec_keys[0] + 4);
+    uint32_t s2 = load_word(input + 8) ^ load_word(dec_keys[0] + 8);
+    uint32_t s3 = load_word(input + 12) ^ load_word(dec_keys[0] + 12);
+    uint32_t t0, t1, t2, t3;
+
+#pragma GCC unroll 14
+    for (uint8_t round = 1; round < rounds; round++)
+    {
+        // Inverse shiftrows moves row r of column (c - r) into column c, so column c takes its row r byte from word s(c - r)
+        t0 = DEC_TABLE[0][s0 >> 24] ^ DEC_TABLE[1][(s3 >> 16) & 0xff] ^ DEC_TABLE[2][(s2 >> 8) & 0xff] ^ DEC_TABLE[3][s1 & 0xff] ^ load_word(dec_keys[round]);
+        t1 = DEC_TABLE[0][s1 >> 24] ^ DEC_TABLE[1][(s0 >> 16) & 0xff] ^ DEC_TABLE[2][(s3 >> 8) & 0xff] ^ DEC_TABLE[3][s2 & 0xff] ^ load_word(dec_keys[round] + 4);
+        t2 = DEC_TABLE[0][s2 >> 24] ^ DEC_TABLE[1][(s1 >> 16) & 0xff] ^ DEC_TABLE[2][(s0 >> 8) & 0xff] ^ DEC_TABLE[3][s3 & 0xff] ^ load_word(dec_keys[round] + 8);
+        t3 = DEC_TABLE[0][s3 >> 24] ^ DEC_TABLE[1][(s2 >> 16) & 0xff] ^ DEC_TABLE[2][(s1 >> 8) & 0xff] ^ DEC_TABLE[3][s0 & 0xff] ^ load_word(dec_keys[round] + 12);
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+
+    // Last round - Inverse subbytes and inverse shiftrows only
+    t0 = ((uint32_t)inv_sbox[s0 >> 24] << 24) | ((uint32_t)inv_sbox[(s3 >> 16) & 0xff] << 16) | ((uint32_t)inv_sbox[(s2 >> 8) & 0xff] << 8) | inv_sbox[s1 & 0xff];
+    t1 = ((uint32_t)inv_sbox[s1 >> 24] << 24) | ((uint32_t)inv_sbox[(s0 >> 16) & 0xff] << 16) | ((uint32_t)inv_sbox[(s3 >> 8) & 0xff] << 8) | inv_sbox[s2 & 0xff];
+    t2 = ((uint32_t)inv_sbox[s2 >> 24] << 24) | ((uint32_t)inv_sbox[(s1 >> 16) & 0xff] << 16) | ((uint32_t)inv_sbox[(s0 >> 8) & 0xff] << 8) | inv_sbox[s3 & 0xff];
+    t3 = ((uint32_t)inv_sbox[s3 >> 24] << 24) | ((uint32_t)inv_sbox[(s2 >> 16) & 0xff] << 16) | ((uint32_t)inv_sbox[(s1 >> 8) & 0xff] << 8) | inv_sbox[s0 & 0xff];
+
+    store_word(output, t0 ^ load_word(dec_keys[rounds]));
+    store_word(output + 4, t1 ^ load_word(dec_keys[rounds] + 4));
+    store_word(output + 8, t2 ^ load_word(dec_keys[rounds] + 8));
+    store_word(output + 12, t3 ^ load_word(dec_keys[rounds] + 12));
+}
+
+void aes_ttable_decrypt(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    switch (rounds)
+    {
+    case 10: ttable_decrypt_rounds(input, output, round_keys, 10); break;
+    case 12: ttable_decrypt_rounds(input, output, round_keys, 12); break;
+    case 14: ttable_decrypt_rounds(input, output, round_keys, 14); break;
+    default: bad_rounds(rounds);
+    }
+}
+
+// The reference aes() and aes_decrypt() wrapped for the block interface, so they can be checked and measured like the other implementations
+void aes_encrypt_reference(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    char *temp = aes((char const*)input, round_keys, rounds);
+    memcpy(output, temp, 16);
+    free(temp);
+}
+
+void aes_decrypt_reference(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    char *temp = aes_decrypt((char const*)input, round_keys, rounds);
+    memcpy(output, temp, 16);
+    free(temp);
+}
+
+// Hardware AES (AES-NI)
+// x86 processors with AES-NI do one full round (subbytes, shiftrows, mixcolumn and the XOR with round key) in a single instruction.
+// The 128-bit register holds the 16 bytes in the same order as our arrays, so the round keys can be loaded as they are.
+// The target attribute lets these functions use the instructions without compiling the whole file for AES-NI,
+// they are only called after aes_init() has checked that the CPU has them.
+// The "lanes" functions of the implementations encrypt one block for each of up to MULTI_LANES different keys, for the multi-buffer CBC
+// below. The no. of lanes is always a multiple of 8, the bitsliced kernel wants all of its AES_BITSLICE_LANES filled.
+#define MULTI_LANES 64
+
+#ifdef AES_X86
+// Like the T-tables, every function here is written once for a constant no. of rounds and specialised for each key size with a switch
+__attribute__((target("aes"))) static inline __attribute__((always_inline)) void aesni_encrypt_rounds(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t const rounds)
+{
+    __m128i state = _mm_loadu_si128((__m128i const*)input);
+    state = _mm_xor_si128(state, _mm_loadu_si128((__m128i const*)round_keys[0]));
+#pragma GCC unroll 14
+    for (uint8_t round = 1; round < rounds; round++)
+        state = _mm_aesenc_si128(state, _mm_loadu_si128((__m128i const*)round_keys[round]));
+    state = _mm_aesenclast_si128(state, _mm_loadu_si128((__m128i const*)round_keys[rounds]));
+    _mm_storeu_si128((__m128i*)output, state);
+}
+
+// AESDEC does the rounds of the equivalent inverse cipher, so it needs the decryption keys which start at row DEC_KEYS
+__attribute__((target("aes"))) static inline __attribute__((always_inline)) void aesni_decrypt_rounds(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t const rounds)
+{
+    uint8_t const (*dec_keys) [16] = round_keys + DEC_KEYS;
+    __m128i state = _mm_loadu_si128((__m128i const*)input);
+    state = _mm_xor_si128(state, _mm_loadu_si128((__m128i const*)dec_keys[0]));
+#pragma GCC unroll 14
+    for (uint8_t round = 1; round < rounds; round++)
+        state = _mm_aesdec_si128(state, _mm_loadu_si128((__m128i const*)dec_keys[round]));
+    state = _mm_aesdeclast_si128(state, _mm_loadu_si128((__m128i const*)dec_keys[rounds]));
+    _mm_storeu_si128((__m128i*)output, state);
+}
+
+__attribute__((target("aes"))) void aesni_encrypt(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    switch (rounds)
+    {
+    case 10: aesni_encrypt_rounds(input, output, round_keys, 10); break;
+    case 12: aesni_encrypt_rounds(input, output, round_keys, 12); break;
+    case 14: aesni_encrypt_rounds(input, output, round_keys, 14); break;
+    default: bad_rounds(rounds);
+    }
+}
+
+__attribute__((target("aes"))) void aesni_decrypt(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    switch (rounds)
+    {
+    case 10: aesni_decrypt_rounds(input, output, round_keys, 10); break;
+    case 12: aesni_decrypt_rounds(input, output, round_keys, 12); break;
+    case 14: aesni_decrypt_rounds(input, output, round_keys, 14); break;
+    default: bad_rounds(rounds);
+    }
+}
+
+// One AESENC takes several cycles to finish but a new one can start every cycle, so a single block leaves the unit mostly idle.
+// These work on 8 independent blocks at once, every round is done for all 8 before moving to the next round.
+#define AESNI_LANES 8
+
+__attribute__((target("aes"))) static inline __attribute__((always_inline)) void aesni_encrypt_blocks_rounds(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t const rounds)
+{
+    __m128i keys[AES_MAX_ROUNDS + 1], state[AESNI_LANES];
+    for (uint8_t round = 0; round <= rounds; round++)
+        keys[round] = _mm_loadu_si128((__m128i const*)round_keys[round]);
+    for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES, input += 16*AESNI_LANES, output += 16*AESNI_LANES)
+    {
+        for (uint8_t lane = 0; lane < AESNI_LANES; lane++)
+            state[lane] = _mm_xor_si128(_mm_loadu_si128((__m128i const*)(input + 16*lane)), keys[0]);
+#pragma GCC unroll 14
+        for (uint8_t round = 1; round < rounds; round++)
+            for (uint8_t lane = 0; lane < AESNI_LANES; lane++)
+                state[lane] = _mm_aesenc_si128(state[lane], keys[round]);
+        for (uint8_t lane = 0; lane < AESNI_LANES; lane++)
+            _mm_storeu_si128((__m128i*)(output + 16*lane), _mm_aesenclast_si128(state[lane], keys[rounds]));
+    }
+    for (; blocks > 0; blocks--, input += 16, output += 16)
+        aesni_encrypt_rounds(input, output, round_keys, rounds);
+}
+
+__attribute__((target("aes"))) static inline __attribute__((always_inline)) void aesni_decrypt_blocks_rounds(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t const rounds)
+{
+    __m128i keys[AES_MAX_ROUNDS + 1], state[AESNI_LANES];
+    for (uint8_t round = 0; round <= rounds; round++)
+        keys[round] = _mm_loadu_si128((__m128i const*)round_keys[DEC_KEYS + round]);
+    for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES, input += 16*AESNI_LANES, output += 16*AESNI_LANES)
+    {
+        for (uint8_t lane = 0; lane < AESNI_LANES; lane++)
+            state[lane] = _mm_xor_si128(_mm_loadu_si128((__m128i const*)(input + 16*lane)), keys[0]);
+#pragma GCC unroll 14
+        for (uint8_t round = 1; round < rounds; round++)
+            for (uint8_t lane = 0; lane < AESNI_LANES; lane++)
+                state[lane] = _mm_aesdec_si128(state[lane], keys[round]);
+        for (uint8_t lane = 0; lane < AESNI_LANES; lane++)
+            _mm_storeu_si128((__m128i*)(output + 16*lane), _mm_aesdeclast_si128(state[lane], keys[rounds]));
+    }
+    for (; blocks > 0; blocks--, input += 16, output += 16)
+        aesni_decrypt_rounds(input, output, round_keys, rounds);
+}
+
+// One block for each of the given keys (all with the same no. of rounds), AESNI_LANES at a time. The keys are read straight from the
+// schedules, AESENC can take its round key from memory at no extra cost.
+__attribute__((target("aes"))) static inline __attribute__((always_inline)) void aesni_encrypt_lanes_rounds(uint8_t (*blocks) [16], uint8_t const (* const *round_keys) [16], size_t lanes, uint8_t const rounds)
+{
+    __m128i state[AESNI_LANES];
+    for (; lanes > 0; lanes -= AESNI_LANES, blocks += AESNI_LANES, round_keys += AESNI_LANES)
+    {
+        for (uint8_t lane = 0; lane < AESNI_LANES; lane++)
+            state[lane] = _mm_xor_si128(_mm_loadu_si128((__m128i const*)blocks[lane]), _mm_loadu_si128((__m128i const*)round_keys[lane][0]));
+#pragma GCC unroll 14
+        for (uint8_t round = 1; round < rounds; round++)
+            for (uint8_t lane = 0; lane < AESNI_LANES; lane++)
+                state[lane] = _mm_aesenc_si128(state[lane], _mm_loadu_si128((__m128i const*)round_keys[lane][round]));
+        for (uint8_t lane = 0; lane < AESNI_LANES; lane++)
+            _mm_storeu_si128((__m128i*)blocks[lane], _mm_aesenclast_si128(state[lane], _mm_loadu_si128((__m128i const*)round_keys[lane][rounds])));
+    }
+}
+
+__attribute__((target("aes"))) void aesni_encrypt_lanes(uint8_t (*blocks) [16], uint8_t const (* const *round_keys) [16], size_t lanes, uint8_t rounds)
+{
+    switch (rounds)
+    {
+    case 10: aesni_encrypt_lanes_rounds(blocks, round_keys, lanes, 10); break;
+    case 12: aesni_encrypt_lanes_rounds(blocks, round_keys, lanes, 12); break;
+    case 14: aesni_encrypt_lanes_rounds(blocks, round_keys, lanes, 14); break;
+    default: bad_rounds(rounds);
+    }
+}
+
+__attribute__((target("aes"))) void aesni_encrypt_blocks(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    switch (rounds)
+    {
+    case 10: aesni_encrypt_blocks_rounds(input, output, blocks, round_keys, 10); break;
+    case 12: aesni_encrypt_blocks_rounds(input, output, blocks, round_keys, 12); break;
+    case 14: aesni_encrypt_blocks_rounds(input, output, blocks, round_keys, 14); break;
+    default: bad_rounds(rounds);
+    }
+}
+
+__attribute__((target("aes"))) void aesni_decrypt_blocks(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    switch (rounds)
+    {
+    case 10: aesni_decrypt_blocks_rounds(input, output, blocks, round_keys, 10); break;
+    case 12: aesni_decrypt_blocks_rounds(input, output, blocks, round_keys, 12); break;
+    case 14: aesni_decrypt_blocks_rounds(input, output, blocks, round_keys, 14); break;
+    default: bad_rounds(rounds);
+    }
+}
+#endif
+
+// Bitsliced AES
+// The T-tables and the S_BOX are indexed with bytes of the state, which depend on the key, and the time a lookup takes depends on
+// whether that part of the table is in the cache, so an attacker measuring the time can learn about the key. Here nothing is looked up.
+// The blocks are transposed so that each of the 128 bits of a block becomes one bit of a word: word 8k + i holds bit i of byte k of
+// AES_BITSLICE_LANES blocks at once, one block per bit. Then subbytes is a boolean circuit of AND, XOR and NOT on 8 words, shiftrows is a
+// renaming of the words, mixcolumn is XORs of them, and the XOR with round key uses each key bit stretched over a whole word.
+// The lane count is a build option: 64 (the default) works on 64 blocks per call with 64-bit words, small 8, 16 or 32-bit cores build
+// with -DAES_BITSLICE_LANES=8 (or 16, 32) to work on that many blocks with their native word size.
+#ifndef AES_BITSLICE_LANES
+#define AES_BITSLICE_LANES 64
+#endif
+#if AES_BITSLICE_LANES == 8
+typedef uint8_t lane_t;
+#elif AES_BITSLICE_LANES == 16
+typedef uint16_t lane_t;
+#elif AES_BITSLICE_LANES == 32
+typedef uint32_t lane_t;
+#elif AES_BITSLICE_LANES == 64
+typedef uint64_t lane_t;
+#else
+#error "AES_BITSLICE_LANES must be 8, 16, 32 or 64"
+#endif
+
+// The S-box circuit of Boyar and Peralta ("A new combinational logic minimization technique with applications to cryptology", 2009),
+// 113 gates: a linear top part, the inversion in GF(2^8) as a small non-linear part, and a linear bottom part that also does the
+// affine transform of subbytes. q[0] is bit 0 (the lowest) of the byte, x0 and s0 are the highest bit as in the paper.
+static inline void bitslice_sbox(lane_t *q)
+{
+    lane_t x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4], x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+
+    // Top linear transformation
+    lane_t y14 = x3 ^ x5, y13 = x0 ^ x6, y9 = x0 ^ x3, y8 = x0 ^ x5;
+    lane_t t0 = x1 ^ x2;
+    lane_t y1 = t0 ^ x7;
+    lane_t y4 = y1 ^ x3, y12 = y13 ^ y14, y2 = y1 ^ x0, y5 = y1 ^ x6;
+    lane_t y3 = y5 ^ y8;
+    lane_t t1 = x4 ^ y12;
+    lane_t y15 = t1 ^ x5, y20 = t1 ^ x1;
+    lane_t y6 = y15 ^ x7, y10 = y15 ^ t0, y11 = y20 ^ y9;
+    lane_t y7 = x7 ^ y11, y17 = y10 ^ y11, y19 = y10 ^ y8, y16 = t0 ^ y11;
+    lane_t y21 = y13 ^ y16, y18 = x0 ^ y16;
+
+    // Non-linear section
+    lane_t t2 = y12 & y15, t3 = y3 & y6;
+    lane_t t4 = t3 ^ t2;
+    lane_t t5 = y4 & x7;
+    lane_t t6 = t5 ^ t2;
+    lane_t t7 = y13 & y16, t8 = y5 & y1;
+    lane_t t9 = t8 ^ t7;
+    lane_t t10 = y2 & y7;
+    lane_t t11 = t10 ^ t7;
+    lane_t t12 = y9 & y11, t13 = y14 & y17;
+    lane_t t14 = t13 ^ t12;
+    lane_t t15 = y8 & y10;
+    lane_t t16 = t15 ^ t12;
+    lane_t t17 = t4 ^ t14, t18 = t6 ^ t16, t19 = t9 ^ t14, t20 = t11 ^ t16;
+    lane_t t21 = t17 ^ y20, t22 = t18 ^ y19, t23 = t19 ^ y21, t24 = t20 ^ y18;
+
+    lane_t t25 = t21 ^ t22, t26 = t21 & t23;
+    lane_t t27 = t24 ^ t26;
+    lane_t t28 = t25 & t27;
+    lane_t t29 = t28 ^ t22, t30 = t23 ^ t24, t31 = t22 ^ t26;
+    lane_t t32 = t31 & t30;
+    lane_t t33 = t32 ^ t24;
+    lane_t t34 = t23 ^ t33, t35 = t27 ^ t33;
+    lane_t t36 = t24 & t35;
+    lane_t t37 = t36 ^ t34, t38 = t27 ^ t36;
+    lane_t t39 = t29 & t38;
+    lane_t t40 = t25 ^ t39;
+
+    lane_t t41 = t40 ^ t37, t42 = t29 ^ t33, t43 = t29 ^ t40, t44 = t33 ^ t37;
+    lane_t t45 = t42 ^ t41;
+    lane_t z0 = t44 & y15, z1 = t37 & y6, z2 = t33 & x7, z3 = t43 & y16, z4 = t40 & y1, z5 = t29 & y7;
+    lane_t z6 = t42 & y11, z7 = t45 & y17, z8 = t41 & y10, z9 = t44 & y12, z10 = t37 & y3, z11 = t33 & y4;
+    lane_t z12 = t43 & y13, z13 = t40 & y5, z14 = t29 & y2, z15 = t42 & y9, z16 = t45 & y14, z17 = t41 & y8;
+
+    // Bottom linear transformation
+    lane_t t46 = z15 ^ z16, t47 = z10 ^ z11, t48 = z5 ^ z13, t49 = z9 ^ z10, t50 = z2 ^ z12;
+    lane_t t51 = z2 ^ z5, t52 = z7 ^ z8, t53 = z0 ^ z3, t54 = z6 ^ z7, t55 = z16 ^ z17;
+    lane_t t56 = z12 ^ t48, t57 = t50 ^ t53, t58 = z4 ^ t46, t59 = z3 ^ t54;
+    lane_t t60 = t46 ^ t57, t61 = z14 ^ t57, t62 = t52 ^ t58, t63 = t49 ^ t58, t64 = z4 ^ t59;
+    lane_t t65 = t61 ^ t62, t66 = z1 ^ t63;
+    lane_t s0 = t59 ^ t63, s6 = t56 ^ ~t62, s7 = t48 ^ ~t60;
+    lane_t t67 = t64 ^ t65;
+    lane_t s3 = t53 ^ t66, s4 = t51 ^ t66, s5 = t47 ^ t65;
+    lane_t s1 = t64 ^ ~s3, s2 = t55 ^ ~t67;
+
+    q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3; q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+// Subbytes is S(x) = A(x^-1) + 0x63 with A the affine matrix, so x^-1 = A^-1(S(x) + 0x63). Writing L(y) = A^-1(y + 0x63), which is
+// rotl1(y) ^ rotl3(y) ^ rotl6(y) ^ 0x05, inverse subbytes is L(S(L(y))) and reuses the same circuit with 20 more gates.
+static inline void bitslice_inverse_affine(lane_t *q)
+{
+    lane_t y[8];
+    for (uint8_t bit = 0; bit < 8; bit++)
+        y[bit] = q[(bit + 7) & 7] ^ q[(bit + 5) & 7] ^ q[(bit + 2) & 7];
+    for (uint8_t bit = 0; bit < 8; bit++)
+        q[bit] = y[bit];
+    q[0] = ~q[0];
+    q[2] = ~q[2];
+}
+
+static inline void bitslice_inverse_sbox(lane_t *q)
+{
+    bitslice_inverse_affine(q);
+    bitslice_sbox(q);
+    bitslice_inverse_affine(q);
+}
+
+// Row r moves left by r places, which in the bitsliced state only moves words around
+static inline void bitslice_shiftrows(lane_t (*state)[8], uint8_t inverse)
+{
+    lane_t old[16][8];
+    memcpy(old, state, sizeof(old));
+    for (uint8_t col = 0; col < 4; col++)
+        for (uint8_t row = 1; row < 4; row++)
+        {
+            uint8_t from = inverse ? (col + 4 - row) % 4 : (col + row) % 4;
+            memcpy(state[4*col + row], old[4*from + row], sizeof(state[0]));
+        }
+}
+
+// The same as multiply() on bitsliced bytes: shift up by one bit and XOR 0x1b in if the top bit was set
+static inline void bitslice_xtime(lane_t const *a, lane_t *out)
+{
+    out[0] = a[7];
+    out[1] = a[0] ^ a[7];
+    out[2] = a[1];
+    out[3] = a[2] ^ a[7];
+    out[4] = a[3] ^ a[7];
+    out[5] = a[4];
+    out[6] = a[5];
+    out[7] = a[6];
+}
+
+// Row r of a column becomes 2 a(r) + 3 a(r+1) + a(r+2) + a(r+3) = x * (a(r) + a(r+1)) + a(r) + (a0 + a1 + a2 + a3)
+static inline void bitslice_mixcolumns(lane_t (*state)[8])
+{
+    for (uint8_t col = 0; col < 4; col++)
+    {
+        lane_t (*a)[8] = state + 4*col;
+        lane_t all[8], pair[8], doubled[8], old[4][8];
+        memcpy(old, a, sizeof(old));
+        for (uint8_t bit = 0; bit < 8; bit++)
+            all[bit] = old[0][bit] ^ old[1][bit] ^ old[2][bit] ^ old[3][bit];
+        for (uint8_t row = 0; row < 4; row++)
+        {
+            for (uint8_t bit = 0; bit < 8; bit++)
+                pair[bit] = old[row][bit] ^ old[(row + 1) % 4][bit];
+            bitslice_xtime(pair, doubled);
+            for (uint8_t bit = 0; bit < 8; bit++)
+                a[row][bit] = doubled[bit] ^ old[row][bit] ^ all[bit];
+        }
+    }
+}
+
+// The inverse mixcolumn matrix (14, 11, 13, 9) is the mixcolumn matrix times (5, 0, 4, 0), so a column is first multiplied by that
+// cheaper matrix: a(r) += x^2 * (a(r) + a(r+2)), and then goes through the normal mixcolumn
+static inline void bitslice_inverse_mixcolumns(lane_t (*state)[8])
+{
+    for (uint8_t col = 0; col < 4; col++)
+    {
+        lane_t (*a)[8] = state + 4*col;
+        for (uint8_t row = 0; row < 2; row++)
+        {
+            lane_t sum[8], once[8], twice[8];
+            for (uint8_t bit = 0; bit < 8; bit++)
+                sum[bit] = a[row][bit] ^ a[row + 2][bit];
+            bitslice_xtime(sum, once);
+            bitslice_xtime(once, twice);
+            for (uint8_t bit = 0; bit < 8; bit++)
+            {
+                a[row][bit] ^= twice[bit];
+                a[row + 2][bit] ^= twice[bit];
+            }
+        }
+    }
+    bitslice_mixcolumns(state);
+}
+
+// Every bit of the round keys is turned into a word of all ones or all zeros without a branch. This is done once per call and not
+// for every group, since it costs about as much as the XORs of all the rounds.
+static inline void bitslice_expand_keys(uint8_t const (*round_keys) [16], uint8_t rounds, lane_t (*keys)[16][8])
+{
+    for (uint8_t round = 0; round <= rounds; round++)
+        for (uint8_t byte = 0; byte < 16; byte++)
+        {
+            lane_t key_byte = round_keys[round][byte];
+#pragma GCC unroll 8
+            for (uint8_t bit = 0; bit < 8; bit++)
+                keys[round][byte][bit] = (lane_t)0 - ((key_byte >> bit) & 1);
+        }
+}
+
+static inline void bitslice_add_round_key(lane_t (*state)[8], lane_t const (*key)[8])
+{
+    for (uint8_t byte = 0; byte < 16; byte++)
+        for (uint8_t bit = 0; bit < 8; bit++)
+            state[byte][bit] ^= key[byte][bit];
+}
+
+// Transposes a square matrix of AES_BITSLICE_LANES x AES_BITSLICE_LANES bits in place, bit b of row r becomes bit r of row b.
+// The top right and bottom left quarters are swapped, then the same is done inside every quarter and so on down to single bits.
+static inline void transpose_lanes(lane_t *rows)
+{
+    lane_t mask = (lane_t)((lane_t)~(lane_t)0 >> (AES_BITSLICE_LANES / 2));
+    for (unsigned half = AES_BITSLICE_LANES / 2; half != 0; half >>= 1, mask ^= (lane_t)(mask << half))
+        for (unsigned start = 0; start < AES_BITSLICE_LANES; start += 2 * half)
+            for (unsigned row = start; row < start + half; row++)
+            {
+                lane_t swap_bits = ((rows[row] >> half) ^ rows[row + half]) & mask;
+                rows[row + half] ^= swap_bits;
+                rows[row] ^= (lane_t)(swap_bits << half);
+            }
+}
+
+// A word from bytes in little-endian order and back, so that bit 8j + i of the word is bit i of byte j on every CPU
+static inline lane_t load_lane(uint8_t const *bytes)
+{
+    lane_t value = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&value, bytes, sizeof(value));
+#else
+    for (uint8_t byte = 0; byte < sizeof(lane_t); byte++)
+        value |= (lane_t)bytes[byte] << (8 * byte);
+#endif
+    return value;
+}
+
+static inline void store_lane(uint8_t *bytes, lane_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(bytes, &value, sizeof(value));
+#else
+    for (uint8_t byte = 0; byte < sizeof(lane_t); byte++)
+        bytes[byte] = (uint8_t)(value >> (8 * byte));
+#endif
+}
+
+// AES_BITSLICE_LANES blocks from input into the bitsliced state. Every block is cut into pieces of one word each (in little-endian
+// order), the pieces at the same place of all the blocks make a square matrix and its transpose gives the words of those bits.
+static inline void bitslice_load(uint8_t const *input, lane_t (*state)[8])
+{
+    lane_t *words = &state[0][0];
+    lane_t rows[AES_BITSLICE_LANES];
+    for (uint8_t piece = 0; piece < 128 / AES_BITSLICE_LANES; piece++)
+    {
+        for (unsigned block = 0; block < AES_BITSLICE_LANES; block++)
+            rows[block] = load_lane(input + 16*block + piece * sizeof(lane_t));
+        transpose_lanes(rows);
+        memcpy(words + piece * AES_BITSLICE_LANES, rows, sizeof(rows));
+    }
+}
+
+static inline void bitslice_store(lane_t (*state)[8], uint8_t *output)
+{
+    lane_t *words = &state[0][0];
+    lane_t rows[AES_BITSLICE_LANES];
+    for (uint8_t piece = 0; piece < 128 / AES_BITSLICE_LANES; piece++)
+    {
+        memcpy(rows, words + piece * AES_BITSLICE_LANES, sizeof(rows));
+        transpose_lanes(rows);
+        for (unsigned block = 0; block < AES_BITSLICE_LANES; block++)
+            store_lane(output + 16*block + piece * sizeof(lane_t), rows[block]);
+    }
+}
+
+// One group of AES_BITSLICE_LANES blocks. Decryption is the plain inverse cipher, so it uses the round keys and not the decryption keys.
+static inline __attribute__((always_inline)) void bitslice_group(uint8_t const *input, uint8_t *output, lane_t const (*keys)[16][8], uint8_t const rounds, uint8_t decrypt)
+{
+    lane_t state[16][8];
+    bitslice_load(input, state);
+    if (!decrypt)
+    {
+        bitslice_add_round_key(state, keys[0]);
+        for (uint8_t round = 1; round <= rounds; round++)
+        {
+            for (uint8_t byte = 0; byte < 16; byte++)
+                bitslice_sbox(state[byte]);
+            bitslice_shiftrows(state, 0);
+            if (round != rounds)
+                bitslice_mixcolumns(state);
+            bitslice_add_round_key(state, keys[round]);
+        }
+    }
+    else
+    {
+        bitslice_add_round_key(state, keys[rounds]);
+        for (uint8_t round = rounds; round > 0; round--)
+        {
+            bitslice_shiftrows(state, 1);
+            for (uint8_t byte = 0; byte < 16; byte++)
+                bitslice_inverse_sbox(state[byte]);
+            bitslice_add_round_key(state, keys[round - 1]);
+            if (round != 1)
+                bitslice_inverse_mixcolumns(state);
+        }
+    }
+    bitslice_store(state, output);
+}
+
+// Full groups are done straight from the input, a last short group is padded with zero blocks
+static inline __attribute__((always_inline)) void bitslice_blocks_rounds(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t const rounds, uint8_t decrypt)
+{
+    lane_t keys[AES_MAX_ROUNDS + 1][16][8];
+    bitslice_expand_keys(round_keys, rounds, keys);
+    for (; blocks >= AES_BITSLICE_LANES; blocks -= AES_BITSLICE_LANES, input += 16*AES_BITSLICE_LANES, output += 16*AES_BITSLICE_LANES)
+        bitslice_group(input, output, (lane_t const (*)[16][8])keys, rounds, decrypt);
+    if (blocks > 0)
+    {
+        uint8_t group[16 * AES_BITSLICE_LANES] = { 0 };
+        memcpy(group, input, 16 * blocks);
+        bitslice_group(group, group, (lane_t const (*)[16][8])keys, rounds, decrypt);
+        memcpy(output, group, 16 * blocks);
+    }
+}
+
+void aes_bitslice_encrypt_blocks(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    switch (rounds)
+    {
+    case 10: bitslice_blocks_rounds(input, output, blocks, round_keys, 10, 0); break;
+    case 12: bitslice_blocks_rounds(input, output, blocks, round_keys, 12, 0); break;
+    case 14: bitslice_blocks_rounds(input, output, blocks, round_keys, 14, 0); break;
+    default: bad_rounds(rounds);
+    }
+}
+
+void aes_bitslice_decrypt_blocks(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    switch (rounds)
+    {
+    case 10: bitslice_blocks_rounds(input, output, blocks, round_keys, 10, 1); break;
+    case 12: bitslice_blocks_rounds(input, output, blocks, round_keys, 12, 1); break;
+    case 14: bitslice_blocks_rounds(input, output, blocks, round_keys, 14, 1); break;
+    default: bad_rounds(rounds);
+    }
+}
+
+// Every lane of a bitsliced word is a block of its own, so the keys do not have to be the same: the round keys of a group of blocks
+// are bitsliced like blocks of data and XORed in as usual. A last short group has zero keys and blocks in its unused lanes.
+void aes_bitslice_encrypt_lanes(uint8_t (*blocks) [16], uint8_t const (* const *round_keys) [16], size_t lanes, uint8_t rounds)
+{
+    lane_t keys[AES_MAX_ROUNDS + 1][16][8];
+    uint8_t group[16 * AES_BITSLICE_LANES];
+    for (size_t first = 0; first < lanes; first += AES_BITSLICE_LANES)
+    {
+        size_t count = lanes - first < AES_BITSLICE_LANES ? lanes - first : AES_BITSLICE_LANES;
+        memset(group, 0, sizeof(group));
+        for (uint8_t round = 0; round <= rounds; round++)
+        {
+            for (size_t lane = 0; lane < count; lane++)
+                memcpy(group + 16*lane, round_keys[first + lane][round], 16);
+            bitslice_load(group, keys[round]);
+        }
+        memcpy(group, blocks[first], 16 * count);
+        bitslice_group(group, group, (lane_t const (*)[16][8])keys, rounds, 0);
+        memcpy(blocks[first], group, 16 * count);
+    }
+}
+
+// A single block costs as much as a whole group, the modes give this kernel many blocks at once wherever they can
+void aes_bitslice_encrypt(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    aes_bitslice_encrypt_blocks(input, output, 1, round_keys, rounds);
+}
+
+void aes_bitslice_decrypt(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    aes_bitslice_decrypt_blocks(input, output, 1, round_keys, rounds);
+}
+
+// Vector permute AES (SSSE3 and AVX2)
+// PSHUFB looks up 16 bytes at once in a 16 byte table held in a register, every byte of the index register picks one entry (and an
+// index with its top bit set gives 0). So any function of 4 bits can be done on all 16 bytes of a block with one instruction and no
+// memory access that depends on the data, which keeps this kernel constant time like the bitsliced one. Shiftrows and the rotations
+// of the column inside mixcolumn only move bytes around, so each of them is a PSHUFB with a fixed index.
+// Subbytes is the hard part because the inverse in GF(2^8) is a function of 8 bits. Following Hamburg ("Accelerating AES with Vector
+// Permute Instructions", 2009) the byte is first moved (by a linear map, done as one lookup per nibble) into a field built on top of
+// GF(2^4) = GF(2)[x]/(x^4 + x + 1): the elements are i v + k with i, k in GF(2^4) and v a root of v^2 + a v + a, where a is the first
+// value for which that has no root in GF(2^4). There the inverse is 1/(i v + k) = (i v + a i + k) / N with N = a i^2 + a i k + k^2, and
+// with j = i + k the two values
+//      io = 1/(1/i + a/k) + j = N / (k + a i)          jo = 1/(1/j + a/k) + i = N / (k + a j)
+// take only inverses in GF(2^4) and XORs, so five lookups in all. 1/io and 1/jo are linear in the two halves of the inverse, which makes
+// the inverse a sum F(io) + G(jo) of a function of each, and the output tables hold those functions already moved back to the AES
+// field and through the affine transform of subbytes (and multiplied by the mixcolumn factors). A zero anywhere on the way becomes
+// an index with the top bit set, which is exactly what makes the lookups give the right answer for it.
+// With AVX2 the same instructions work on 256-bit registers as two separate 128-bit halves, so every instruction does two blocks.
+// All the tables are filled once by generate_vperm_tables().
+#ifdef AES_X86
+uint8_t VPERM_INPUT[2][16] __attribute__((aligned(16)));          // AES field to the GF(2^4) field, by low and by high nibble
+uint8_t VPERM_DEC_INPUT[2][16] __attribute__((aligned(16)));      // The same after undoing the affine transform, for inverse subbytes
+uint8_t VPERM_INV[16] __attribute__((aligned(16)));               // 1/n in GF(2^4)
+uint8_t VPERM_DIV_A[16] __attribute__((aligned(16)));             // a/n in GF(2^4)
+uint8_t VPERM_SBOX[2][2][16] __attribute__((aligned(16)));        // Subbytes without the 0x63, times 1 and times 2, from io and jo
+uint8_t VPERM_DEC_SBOX[5][2][16] __attribute__((aligned(16)));    // Inverse subbytes times 1, 14, 11, 13 and 9, from io and jo
+uint8_t VPERM_SHIFT[4][16] __attribute__((aligned(16)));          // Shiftrows followed by moving every column up by 0 to 3 rows
+uint8_t VPERM_DEC_SHIFT[4][16] __attribute__((aligned(16)));      // The same for inverse shiftrows
+
+// Multiplication in GF(2^4) modulo x^4 + x + 1, the same way as multiply() in GF(2^8)
+uint8_t gf16_multiply(uint8_t val, uint8_t factor)
+{
+    uint8_t result = 0;
+    for (uint8_t bit = 0; bit < 4; bit++)
+    {
+        if (factor & (1 << bit))
+            result ^= val;
+        val = (val & 8) ? ((val << 1) ^ 0x13) : (val << 1);
+    }
+    return result;
+}
+
+uint8_t gf16_inverse(uint8_t val)
+{
+    for (uint8_t itr = 1; itr < 16; itr++)
+        if (gf16_multiply(val, itr) == 1)
+            return itr;
+    return 0;
+}
+
+// Multiplication of i v + k (stored as i in the high nibble and k in the low one) using v^2 = a v + a
+uint8_t tower_multiply(uint8_t x, uint8_t y, uint8_t a)
+{
+    uint8_t ii = gf16_multiply(gf16_multiply(x >> 4, y >> 4), a);
+    uint8_t high = ii ^ gf16_multiply(x >> 4, y & 15) ^ gf16_multiply(x & 15, y >> 4);
+    uint8_t low = ii ^ gf16_multiply(x & 15, y & 15);
+    return (uint8_t)((high << 4) | low);
+}
+
+// val times factor in GF(2^8), with multiply() for every power of x in the factor
+uint8_t gf_multiply(uint8_t val, uint8_t factor)
+{
+    uint8_t result = 0;
+    for (; factor; factor >>= 1, val = multiply(val))
+        if (factor & 1)
+            result ^= val;
+    return result;
+}
+
+static inline uint8_t rotate_byte(uint8_t val, uint8_t count)
+{
+    return (uint8_t)((val << count) | (val >> (8 - count)));
+}
+
+void generate_vperm_tables()
+{
+    // The first a for which v^2 + a v + a has no root in GF(2^4)
+    uint8_t a = 1;
+    for (uint8_t irreducible = 0; !irreducible; )
+    {
+        a++;
+        irreducible = 1;
+        for (uint8_t y = 0; y < 16; y++)
+            if ((gf16_multiply(y, y) ^ gf16_multiply(a, y) ^ a) == 0)
+                irreducible = 0;
+    }
+
+    // The AES field is GF(2)[x]/(x^8 + x^4 + x^3 + x + 1), so a root g of that polynomial in the new field gives the map
+    // sum of b(n) x^n -> sum of b(n) g^n. It keeps additions and multiplications, so it also keeps inverses.
+    uint8_t powers[8], to_tower[256], from_tower[256];
+    for (uint16_t g = 2; g < 256; g++)
+    {
+        powers[0] = 1;
+        for (uint8_t itr = 1; itr < 8; itr++)
+            powers[itr] = tower_multiply(powers[itr - 1], g, a);
+        if ((tower_multiply(powers[7], g, a) ^ powers[4] ^ powers[3] ^ powers[1] ^ 1) == 0)
+            break;
+    }
+    for (uint16_t val = 0; val < 256; val++)
+    {
+        to_tower[val] = 0;
+        for (uint8_t bit = 0; bit < 8; bit++)
+            if (val & (1 << bit))
+                to_tower[val] ^= powers[bit];
+        from_tower[to_tower[val]] = val;
+    }
+
+    for (uint8_t nibble = 0; nibble < 16; nibble++)
+    {
+        // Subbytes is affine(1/b) + 0x63 with affine(b) = b + rotl1(b) + rotl2(b) + rotl3(b) + rotl4(b), inverse subbytes undoes the
+        // affine part first with rotl1(b) + rotl3(b) + rotl6(b) + 0x05 (0x05 is where the 0x63 goes)
+        uint8_t low = nibble, high = nibble << 4;
+        VPERM_INPUT[0][nibble] = to_tower[low];
+        VPERM_INPUT[1][nibble] = to_tower[high];
+        VPERM_DEC_INPUT[0][nibble] = to_tower[rotate_byte(low, 1) ^ rotate_byte(low, 3) ^ rotate_byte(low, 6) ^ 0x05];
+        VPERM_DEC_INPUT[1][nibble] = to_tower[rotate_byte(high, 1) ^ rotate_byte(high, 3) ^ rotate_byte(high, 6)];
+
+        uint8_t inverse = gf16_inverse(nibble);
+        VPERM_INV[nibble] = nibble ? inverse : 0x80;
+        VPERM_DIV_A[nibble] = nibble ? gf16_multiply(a, inverse) : 0x80;
+
+        // With u = 1/io and w = 1/jo the inverse is (u (a + 1) / a^2 + w / a^2) v + u, split into the part of io and the part of jo
+        uint8_t a2_inverse = gf16_inverse(gf16_multiply(a, a));
+        uint8_t parts[2] = {
+            from_tower[(gf16_multiply(gf16_multiply(a ^ 1, a2_inverse), inverse) << 4) | inverse],
+            from_tower[gf16_multiply(a2_inverse, inverse) << 4]
+        };
+        uint8_t const dec_factors[5] = {1, 14, 11, 13, 9};
+        for (uint8_t part = 0; part < 2; part++)
+        {
+            uint8_t val = parts[part];
+            uint8_t affine = val ^ rotate_byte(val, 1) ^ rotate_byte(val, 2) ^ rotate_byte(val, 3) ^ rotate_byte(val, 4);
+            VPERM_SBOX[0][part][nibble] = affine;
+            VPERM_SBOX[1][part][nibble] = multiply(affine);
+            for (uint8_t factor = 0; factor < 5; factor++)
+                VPERM_DEC_SBOX[factor][part][nibble] = gf_multiply(val, dec_factors[factor]);
+        }
+    }
+
+    // Byte 4c + r of the block is row r of column c. Shiftrows brings row r of column c + r into column c, and moving the column up by
+    // n rows then brings row r + n there, so the byte comes from column c + r + n (c - r - n for inverse shiftrows) and row r + n.
+    for (uint8_t column = 0; column < 4; column++)
+        for (uint8_t row = 0; row < 4; row++)
+            for (uint8_t up = 0; up < 4; up++)
+            {
+                VPERM_SHIFT[up][4*column + row] = 4*((column + row + up) & 3) + ((row + up) & 3);
+                VPERM_DEC_SHIFT[up][4*column + row] = 4*((column - row - up) & 3) + ((row + up) & 3);
+            }
+}
+
+// The tables in registers, loaded once per call
+typedef struct
+{
+    __m128i mask, input[2], inv, div_a, sbox[5][2], shift[4];
+} vperm_regs;
+
+__attribute__((target("ssse3"))) static inline __attribute__((always_inline)) void vperm_load_regs(vperm_regs *regs, uint8_t decrypt)
+{
+    regs->mask = _mm_set1_epi8(0x0f);
+    regs->inv = _mm_load_si128((__m128i const*)VPERM_INV);
+    regs->div_a = _mm_load_si128((__m128i const*)VPERM_DIV_A);
+    for (uint8_t part = 0; part < 2; part++)
+        regs->input[part] = _mm_load_si128((__m128i const*)(decrypt ? VPERM_DEC_INPUT[part] : VPERM_INPUT[part]));
+    for (uint8_t factor = 0; factor < (decrypt ? 5 : 2); factor++)
+        for (uint8_t part = 0; part < 2; part++)
+            regs->sbox[factor][part] = _mm_load_si128((__m128i const*)(decrypt ? VPERM_DEC_SBOX[factor][part] : VPERM_SBOX[factor][part]));
+    for (uint8_t up = 0; up < 4; up++)
+        regs->shift[up] = _mm_load_si128((__m128i const*)(decrypt ? VPERM_DEC_SHIFT[up] : VPERM_SHIFT[up]));
+}
+
+// One round on one block: (inverse) subbytes, (inverse) shiftrows, (inverse) mixcolumn unless it is the last round, and the XOR with
+// the key. For encryption the key has the 0x63 of subbytes in it (mixcolumn keeps a column of 0x63 as it is).
+__attribute__((target("ssse3"))) static inline __attribute__((always_inline)) __m128i vperm_round(vperm_regs const *regs, __m128i state, __m128i key, uint8_t last, uint8_t decrypt)
+{
+    // Into the GF(2^4) field and split into the i (high) and k (low) nibbles
+    state = _mm_xor_si128(_mm_shuffle_epi8(regs->input[0], _mm_and_si128(state, regs->mask)),
+                          _mm_shuffle_epi8(regs->input[1], _mm_and_si128(_mm_srli_epi16(state, 4), regs->mask)));
+    __m128i i = _mm_and_si128(_mm_srli_epi16(state, 4), regs->mask);
+    __m128i k = _mm_and_si128(state, regs->mask);
+    __m128i j = _mm_xor_si128(i, k);
+
+    __m128i a_k = _mm_shuffle_epi8(regs->div_a, k);
+    __m128i iak = _mm_xor_si128(_mm_shuffle_epi8(regs->inv, i), a_k);
+    __m128i jak = _mm_xor_si128(_mm_shuffle_epi8(regs->inv, j), a_k);
+    __m128i io = _mm_xor_si128(_mm_shuffle_epi8(regs->inv, iak), j);
+    __m128i jo = _mm_xor_si128(_mm_shuffle_epi8(regs->inv, jak), i);
+
+#define VPERM_SBOX_TIMES(factor) _mm_xor_si128(_mm_shuffle_epi8(regs->sbox[factor][0], io), _mm_shuffle_epi8(regs->sbox[factor][1], jo))
+    if (last)
+        state = _mm_shuffle_epi8(VPERM_SBOX_TIMES(0), regs->shift[0]);
+    else if (!decrypt)
+    {
+        // 2 s(r) + 3 s(r+1) + s(r+2) + s(r+3)
+        __m128i s = VPERM_SBOX_TIMES(0), s2 = VPERM_SBOX_TIMES(1);
+        state = _mm_xor_si128(_mm_xor_si128(_mm_shuffle_epi8(s2, regs->shift[0]), _mm_shuffle_epi8(_mm_xor_si128(s2, s), regs->shift[1])),
+                              _mm_xor_si128(_mm_shuffle_epi8(s, regs->shift[2]), _mm_shuffle_epi8(s, regs->shift[3])));
+    }
+    else
+    {
+        // 14 s(r) + 11 s(r+1) + 13 s(r+2) + 9 s(r+3)
+        state = _mm_xor_si128(_mm_xor_si128(_mm_shuffle_epi8(VPERM_SBOX_TIMES(1), regs->shift[0]), _mm_shuffle_epi8(VPERM_SBOX_TIMES(2), regs->shift[1])),
+                              _mm_xor_si128(_mm_shuffle_epi8(VPERM_SBOX_TIMES(3), regs->shift[2]), _mm_shuffle_epi8(VPERM_SBOX_TIMES(4), regs->shift[3])));
+    }
+#undef VPERM_SBOX_TIMES
+    return _mm_xor_si128(state, key);
+}
+
+// The 256-bit versions of the above for AVX2, every table is there twice so that both halves see it
+typedef struct
+{
+    __m256i mask, input[2], inv, div_a, sbox[5][2], shift[4];
+} vperm_regs_avx2;
+
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) __m256i vperm_broadcast(uint8_t const *table)
+{
+    return _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const*)table));
+}
+
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) void vperm_load_regs_avx2(vperm_regs_avx2 *regs, uint8_t decrypt)
+{
+    regs->mask = _mm256_set1_epi8(0x0f);
+    regs->inv = vperm_broadcast(VPERM_INV);
+    regs->div_a = vperm_broadcast(VPERM_DIV_A);
+    for (uint8_t part = 0; part < 2; part++)
+        regs->input[part] = vperm_broadcast(decrypt ? VPERM_DEC_INPUT[part] : VPERM_INPUT[part]);
+    for (uint8_t factor = 0; factor < (decrypt ? 5 : 2); factor++)
+        for (uint8_t part = 0; part < 2; part++)
+            regs->sbox[factor][part] = vperm_broadcast(decrypt ? VPERM_DEC_SBOX[factor][part] : VPERM_SBOX[factor][part]);
+    for (uint8_t up = 0; up < 4; up++)
+        regs->shift[up] = vperm_broadcast(decrypt ? VPERM_DEC_SHIFT[up] : VPERM_SHIFT[up]);
+}
+
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) __m256i vperm_round_avx2(vperm_regs_avx2 const *regs, __m256i state, __m256i key, uint8_t last, uint8_t decrypt)
+{
+    state = _mm256_xor_si256(_mm256_shuffle_epi8(regs->input[0], _mm256_and_si256(state, regs->mask)),
+                             _mm256_shuffle_epi8(regs->input[1], _mm256_and_si256(_mm256_srli_epi16(state, 4), regs->mask)));
+    __m256i i = _mm256_and_si256(_mm256_srli_epi16(state, 4), regs->mask);
+    __m256i k = _mm256_and_si256(state, regs->mask);
+    __m256i j = _mm256_xor_si256(i, k);
+
+    __m256i a_k = _mm256_shuffle_epi8(regs->div_a, k);
+    __m256i iak = _mm256_xor_si256(_mm256_shuffle_epi8(regs->inv, i), a_k);
+    __m256i jak = _mm256_xor_si256(_mm256_shuffle_epi8(regs->inv, j), a_k);
+    __m256i io = _mm256_xor_si256(_mm256_shuffle_epi8(regs->inv, iak), j);
+    __m256i jo = _mm256_xor_si256(_mm256_shuffle_epi8(regs->inv, jak), i);
+
+#define VPERM_SBOX_TIMES(factor) _mm256_xor_si256(_mm256_shuffle_epi8(regs->sbox[factor][0], io), _mm256_shuffle_epi8(regs->sbox[factor][1], jo))
+    if (last)
+        state = _mm256_shuffle_epi8(VPERM_SBOX_TIMES(0), regs->shift[0]);
+    else if (!decrypt)
+    {
+        __m256i s = VPERM_SBOX_TIMES(0), s2 = VPERM_SBOX_TIMES(1);
+        state = _mm256_xor_si256(_mm256_xor_si256(_mm256_shuffle_epi8(s2, regs->shift[0]), _mm256_shuffle_epi8(_mm256_xor_si256(s2, s), regs->shift[1])),
+                                 _mm256_xor_si256(_mm256_shuffle_epi8(s, regs->shift[2]), _mm256_shuffle_epi8(s, regs->shift[3])));
+    }
+    else
+    {
+        state = _mm256_xor_si256(_mm256_xor_si256(_mm256_shuffle_epi8(VPERM_SBOX_TIMES(1), regs->shift[0]), _mm256_shuffle_epi8(VPERM_SBOX_TIMES(2), regs->shift[1])),
+                                 _mm256_xor_si256(_mm256_shuffle_epi8(VPERM_SBOX_TIMES(3), regs->shift[2]), _mm256_shuffle_epi8(VPERM_SBOX_TIMES(4), regs->shift[3])));
+    }
+#undef VPERM_SBOX_TIMES
+    return _mm256_xor_si256(state, key);
+}
+
+// The keys in the order they are used: the decryption keys for decryption (the rounds have the shape of the equivalent inverse cipher),
+// and for encryption the round keys with 0x63 added to all but the first
+__attribute__((target("ssse3"))) static inline __attribute__((always_inline)) void vperm_load_keys(uint8_t const (*round_keys) [16], uint8_t const rounds, uint8_t decrypt, __m128i *keys)
+{
+    for (uint8_t round = 0; round <= rounds; round++)
+    {
+        keys[round] = _mm_loadu_si128((__m128i const*)round_keys[decrypt ? DEC_KEYS + round : round]);
+        if (!decrypt && round > 0)
+            keys[round] = _mm_xor_si128(keys[round], _mm_set1_epi8(0x63));
+    }
+}
+
+// Like the AES-NI kernel this works on several independent blocks at once so that the shuffles of one can run while another waits
+#define VPERM_LANES 4
+
+__attribute__((target("ssse3"))) static inline __attribute__((always_inline)) void vperm_blocks_rounds(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t const rounds, uint8_t decrypt)
+{
+    vperm_regs regs;
+    __m128i keys[AES_MAX_ROUNDS + 1], state[VPERM_LANES];
+    vperm_load_regs(&regs, decrypt);
+    vperm_load_keys(round_keys, rounds, decrypt, keys);
+    for (; blocks >= VPERM_LANES; blocks -= VPERM_LANES, input += 16*VPERM_LANES, output += 16*VPERM_LANES)
+    {
+        for (uint8_t lane = 0; lane < VPERM_LANES; lane++)
+            state[lane] = _mm_xor_si128(_mm_loadu_si128((__m128i const*)(input + 16*lane)), keys[0]);
+#pragma GCC unroll 14
+        for (uint8_t round = 1; round < rounds; round++)
+            for (uint8_t lane = 0; lane < VPERM_LANES; lane++)
+                state[lane] = vperm_round(&regs, state[lane], keys[round], 0, decrypt);
+        for (uint8_t lane = 0; lane < VPERM_LANES; lane++)
+            _mm_storeu_si128((__m128i*)(output + 16*lane), vperm_round(&regs, state[lane], keys[rounds], 1, decrypt));
+    }
+    for (; blocks > 0; blocks--, input += 16, output += 16)
+    {
+        state[0] = _mm_xor_si128(_mm_loadu_si128((__m128i const*)input), keys[0]);
+#pragma GCC unroll 14
+        for (uint8_t round = 1; round < rounds; round++)
+            state[0] = vperm_round(&regs, state[0], keys[round], 0, decrypt);
+        _mm_storeu_si128((__m128i*)output, vperm_round(&regs, state[0], keys[rounds], 1, decrypt));
+    }
+}
+
+// Two blocks per register and VPERM_LANES registers at once, a last odd block goes through the 128-bit version
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) void vperm_avx2_blocks_rounds(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t const rounds, uint8_t decrypt)
+{
+    vperm_regs_avx2 regs;
+    __m128i keys_128[AES_MAX_ROUNDS + 1];
+    __m256i keys[AES_MAX_ROUNDS + 1], state[VPERM_LANES];
+    vperm_load_regs_avx2(&regs, decrypt);
+    vperm_load_keys(round_keys, rounds, decrypt, keys_128);
+    for (uint8_t round = 0; round <= rounds; round++)
+        keys[round] = _mm256_broadcastsi128_si256(keys_128[round]);
+    for (; blocks >= 2*VPERM_LANES; blocks -= 2*VPERM_LANES, input += 32*VPERM_LANES, output += 32*VPERM_LANES)
+    {
+        for (uint8_t lane = 0; lane < VPERM_LANES; lane++)
+            state[lane] = _mm256_xor_si256(_mm256_loadu_si256((__m256i const*)(input + 32*lane)), keys[0]);
+#pragma GCC unroll 14
+        for (uint8_t round = 1; round < rounds; round++)
+            for (uint8_t lane = 0; lane < VPERM_LANES; lane++)
+                state[lane] = vperm_round_avx2(&regs, state[lane], keys[round], 0, decrypt);
+        for (uint8_t lane = 0; lane < VPERM_LANES; lane++)
+            _mm256_storeu_si256((__m256i*)(output + 32*lane), vperm_round_avx2(&regs, state[lane], keys[rounds], 1, decrypt));
+    }
+    for (; blocks >= 2; blocks -= 2, input += 32, output += 32)
+    {
+        state[0] = _mm256_xor_si256(_mm256_loadu_si256((__m256i const*)input), keys[0]);
+#pragma GCC unroll 14
+        for (uint8_t round = 1; round < rounds; round++)
+            state[0] = vperm_round_avx2(&regs, state[0], keys[round], 0, decrypt);
+        _mm256_storeu_si256((__m256i*)output, vperm_round_avx2(&regs, state[0], keys[rounds], 1, decrypt));
+    }
+    if (blocks > 0)
+        vperm_blocks_rounds(input, output, 1, round_keys, rounds, decrypt);
+}
+
+#define VPERM_SWITCH(fun, decrypt) \
+    switch (rounds) \
+    { \
+    case 10: fun(input, output, blocks, round_keys, 10, decrypt); break; \
+    case 12: fun(input, output, blocks, round_keys, 12, decrypt); break; \
+    case 14: fun(input, output, blocks, round_keys, 14, decrypt); break; \
+    default: bad_rounds(rounds); \
+    }
+
+__attribute__((target("ssse3"))) void vperm_encrypt_blocks(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    VPERM_SWITCH(vperm_blocks_rounds, 0)
+}
+
+__attribute__((target("ssse3"))) void vperm_decrypt_blocks(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    VPERM_SWITCH(vperm_blocks_rounds, 1)
+}
+
+__attribute__((target("avx2"))) void vperm_avx2_encrypt_blocks(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    VPERM_SWITCH(vperm_avx2_blocks_rounds, 0)
+}
+
+__attribute__((target("avx2"))) void vperm_avx2_decrypt_blocks(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    VPERM_SWITCH(vperm_avx2_blocks_rounds, 1)
+}
+
+// One block for each of the given keys, VPERM_LANES at a time. The round keys are loaded (and get their 0x63) on the way.
+__attribute__((target("ssse3"))) static inline __attribute__((always_inline)) void vperm_lanes_rounds(uint8_t (*blocks) [16], uint8_t const (* const *round_keys) [16], size_t lanes, uint8_t const rounds)
+{
+    vperm_regs regs;
+    __m128i state[VPERM_LANES], sbox_constant = _mm_set1_epi8(0x63);
+    vperm_load_regs(&regs, 0);
+    for (; lanes > 0; lanes -= VPERM_LANES, blocks += VPERM_LANES, round_keys += VPERM_LANES)
+    {
+        for (uint8_t lane = 0; lane < VPERM_LANES; lane++)
+            state[lane] = _mm_xor_si128(_mm_loadu_si128((__m128i const*)blocks[lane]), _mm_loadu_si128((__m128i const*)round_keys[lane][0]));
+#pragma GCC unroll 14
+        for (uint8_t round = 1; round <= rounds; round++)
+            for (uint8_t lane = 0; lane < VPERM_LANES; lane++)
+                state[lane] = vperm_round(&regs, state[lane], _mm_xor_si128(_mm_loadu_si128((__m128i const*)round_keys[lane][round]), sbox_constant), round == rounds, 0);
+        for (uint8_t lane = 0; lane < VPERM_LANES; lane++)
+            _mm_storeu_si128((__m128i*)blocks[lane], state[lane]);
+    }
+}
+
+// With AVX2 two neighbouring lanes share a register, and their keys are put together for every round
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) void vperm_avx2_lanes_rounds(uint8_t (*blocks) [16], uint8_t const (* const *round_keys) [16], size_t lanes, uint8_t const rounds)
+{
+    vperm_regs_avx2 regs;
+    __m256i state[VPERM_LANES / 2], sbox_constant = _mm256_set1_epi8(0x63);
+    vperm_load_regs_avx2(&regs, 0);
+#define VPERM_LANE_KEYS(pair, round) _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const*)round_keys[2*(pair)][round])), \
+                                                             _mm_loadu_si128((__m128i const*)round_keys[2*(pair) + 1][round]), 1)
+    for (; lanes > 0; lanes -= VPERM_LANES, blocks += VPERM_LANES, round_keys += VPERM_LANES)
+    {
+        for (uint8_t pair = 0; pair < VPERM_LANES / 2; pair++)
+            state[pair] = _mm256_xor_si256(_mm256_loadu_si256((__m256i const*)blocks[2*pair]), VPERM_LANE_KEYS(pair, 0));
+#pragma GCC unroll 14
+        for (uint8_t round = 1; round <= rounds; round++)
+            for (uint8_t pair = 0; pair < VPERM_LANES / 2; pair++)
+                state[pair] = vperm_round_avx2(&regs, state[pair], _mm256_xor_si256(VPERM_LANE_KEYS(pair, round), sbox_constant), round == rounds, 0);
+        for (uint8_t pair = 0; pair < VPERM_LANES / 2; pair++)
+            _mm256_storeu_si256((__m256i*)blocks[2*pair], state[pair]);
+    }
+#undef VPERM_LANE_KEYS
+}
+
+#define VPERM_LANES_SWITCH(fun) \
+    switch (rounds) \
+    { \
+    case 10: fun(blocks, round_keys, lanes, 10); break; \
+    case 12: fun(blocks, round_keys, lanes, 12); break; \
+    case 14: fun(blocks, round_keys, lanes, 14); break; \
+    default: bad_rounds(rounds); \
+    }
+
+__attribute__((target("ssse3"))) void vperm_encrypt_lanes(uint8_t (*blocks) [16], uint8_t const (* const *round_keys) [16], size_t lanes, uint8_t rounds)
+{
+    VPERM_LANES_SWITCH(vperm_lanes_rounds)
+}
+
+__attribute__((target("avx2"))) void vperm_avx2_encrypt_lanes(uint8_t (*blocks) [16], uint8_t const (* const *round_keys) [16], size_t lanes, uint8_t rounds)
+{
+    VPERM_LANES_SWITCH(vperm_avx2_lanes_rounds)
+}
+
+// A single block, which is the same with or without AVX2
+void vperm_encrypt(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    vperm_encrypt_blocks(input, output, 1, round_keys, rounds);
+}
+
+void vperm_decrypt(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    vperm_decrypt_blocks(input, output, 1, round_keys, rounds);
+}
+#endif
+
+// All the implementations of the block functions, from the least to the most preferred: mostly from the slowest to the fastest, but the
+// bitsliced one comes after the T-tables although it is slower, as its timing does not depend on the key. They take the schedule made
+// by key_scheduling_fun() and allow the input and output to be the same buffer. The "blocks" versions take many independent blocks in one call so that an
+// implementation can work on several of them at once, and the "lanes" version encrypts a multiple of 8 blocks (at most MULTI_LANES) in
+// place, each with its own key. The multi-buffer CBC gives it as many blocks at once as the kernel likes best.
+// aes_init() marks the ones this CPU can run, the benchmark goes through all of them.
+typedef void (*block_fun)(uint8_t const *input, uint8_t *output, uint8_t const (*round_keys) [16], uint8_t rounds);
+typedef void (*blocks_fun)(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t rounds);
+typedef void (*lanes_fun)(uint8_t (*blocks) [16], uint8_t const (* const *round_keys) [16], size_t lanes, uint8_t rounds);
+typedef struct
+{
+    char const *name;
+    block_fun encrypt;
+    block_fun decrypt;          // NULL when the implementation has no decryption of its own
+    blocks_fun encrypt_blocks;  // NULL when the blocks are simply done one by one
+    blocks_fun decrypt_blocks;
+    lanes_fun encrypt_lanes;    // NULL when the lanes are simply done one by one
+    uint8_t lanes;              // The no. of lanes that keeps encrypt_lanes busy
+    uint8_t available;
+} aes_kernel;
+
+aes_kernel KERNELS[] = {
+    { "reference", aes_encrypt_reference, aes_decrypt_reference, NULL, NULL, NULL, 8, 1 },
+    { "ttable", aes_ttable, aes_ttable_decrypt, NULL, NULL, NULL, 8, 1 },
+    { "bitslice", aes_bitslice_encrypt, aes_bitslice_decrypt, aes_bitslice_encrypt_blocks, aes_bitslice_decrypt_blocks, aes_bitslice_encrypt_lanes, AES_BITSLICE_LANES, 1 },
+#ifdef AES_X86
+    { "vperm", vperm_encrypt, vperm_decrypt, vperm_encrypt_blocks, vperm_decrypt_blocks, vperm_encrypt_lanes, 8, 0 },
+    { "vperm-avx2", vperm_encrypt, vperm_decrypt, vperm_avx2_encrypt_blocks, vperm_avx2_decrypt_blocks, vperm_avx2_encrypt_lanes, 8, 0 },
+    { "aesni", aesni_encrypt, aesni_decrypt, aesni_encrypt_blocks, aesni_decrypt_blocks, aesni_encrypt_lanes, AESNI_LANES, 0 },
+#endif
+};
+#define KERNEL_COUNT (sizeof(KERNELS) / sizeof(KERNELS[0]))
+
+// The block encryption and decryption to be used when speed matters. They point to the fastest available implementation,
+// which is chosen once by aes_init(). aes() and aes_decrypt() stay as the byte wise reference (with the round by round output).
+uint8_t aesni_available = 0, pclmul_available = 0, ssse3_available = 0, avx2_available = 0;
+block_fun aes_encrypt_block = aes_ttable;
+block_fun aes_decrypt_block = aes_ttable_decrypt;
+blocks_fun aes_encrypt_blocks;
+blocks_fun aes_decrypt_blocks;
+lanes_fun aes_encrypt_lanes;
+size_t aes_lane_count = 8;
+
+// Used for implementations that have no blocks version of their own
+void encrypt_blocks_one_by_one(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    for (size_t itr = 0; itr < blocks; itr++)
+        aes_encrypt_block(input + 16*itr, output + 16*itr, round_keys, rounds);
+}
+
+void decrypt_blocks_one_by_one(uint8_t const *input, uint8_t *output, size_t blocks, uint8_t const (*round_keys) [16], uint8_t rounds)
+{
+    for (size_t itr = 0; itr < blocks; itr++)
+        aes_decrypt_block(input + 16*itr, output + 16*itr, round_keys, rounds);
+}
+
+void encrypt_lanes_one_by_one(uint8_t (*blocks) [16], uint8_t const (* const *round_keys) [16], size_t lanes, uint8_t rounds)
+{
+    for (size_t lane = 0; lane < lanes; lane++)
+        aes_encrypt_block(blocks[lane], blocks[lane], round_keys[lane], rounds);
+}
+
+// Points the block functions to the given implementation, its decryption is only used if it has one
+void use_kernel(aes_kernel const *kernel)
+{
+    aes_encrypt_block = kernel->encrypt;
+    aes_encrypt_blocks = kernel->encrypt_blocks ? kernel->encrypt_blocks : encrypt_blocks_one_by_one;
+    aes_encrypt_lanes = kernel->encrypt_lanes ? kernel->encrypt_lanes : encrypt_lanes_one_by_one;
+    aes_lane_count = kernel->lanes;
+    if (kernel->decrypt)
+    {
+        aes_decrypt_block = kernel->decrypt;
+        aes_decrypt_blocks = kernel->decrypt_blocks ? kernel->decrypt_blocks : decrypt_blocks_one_by_one;
+    }
+}
+
+// Points the block functions back to the fastest implementations this CPU has
+void use_best_kernels()
+{
+    for (size_t itr = 0; itr < KERNEL_COUNT; itr++)
+        if (KERNELS[itr].available)
+            use_kernel(&KERNELS[itr]);
+}
+
+// Looks up an implementation by its name, NULL if there is none or this CPU cannot run it
+aes_kernel *find_kernel(char const *name)
+{
+    for (size_t itr = 0; itr < KERNEL_COUNT; itr++)
+        if (KERNELS[itr].available && strcmp(KERNELS[itr].name, name) == 0)
+            return &KERNELS[itr];
+    return NULL;
+}
+
+// This checks the CPU (CPUID leaf 1, ECX bit 25) for AES-NI, and for PCLMULQDQ (bit 1) with SSSE3 (bit 9) for the GCM hash.
+// AVX2 is leaf 7, EBX bit 5, and it can only be used if the OS saves the 256-bit registers too (OSXSAVE, then bits 1 and 2 of XCR0).
+void detect_cpu()
+{
+#ifdef AES_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        aesni_available = (ecx & bit_AES) != 0;
+        pclmul_available = (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+        ssse3_available = (ecx & bit_SSSE3) != 0;
+        if (ecx & bit_OSXSAVE)
+        {
+            unsigned int xcr0, xcr0_high;
+            __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_high) : "c" (0));
+            if ((xcr0 & 6) == 6 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+                avx2_available = (ebx & bit_AVX2) != 0;
+        }
+    }
+#endif
+}
+
+void use_best_ghash();
+void use_best_key_expansion();
+
+// The tables and the CPU check are needed before any encryption is done, so they are done once when the program is loaded
+__attribute__((constructor)) void aes_init()
+{
+    generate_enc_tables();
+    generate_dec_tables();
+    detect_cpu();
+#ifdef AES_X86
+    generate_vperm_tables();
+    for (size_t itr = 0; itr < KERNEL_COUNT; itr++)
+    {
+        if (KERNELS[itr].encrypt == aesni_encrypt)
+            KERNELS[itr].available = aesni_available;
+        else if (KERNELS[itr].encrypt_blocks == vperm_encrypt_blocks)
+            KERNELS[itr].available = ssse3_available;
+        else if (KERNELS[itr].encrypt_blocks == vperm_avx2_encrypt_blocks)
+            KERNELS[itr].available = avx2_available;
+    }
+#endif
+    use_best_kernels();
+    use_best_ghash();
+    use_best_key_expansion();
+}
+
+// Context interface
+// key_scheduling_fun() allocates the round keys and aes()/aes_decrypt() allocate their output, which is fine for one block but not
+// when millions of small records go through. An aes_ctx holds the expanded key itself so it can be put on the stack, inside another
+// struct or in an arena, and the functions below write into buffers given by the caller. None of them touch the heap.
+// The rows are aligned to 16 bytes so that the AES-NI kernels load them from a single cache line each.
+typedef struct
+{
+    uint8_t round_keys[SCHEDULE_ROWS][16] __attribute__((aligned(16)));   // the round keys, then the decryption keys from row DEC_KEYS
+    uint8_t rounds;                                                         // 10, 12 or 14
+} aes_ctx;
+
+int aes_ctx_init_many(aes_ctx *ctxs, uint8_t const * const *keys, size_t key_length, size_t count);
+
+// Expands a 16, 24 or 32 byte key into the context, returns 0 or -1 if the key length is not one of those.
+// It is the batched expansion (see aes_ctx_init_many() below) with a batch of one.
+int aes_ctx_init(aes_ctx *ctx, uint8_t const *key, size_t key_length)
+{
+    return aes_ctx_init_many(ctx, &key, key_length, 1);
+}
+
+// Encrypts or decrypts the given no. of 16 byte blocks from input to output, each block on its own.
+// The input and output can be the same buffer to work in place.
+void aes_ctx_encrypt(aes_ctx const *ctx, uint8_t const *input, uint8_t *output, size_t blocks)
+{
+    aes_encrypt_blocks(input, output, blocks, ctx->round_keys, ctx->rounds);
+}
+
+void aes_ctx_decrypt(aes_ctx const *ctx, uint8_t const *input, uint8_t *output, size_t blocks)
+{
+    aes_decrypt_blocks(input, output, blocks, ctx->round_keys, ctx->rounds);
+}
+
+// Thread pool
+// Long buffers are cut into tasks that run on a pool of threads started on first use, one per core (the calling thread works as well,
+// so the pool has one thread less). parallel_for() runs fun(arg, task) for every task from 0 to tasks - 1 on at most the given no. of
+// threads (0 for all of them) and returns when all are done. Only one call uses the pool at a time, any call made while it is busy
+// (from another thread or from inside a task) simply runs all its tasks on the calling thread.
+typedef void (*task_fun)(void *arg, size_t task);
+
+struct
+{
+    pthread_once_t started;
+    pthread_mutex_t busy;               // held by the caller of parallel_for() while the pool works for it
+    pthread_mutex_t lock;               // protects everything below except next_task
+    pthread_cond_t wake, finished;
+    unsigned workers;
+    uint64_t generation;                // increased for every call, the workers wait for it to change
+    task_fun fun;
+    void *arg;
+    size_t tasks;
+    atomic_size_t next_task;
+    unsigned helpers_wanted, helpers_joined, helpers_running;
+} pool = {
+    .started = PTHREAD_ONCE_INIT,
+    .busy = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+};
+
+// Takes tasks until there are none left
+void pool_run_tasks(task_fun fun, void *arg, size_t tasks)
+{
+    size_t task;
+    while ((task = atomic_fetch_add(&pool.next_task, 1)) < tasks)
+        fun(arg, task);
+}
+
+void *pool_worker(void *unused)
+{
+    (void)unused;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    while (1)
+    {
+        while (pool.generation == seen)
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        seen = pool.generation;
+        if (pool.helpers_joined >= pool.helpers_wanted)
+            continue;
+        pool.helpers_joined++;
+        pool.helpers_running++;
+        task_fun fun = pool.fun;
+        void *arg = pool.arg;
+        size_t tasks = pool.tasks;
+        pthread_mutex_unlock(&pool.lock);
+
+        pool_run_tasks(fun, arg, tasks);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.helpers_running == 0)
+            pthread_cond_signal(&pool.finished);
+    }
+    return NULL;
+}
+
+void pool_start()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long itr = 1; itr < cores; itr++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, NULL) != 0)
+            break;
+        pthread_detach(thread);
+        pool.workers++;
+    }
+}
+
+// The no. of threads parallel_for() can use at most
+unsigned pool_threads()
+{
+    pthread_once(&pool.started, pool_start);
+    return pool.workers + 1;
+}
+
+void parallel_for(size_t tasks, unsigned threads, task_fun fun, void *arg)
+{
+    unsigned available = pool_threads();
+    if (threads == 0 || threads > available)
+        threads = available;
+    if (threads > tasks)
+        threads = tasks;
+    if (threads <= 1 || pthread_mutex_trylock(&pool.busy) != 0)
+    {
+        for (size_t task = 0; task < tasks; task++)
+            fun(arg, task);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    // A worker that woke up late for the last call may still be looking at its tasks
+    while (pool.helpers_running > 0)
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    pool.fun = fun;
+    pool.arg = arg;
+    pool.tasks = tasks;
+    atomic_store(&pool.next_task, 0);
+    pool.helpers_wanted = threads - 1;
+    pool.helpers_joined = 0;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    pool_run_tasks(fun, arg, tasks);
+
+    // All tasks are taken, wait for the ones still running on the workers
+    pthread_mutex_lock(&pool.lock);
+    while (pool.helpers_running > 0)
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.busy);
+}
+
+// Counter mode (CTR, NIST SP 800-38A section 6.5)
+// The keystream is the encryption of a 128-bit big-endian counter that starts at the given counter block and goes up by one for every
+// block, and the data is XORed with it. Encryption and decryption are the same operation and the length does not have to be a multiple
+// of 16. Since block n only needs counter + n, the buffer is cut into CTR_CHUNK sized tasks for the thread pool, each starting its own
+// counter at the right place, so the output is the same whatever the no. of threads. Inside a task CTR_BATCH counter blocks are
+// encrypted in one call so that the multi block implementations can keep several blocks in flight. 64 blocks (1 KiB of keystream,
+// still in the L1 cache for the XOR) fill a whole group of the bitsliced kernel and save the AES-NI one some calls as well.
+#define CTR_BATCH 64
+#define CTR_CHUNK ((size_t)64 * 1024)
+
+// Adds value to a 128-bit big-endian counter
+void counter_add(uint8_t *counter, uint64_t value)
+{
+    uint64_t carry = value;
+    for (int8_t itr = 15; itr >= 0 && carry; itr--)
+    {
+        carry += counter[itr];
+        counter[itr] = (uint8_t)carry;
+        carry >>= 8;
+    }
+}
+
+// 64-bit big-endian loads and stores. Writing the counter with two 8 byte stores instead of 16 single bytes matters, because the
+// encryption reads the block right back with one 16 byte load, which the CPU can only serve quickly from a few large stores.
+static inline uint64_t load_big64(uint8_t const *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+static inline void store_big64(uint8_t *bytes, uint64_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    memcpy(bytes, &value, 8);
+}
+
+// XORs length bytes of a and b into output, 8 bytes at a time where possible
+static inline void xor_bytes(uint8_t *output, uint8_t const *a, uint8_t const *b, size_t length)
+{
+    size_t itr = 0;
+    for (; itr + 8 <= length; itr += 8)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + itr, 8);
+        memcpy(&y, b + itr, 8);
+        x ^= y;
+        memcpy(output + itr, &x, 8);
+    }
+    for (; itr < length; itr++)
+        output[itr] = a[itr] ^ b[itr];
+}
+
+// Counter mode on one part of the buffer, first_block is the no. of blocks from the start of the whole buffer
+void ctr_range(aes_ctx const *ctx, uint8_t const *counter, uint64_t first_block, uint8_t const *input, uint8_t *output, size_t length)
+{
+    uint8_t keystream[CTR_BATCH][16] __attribute__((aligned(16)));
+    uint8_t start[16];
+    memcpy(start, counter, 16);
+    counter_add(start, first_block);
+    // The counter is kept as two 64-bit halves, so going to the next block is an add and a rare carry
+    uint64_t high = load_big64(start);
+    uint64_t low = load_big64(start + 8);
+
+    while (length > 0)
+    {
+        size_t blocks = (length + 15) / 16;
+        if (blocks > CTR_BATCH)
+            blocks = CTR_BATCH;
+        for (size_t itr = 0; itr < blocks; itr++)
+        {
+            store_big64(keystream[itr], high);
+            store_big64(keystream[itr] + 8, low);
+            if (++low == 0)
+                high++;
+        }
+        aes_encrypt_blocks(keystream[0], keystream[0], blocks, ctx->round_keys, ctx->rounds);
+        size_t bytes = length < 16*blocks ? length : 16*blocks;
+        xor_bytes(output, input, keystream[0], bytes);
+        input += bytes;
+        output += bytes;
+        length -= bytes;
+    }
+}
+
+typedef struct
+{
+    aes_ctx const *ctx;
+    uint8_t const *counter;
+    uint8_t const *input;
+    uint8_t *output;
+    size_t length;
+} ctr_job;
+
+void ctr_task(void *arg, size_t task)
+{
+    ctr_job const *job = arg;
+    size_t offset = task * CTR_CHUNK;
+    size_t length = job->length - offset < CTR_CHUNK ? job->length - offset : CTR_CHUNK;
+    ctr_range(job->ctx, job->counter, offset / 16, job->input + offset, job->output + offset, length);
+}
+
+// Encrypts (or decrypts) length bytes in counter mode starting from the given 16 byte counter block, using at most the given
+// no. of threads (0 for all cores). The input and output can be the same buffer. To continue a stream later, the counter has
+// to be moved on by the no. of blocks used with counter_add().
+void aes_ctr(aes_ctx const *ctx, uint8_t const *counter, uint8_t const *input, uint8_t *output, size_t length, unsigned threads)
+{
+    ctr_job job = { ctx, counter, input, output, length };
+    size_t tasks = (length + CTR_CHUNK - 1) / CTR_CHUNK;
+    if (tasks <= 1)
+        ctr_range(ctx, counter, 0, input, output, length);
+    else
+        parallel_for(tasks, threads, ctr_task, &job);
+}
+
+// Galois/Counter Mode (GCM, NIST SP 800-38D)
+// GCM is counter mode plus a MAC over the ciphertext, so it gives confidentiality and integrity with one key. The MAC is GHASH:
+// every 16 byte block of the additional data and of the ciphertext is added into an accumulator which is then multiplied by
+// H = E(K, 0) in GF(2^128). At the end the lengths are hashed as well and the result, XORed with the encryption of the first counter
+// block J0, is the tag. GF(2^128) here is "bit reflected": bit 0 of byte 0 is the highest power of x, and the field polynomial is
+// x^128 + x^7 + x^2 + x + 1.
+// The data is read only once. It is done CTR_BATCH blocks at a time: the keystream for the batch is made, XORed into the data and
+// the ciphertext is hashed while it is still in the L1 cache. With AES-NI and PCLMULQDQ both there is a single loop that has the
+// AES rounds of GCM_BATCH blocks and the GHASH of the ones before in flight at the same time.
+#define GCM_BATCH 8
+
+typedef struct
+{
+    aes_ctx aes;
+    uint64_t table_high[16], table_low[16];                 // i * H for every 4 bit i, for the software GHASH
+    uint8_t h_powers[4][16] __attribute__((aligned(16)));    // H, H^2, H^3, H^4 with their bytes reversed, for the PCLMULQDQ GHASH
+} gcm_ctx;
+
+// The state of one message, so that it can be given in pieces of any length
+typedef struct
+{
+    gcm_ctx const *gcm;
+    uint8_t j0[16];             // the counter block that encrypts the tag
+    uint8_t counter[16];        // the counter block of the next data block
+    uint8_t hash[16];           // the GHASH accumulator
+    uint8_t keystream[16];      // the keystream of a block that was only partly used
+    uint8_t partial[16];        // the ciphertext of that block, it is hashed once the block is full
+    uint8_t used;               // the no. of bytes of the partial block already done, 0 when there is none
+    uint64_t aad_length, text_length;
+} gcm_state;
+
+// Software GHASH
+// Multiplying by H is done 4 bits at a time (Shoup's method): table[i] = i * H for the 16 values of a nibble, and going from one
+// nibble to the next is a shift right by 4 bits, where the 4 bits that fall off are reduced back in with LAST4.
+uint64_t const LAST4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+void gcm_make_tables(gcm_ctx *gcm, uint8_t const *h)
+{
+    uint64_t high = load_big64(h), low = load_big64(h + 8);
+    // table[8] is H itself (the nibble 1000 is x^0), halving is multiplying by x
+    gcm->table_high[8] = high;
+    gcm->table_low[8] = low;
+    for (uint8_t itr = 4; itr > 0; itr >>= 1)
+    {
+        uint64_t reduce = (low & 1) ? 0xe100000000000000ULL : 0;
+        low = (high << 63) | (low >> 1);
+        high = (high >> 1) ^ reduce;
+        gcm->table_high[itr] = high;
+        gcm->table_low[itr] = low;
+    }
+    gcm->table_high[0] = gcm->table_low[0] = 0;
+    // Every other entry is the sum of the powers of two in it
+    for (uint8_t itr = 2; itr < 16; itr <<= 1)
+        for (uint8_t itr2 = 1; itr2 < itr; itr2++)
+        {
+            gcm->table_high[itr + itr2] = gcm->table_high[itr] ^ gcm->table_high[itr2];
+            gcm->table_low[itr + itr2] = gcm->table_low[itr] ^ gcm->table_low[itr2];
+        }
+}
+
+// One step of the multiplication: the product so far is multiplied by x^4 (a shift right by 4 in the reflected order, the 4 bits
+// that fall off are reduced back in) and the next nibble times H is added
+static inline void gcm_step(gcm_ctx const *gcm, uint64_t *high, uint64_t *low, uint8_t nibble)
+{
+    uint8_t rem = *low & 0xf;
+    *low = (*high << 60) | (*low >> 4);
+    *high = (*high >> 4) ^ (LAST4[rem] << 48);
+    *high ^= gcm->table_high[nibble];
+    *low ^= gcm->table_low[nibble];
+}
+
+// hash = hash * H, starting from the last nibble
+void gcm_multiply(gcm_ctx const *gcm, uint8_t *hash)
+{
+    uint64_t high = gcm->table_high[hash[15] & 0xf], low = gcm->table_low[hash[15] & 0xf];
+    gcm_step(gcm, &high, &low, hash[15] >> 4);
+    for (int8_t itr = 14; itr >= 0; itr--)
+    {
+        gcm_step(gcm, &high, &low, hash[itr] & 0xf);
+        gcm_step(gcm, &high, &low, hash[itr] >> 4);
+    }
+    store_big64(hash, high);
+    store_big64(hash + 8, low);
+}
+
+void ghash_software(gcm_ctx const *gcm, uint8_t *hash, uint8_t const *data, size_t blocks)
+{
+    for (; blocks > 0; blocks--, data += 16)
+    {
+        xor_bytes(hash, hash, data, 16);
+        gcm_multiply(gcm, hash);
+    }
+}
+
+#ifdef AES_X86
+// PCLMULQDQ GHASH
+// PCLMULQDQ multiplies two 64-bit polynomials without carries, four of them give the 256-bit product of two 128-bit values. The bytes
+// are reversed on load so that the reflected bit order becomes a plain shift by one bit, after which the product is reduced modulo
+// the field polynomial (Intel's "Carry-Less Multiplication Instruction and its Usage for Computing the GCM Mode", algorithm 5).
+// Four blocks are hashed with one reduction: X = (X + C1) * H^4 + C2 * H^3 + C3 * H^2 + C4 * H.
+__attribute__((target("ssse3"))) static inline __m128i reverse_bytes(__m128i value)
+{
+    return _mm_shuffle_epi8(value, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// The 256-bit carry-less product of a and b, added into low and high
+__attribute__((target("pclmul"))) static inline void clmul_add(__m128i a, __m128i b, __m128i *low, __m128i *high)
+{
+    __m128i lo = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(a, b, 0x11);
+    __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    *low = _mm_xor_si128(*low, _mm_xor_si128(lo, _mm_slli_si128(mid, 8)));
+    *high = _mm_xor_si128(*high, _mm_xor_si128(hi, _mm_srli_si128(mid, 8)));
+}
+
+// Shifts the 256-bit product left by one bit (the reflected order is one bit off) and reduces it to 128 bits
+__attribute__((target("sse2"))) static inline __m128i gf_reduce(__m128i low, __m128i high)
+{
+    __m128i carry_low = _mm_srli_epi32(low, 31), carry_high = _mm_srli_epi32(high, 31);
+    low = _mm_slli_epi32(low, 1);
+    high = _mm_slli_epi32(high, 1);
+    high = _mm_or_si128(high, _mm_or_si128(_mm_slli_si128(carry_high, 4), _mm_srli_si128(carry_low, 12)));
+    low = _mm_or_si128(low, _mm_slli_si128(carry_low, 4));
+
+    __m128i fold = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(low, 31), _mm_slli_epi32(low, 30)), _mm_slli_epi32(low, 25));
+    __m128i fold_high = _mm_srli_si128(fold, 4);
+    low = _mm_xor_si128(low, _mm_slli_si128(fold, 12));
+    __m128i shifted = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(low, 1), _mm_srli_epi32(low, 2)), _mm_srli_epi32(low, 7));
+    low = _mm_xor_si128(low, _mm_xor_si128(shifted, fold_high));
+    return _mm_xor_si128(high, low);
+}
+
+// Hashes 4 blocks (already byte reversed) into the byte reversed accumulator
+__attribute__((target("pclmul,ssse3"))) static inline __m128i ghash_4(__m128i const *h_powers, __m128i hash, __m128i const *data)
+{
+    __m128i low = _mm_setzero_si128(), high = _mm_setzero_si128();
+    clmul_add(_mm_xor_si128(hash, data[0]), h_powers[3], &low, &high);
+    clmul_add(data[1], h_powers[2], &low, &high);
+    clmul_add(data[2], h_powers[1], &low, &high);
+    clmul_add(data[3], h_powers[0], &low, &high);
+    return gf_reduce(low, high);
+}
+
+__attribute__((target("pclmul,ssse3"))) static inline __m128i ghash_1(__m128i h, __m128i hash, __m128i data)
+{
+    __m128i low = _mm_setzero_si128(), high = _mm_setzero_si128();
+    clmul_add(_mm_xor_si128(hash, data), h, &low, &high);
+    return gf_reduce(low, high);
+}
+
+__attribute__((target("pclmul,ssse3"))) void ghash_pclmul(gcm_ctx const *gcm, uint8_t *hash, uint8_t const *data, size_t blocks)
+{
+    __m128i h_powers[4], group[4];
+    for (uint8_t itr = 0; itr < 4; itr++)
+        h_powers[itr] = _mm_load_si128((__m128i const*)gcm->h_powers[itr]);
+    __m128i x = reverse_bytes(_mm_loadu_si128((__m128i const*)hash));
+    for (; blocks >= 4; blocks -= 4, data += 64)
+    {
+        for (uint8_t itr = 0; itr < 4; itr++)
+            group[itr] = reverse_bytes(_mm_loadu_si128((__m128i const*)(data + 16*itr)));
+        x = ghash_4(h_powers, x, group);
+    }
+    for (; blocks > 0; blocks--, data += 16)
+        x = ghash_1(h_powers[0], x, reverse_bytes(_mm_loadu_si128((__m128i const*)data)));
+    _mm_storeu_si128((__m128i*)hash, reverse_bytes(x));
+}
+
+// H^2 .. H^4 for the aggregated reduction
+__attribute__((target("pclmul,ssse3"))) void gcm_make_powers(gcm_ctx *gcm, uint8_t const *h)
+{
+    __m128i power = reverse_bytes(_mm_loadu_si128((__m128i const*)h)), first = power;
+    _mm_store_si128((__m128i*)gcm->h_powers[0], power);
+    for (uint8_t itr = 1; itr < 4; itr++)
+    {
+        __m128i low = _mm_setzero_si128(), high = _mm_setzero_si128();
+        clmul_add(power, first, &low, &high);
+        power = gf_reduce(low, high);
+        _mm_store_si128((__m128i*)gcm->h_powers[itr], power);
+    }
+}
+#endif
+
+// The GHASH in use, ghash_pclmul() when the CPU has PCLMULQDQ (chosen by aes_init())
+typedef void (*ghash_fun)(gcm_ctx const *gcm, uint8_t *hash, uint8_t const *data, size_t blocks);
+ghash_fun ghash_blocks = ghash_software;
+
+void use_best_ghash()
+{
+#ifdef AES_X86
+    ghash_blocks = pclmul_available ? ghash_pclmul : ghash_software;
+#endif
+}
+
+// Makes the GHASH tables for the key already expanded in gcm->aes
+void gcm_make_hash_key(gcm_ctx *gcm)
+{
+    uint8_t h[16] = { 0 };
+    aes_encrypt_block(h, h, gcm->aes.round_keys, gcm->aes.rounds);
+    gcm_make_tables(gcm, h);
+#ifdef AES_X86
+    if (pclmul_available)
+        gcm_make_powers(gcm, h);
+#endif
+}
+
+// Expands the 16, 24 or 32 byte key and makes the GHASH tables for it, returns -1 if the key length is wrong
+int aes_gcm_init(gcm_ctx *gcm, uint8_t const *key, size_t key_length)
+{
+    if (aes_ctx_init(&gcm->aes, key, key_length) != 0)
+        return -1;
+    gcm_make_hash_key(gcm);
+    return 0;
+}
+
+// Hashes a buffer of any length, padded with zeros to whole blocks
+void ghash_padded(gcm_ctx const *gcm, uint8_t *hash, uint8_t const *data, size_t length)
+{
+    ghash_blocks(gcm, hash, data, length / 16);
+    if (length % 16)
+    {
+        uint8_t last[16] = { 0 };
+        memcpy(last, data + length - length % 16, length % 16);
+        ghash_blocks(gcm, hash, last, 1);
+    }
+}
+
+// Only the low 32 bits of a GCM counter block count, they wrap around without carrying into the rest
+static inline void counter_inc32(uint8_t *counter)
+{
+    store_word(counter + 12, load_word(counter + 12) + 1);
+}
+
+// Starts a message with the given IV (12 bytes is the usual and fastest size, other sizes are hashed into J0) and additional data.
+// Returns 0, or -1 if the IV is empty, which SP 800-38D does not allow.
+int aes_gcm_start(gcm_state *state, gcm_ctx const *gcm, uint8_t const *iv, size_t iv_length, uint8_t const *aad, size_t aad_length)
+{
+    memset(state, 0, sizeof(*state));
+    if (iv_length == 0)
+        return -1;
+    state->gcm = gcm;
+    if (iv_length == 12)
+    {
+        memcpy(state->j0, iv, 12);
+        state->j0[15] = 1;
+    }
+    else
+    {
+        uint8_t lengths[16] = { 0 };
+        ghash_padded(gcm, state->j0, iv, iv_length);
+        store_big64(lengths + 8, (uint64_t)iv_length * 8);
+        ghash_blocks(gcm, state->j0, lengths, 1);
+    }
+    memcpy(state->counter, state->j0, 16);
+    counter_inc32(state->counter);
+    ghash_padded(gcm, state->hash, aad, aad_length);
+    state->aad_length = aad_length;
+    return 0;
+}
+
+// Whole blocks with any block functions and GHASH: a batch of keystream, XOR, then the ciphertext is hashed
+void gcm_blocks_generic(gcm_state *state, uint8_t const *input, uint8_t *output, size_t blocks, uint8_t decrypt)
+{
+    uint8_t keystream[CTR_BATCH][16] __attribute__((aligned(16)));
+    while (blocks > 0)
+    {
+        size_t batch = blocks < CTR_BATCH ? blocks : CTR_BATCH;
+        for (size_t itr = 0; itr < batch; itr++)
+        {
+            memcpy(keystream[itr], state->counter, 16);
+            counter_inc32(state->counter);
+        }
+        aes_encrypt_blocks(keystream[0], keystream[0], batch, state->gcm->aes.round_keys, state->gcm->aes.rounds);
+        if (decrypt)
+            ghash_blocks(state->gcm, state->hash, input, batch);
+        xor_bytes(output, input, keystream[0], 16 * batch);
+        if (!decrypt)
+            ghash_blocks(state->gcm, state->hash, output, batch);
+        input += 16 * batch;
+        output += 16 * batch;
+        blocks -= batch;
+    }
+}
+
+#ifdef AES_X86
+// Whole blocks with AES-NI and PCLMULQDQ in one loop. The counter is kept byte reversed so that its low 32 bits are the lowest lane
+// and inc32 is one add. While the AES rounds of 8 blocks run, the 8 ciphertext blocks of the step before are hashed (for decryption
+// the ciphertext is known up front, so its own blocks are hashed), which keeps the AES and the multiplier units busy together.
+__attribute__((target("aes,pclmul,ssse3"))) static inline __attribute__((always_inline)) void aesni_gcm_blocks_rounds(gcm_state *state, uint8_t const *input, uint8_t *output, size_t blocks, uint8_t decrypt, uint8_t const rounds)
+{
+    gcm_ctx const *gcm = state->gcm;
+    __m128i keys[AES_MAX_ROUNDS + 1], h_powers[4], block[GCM_BATCH], hashed[GCM_BATCH];
+    for (uint8_t round = 0; round <= rounds; round++)
+        keys[round] = _mm_load_si128((__m128i const*)gcm->aes.round_keys[round]);
+    for (uint8_t itr = 0; itr < 4; itr++)
+        h_powers[itr] = _mm_load_si128((__m128i const*)gcm->h_powers[itr]);
+    __m128i x = reverse_bytes(_mm_loadu_si128((__m128i const*)state->hash));
+    __m128i counter = reverse_bytes(_mm_loadu_si128((__m128i const*)state->counter));
+    __m128i const one = _mm_set_epi32(0, 0, 0, 1);
+    uint8_t pending = 0;        // for encryption: hashed[] holds the last batch of ciphertext, not hashed yet
+
+    for (; blocks >= GCM_BATCH; blocks -= GCM_BATCH, input += 16*GCM_BATCH, output += 16*GCM_BATCH)
+    {
+        for (uint8_t lane = 0; lane < GCM_BATCH; lane++)
+        {
+            block[lane] = _mm_xor_si128(reverse_bytes(counter), keys[0]);
+            counter = _mm_add_epi32(counter, one);
+        }
+        if (decrypt)
+            for (uint8_t lane = 0; lane < GCM_BATCH; lane++)
+                hashed[lane] = reverse_bytes(_mm_loadu_si128((__m128i const*)(input + 16*lane)));
+        // The rounds of this batch and the GHASH of the ciphertext in hashed[] do not depend on each other
+#pragma GCC unroll 14
+        for (uint8_t round = 1; round < rounds; round++)
+        {
+            for (uint8_t lane = 0; lane < GCM_BATCH; lane++)
+                block[lane] = _mm_aesenc_si128(block[lane], keys[round]);
+            if ((decrypt || pending) && (round == 3 || round == 6))
+                x = ghash_4(h_powers, x, hashed + (round == 3 ? 0 : 4));
+        }
+        for (uint8_t lane = 0; lane < GCM_BATCH; lane++)
+        {
+            __m128i text = _mm_xor_si128(_mm_aesenclast_si128(block[lane], keys[rounds]), _mm_loadu_si128((__m128i const*)(input + 16*lane)));
+            _mm_storeu_si128((__m128i*)(output + 16*lane), text);
+            if (!decrypt)
+                hashed[lane] = reverse_bytes(text);
+        }
+        pending = !decrypt;
+    }
+    if (pending)
+    {
+        x = ghash_4(h_powers, x, hashed);
+        x = ghash_4(h_powers, x, hashed + 4);
+    }
+    _mm_storeu_si128((__m128i*)state->hash, reverse_bytes(x));
+    _mm_storeu_si128((__m128i*)state->counter, reverse_bytes(counter));
+    // Less than one batch left
+    gcm_blocks_generic(state, input, output, blocks, decrypt);
+}
+
+__attribute__((target("aes,pclmul,ssse3"))) void aesni_gcm_blocks(gcm_state *state, uint8_t const *input, uint8_t *output, size_t blocks, uint8_t decrypt)
+{
+    switch (state->gcm->aes.rounds)
+    {
+    case 10: aesni_gcm_blocks_rounds(state, input, output, blocks, decrypt, 10); break;
+    case 12: aesni_gcm_blocks_rounds(state, input, output, blocks, decrypt, 12); break;
+    case 14: aesni_gcm_blocks_rounds(state, input, output, blocks, decrypt, 14); break;
+    default: bad_rounds(state->gcm->aes.rounds);
+    }
+}
+#endif
+
+// SP 800-38D allows at most 2^39 - 256 bits (2^36 - 32 bytes) of plaintext per message: the 32-bit counter of the blocks would come
+// back round to J0, which encrypts the tag, and the length in bits no longer fits in the 64 bits hashed at the end.
+#define GCM_MAX_TEXT (((uint64_t)1 << 36) - 32)
+
+// Encrypts (or decrypts) the next length bytes of the message. The pieces can have any length, only the last one may end in the
+// middle of a block for the result to be the same as in one go. The input and output can be the same buffer.
+// Returns 0, or -1 without touching anything if the message would grow beyond GCM_MAX_TEXT.
+int aes_gcm_update(gcm_state *state, uint8_t const *input, uint8_t *output, size_t length, uint8_t decrypt)
+{
+    if (length > GCM_MAX_TEXT - state->text_length)
+        return -1;
+    state->text_length += length;
+    // Finish a block that an earlier call left partly done
+    while (state->used && length > 0)
+    {
+        state->partial[state->used] = decrypt ? *input : (uint8_t)(*input ^ state->keystream[state->used]);
+        *output++ = *input++ ^ state->keystream[state->used];
+        length--;
+        if (++state->used == 16)
+        {
+            ghash_blocks(state->gcm, state->hash, state->partial, 1);
+            state->used = 0;
+        }
+    }
+
+    size_t blocks = length / 16;
+#ifdef AES_X86
+    if (aes_encrypt_blocks == aesni_encrypt_blocks && ghash_blocks == ghash_pclmul)
+        aesni_gcm_blocks(state, input, output, blocks, decrypt);
+    else
+#endif
+        gcm_blocks_generic(state, input, output, blocks, decrypt);
+    input += 16 * blocks;
+    output += 16 * blocks;
+    length -= 16 * blocks;
+
+    if (length > 0)
+    {
+        memcpy(state->keystream, state->counter, 16);
+        counter_inc32(state->counter);
+        aes_encrypt_block(state->keystream, state->keystream, state->gcm->aes.round_keys, state->gcm->aes.rounds);
+        for (; length > 0; length--, state->used++)
+        {
+            state->partial[state->used] = decrypt ? *input : (uint8_t)(*input ^ state->keystream[state->used]);
+            *output++ = *input++ ^ state->keystream[state->used];
+        }
+    }
+    return 0;
+}
+
+// Hashes the last partial block and the lengths and writes the 16 byte tag
+void aes_gcm_finish(gcm_state *state, uint8_t *tag)
+{
+    if (state->used)
+    {
+        memset(state->partial + state->used, 0, 16 - state->used);
+        ghash_blocks(state->gcm, state->hash, state->partial, 1);
+        state->used = 0;
+    }
+    uint8_t lengths[16];
+    store_big64(lengths, state->aad_length * 8);
+    store_big64(lengths + 8, state->text_length * 8);
+    ghash_blocks(state->gcm, state->hash, lengths, 1);
+    aes_encrypt_block(state->j0, tag, state->gcm->aes.round_keys, state->gcm->aes.rounds);
+    xor_bytes(tag, tag, state->hash, 16);
+}
+
+// Encrypts a whole message and writes its 16 byte tag, returns 0 or -1 if the IV is empty or the message too long
+int aes_gcm_encrypt(gcm_ctx const *gcm, uint8_t const *iv, size_t iv_length, uint8_t const *aad, size_t aad_length,
+                    uint8_t const *input, uint8_t *output, size_t length, uint8_t *tag)
+{
+    gcm_state state;
+    if (aes_gcm_start(&state, gcm, iv, iv_length, aad, aad_length) != 0 || aes_gcm_update(&state, input, output, length, 0) != 0)
+        return -1;
+    aes_gcm_finish(&state, tag);
+    return 0;
+}
+
+// Compares two tags in a time that does not depend on where they differ, returns 1 if they are equal
+int tags_equal(uint8_t const *a, uint8_t const *b, size_t length)
+{
+    uint8_t difference = 0;
+    for (size_t itr = 0; itr < length; itr++)
+        difference |= a[itr] ^ b[itr];
+    return difference == 0;
+}
+
+// The tag lengths SP 800-38D allows: 12 to 16 bytes, and 4 or 8 bytes only when built with -DAES_GCM_SHORT_TAGS for the protocols
+// that need them (a short tag is much easier to forge, see appendix C of SP 800-38D).
+int gcm_tag_length_allowed(size_t tag_length)
+{
+#ifdef AES_GCM_SHORT_TAGS
+    if (tag_length == 4 || tag_length == 8)
+        return 1;
+#endif
+    return tag_length >= 12 && tag_length <= 16;
+}
+
+// Decrypts a whole message and checks its tag (tag_length bytes, see gcm_tag_length_allowed()). It returns 0 if the message is
+// authentic and -1 if not (or if the IV is empty, the message too long or the tag length not allowed), in which case the output is
+// cleared so that no unauthenticated plaintext is left behind.
+int aes_gcm_decrypt(gcm_ctx const *gcm, uint8_t const *iv, size_t iv_length, uint8_t const *aad, size_t aad_length,
+                    uint8_t const *input, uint8_t *output, size_t length, uint8_t const *tag, size_t tag_length)
+{
+    gcm_state state;
+    uint8_t expected[16];
+    if (!gcm_tag_length_allowed(tag_length) || aes_gcm_start(&state, gcm, iv, iv_length, aad, aad_length) != 0 ||
+        aes_gcm_update(&state, input, output, length, 1) != 0)
+    {
+        memset(output, 0, length);
+        return -1;
+    }
+    aes_gcm_finish(&state, expected);
+    if (!tags_equal(expected, tag, tag_length))
+    {
+        memset(output, 0, length);
+        return -1;
+    }
+    return 0;
+}
+
+// XTS (IEEE 1619, NIST SP 800-38E)
+// XTS is made for disks: every data unit (a sector) is encrypted on its own, so any sector can be read or written without touching the
+// others, and the same data in two sectors still looks different. The key is two AES keys of the same size. The second one encrypts
+// the data unit no. (as a 128-bit little-endian number) into the tweak T, and block j of the unit is
+//      C(j) = E(K1, P(j) + T a^j) + T a^j
+// where a^j is the j-th power of x in GF(2^128) with the polynomial x^128 + x^7 + x^2 + x + 1 in little-endian order, so the tweak
+// of the next block is the one before doubled: a shift by one bit and an XOR with 0x87 if a bit fell off the top.
+// The tweaks of CTR_BATCH blocks are made first and the blocks are encrypted in one call, so the multi block implementations work on
+// many blocks of a sector at once. Sectors do not depend on each other, so groups of them go to the thread pool as tasks.
+// A unit that is not a multiple of 16 bytes (but at least 16) uses ciphertext stealing: the last full block is encrypted, its first
+// bytes become the short last block and the rest of it fills up the short plaintext block, which is encrypted in its place.
+typedef struct
+{
+    aes_ctx data;
+    aes_ctx tweak;
+} xts_ctx;
+
+// Expands a 32 or 64 byte key (two AES-128 or two AES-256 keys, the data key first) into the context. Returns 0, or -1 if the key
+// length is not one of those or if the two halves are the same, which SP 800-38E and IEEE 1619 do not allow.
+int aes_xts_init(xts_ctx *xts, uint8_t const *key, size_t key_length)
+{
+    if ((key_length != 32 && key_length != 64) || tags_equal(key, key + key_length / 2, key_length / 2))
+        return -1;
+    aes_ctx_init(&xts->data, key, key_length / 2);
+    aes_ctx_init(&xts->tweak, key + key_length / 2, key_length / 2);
+    return 0;
+}
+
+// 64-bit little-endian loads and stores, the tweak is kept as two of them with tweak[0] the low half
+static inline uint64_t load_little64(uint8_t const *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+static inline void store_little64(uint8_t *bytes, uint64_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    memcpy(bytes, &value, 8);
+}
+
+// T * x in GF(2^128), without a branch on the bit that falls off
+static inline void xts_double(uint64_t *tweak)
+{
+    uint64_t carry = tweak[1] >> 63;
+    tweak[1] = (tweak[1] << 1) | (tweak[0] >> 63);
+    tweak[0] = (tweak[0] << 1) ^ (0x87 & (0 - carry));
+}
+
+// One block with the given tweak, for the two blocks of ciphertext stealing
+void xts_block(xts_ctx const *xts, uint8_t const *input, uint8_t *output, uint64_t const *tweak, uint8_t decrypt)
+{
+    uint8_t mask[16], block[16];
+    store_little64(mask, tweak[0]);
+    store_little64(mask + 8, tweak[1]);
+    xor_bytes(block, input, mask, 16);
+    if (decrypt)
+        aes_decrypt_block(block, block, xts->data.round_keys, xts->data.rounds);
+    else
+        aes_encrypt_block(block, block, xts->data.round_keys, xts->data.rounds);
+    xor_bytes(output, block, mask, 16);
+}
+
+// Encrypts or decrypts one data unit of length bytes (at least 16)
+void xts_unit(xts_ctx const *xts, uint64_t unit, uint8_t const *input, uint8_t *output, size_t length, uint8_t decrypt)
+{
+    uint8_t tweaks[CTR_BATCH][16] __attribute__((aligned(16)));
+    uint8_t buffer[CTR_BATCH][16] __attribute__((aligned(16)));
+    uint64_t tweak[2];
+    store_little64(buffer[0], unit);
+    store_little64(buffer[0] + 8, 0);
+    aes_encrypt_block(buffer[0], buffer[0], xts->tweak.round_keys, xts->tweak.rounds);
+    tweak[0] = load_little64(buffer[0]);
+    tweak[1] = load_little64(buffer[0] + 8);
+
+    // With stealing the last full block is done together with the short one
+    size_t partial = length % 16;
+    size_t blocks = length / 16 - (partial ? 1 : 0);
+    while (blocks > 0)
+    {
+        size_t batch = blocks < CTR_BATCH ? blocks : CTR_BATCH;
+        for (size_t itr = 0; itr < batch; itr++)
+        {
+            store_little64(tweaks[itr], tweak[0]);
+            store_little64(tweaks[itr] + 8, tweak[1]);
+            xts_double(tweak);
+        }
+        xor_bytes(buffer[0], input, tweaks[0], 16*batch);
+        if (decrypt)
+            aes_decrypt_blocks(buffer[0], buffer[0], batch, xts->data.round_keys, xts->data.rounds);
+        else
+            aes_encrypt_blocks(buffer[0], buffer[0], batch, xts->data.round_keys, xts->data.rounds);
+        xor_bytes(output, buffer[0], tweaks[0], 16*batch);
+        input += 16*batch;
+        output += 16*batch;
+        blocks -= batch;
+    }
+
+    if (partial)
+    {
+        // Encryption uses the tweak of the last full block first and the next one for the block made of the short one. Decryption has
+        // to undo them in the opposite order. The short input block is read before anything is written, so this works in place too.
+        uint64_t next_tweak[2] = { tweak[0], tweak[1] };
+        xts_double(next_tweak);
+        uint8_t block[16], stolen[16];
+        xts_block(xts, input, block, decrypt ? next_tweak : tweak, decrypt);
+        memcpy(stolen, input + 16, partial);
+        memcpy(stolen + partial, block + partial, 16 - partial);
+        memcpy(output + 16, block, partial);
+        xts_block(xts, stolen, output, decrypt ? tweak : next_tweak, decrypt);
+    }
+}
+
+typedef struct
+{
+    xts_ctx const *xts;
+    uint64_t first_unit;
+    uint8_t const *input;
+    uint8_t *output;
+    size_t unit_length, units, units_per_task;
+    uint8_t decrypt;
+} xts_job;
+
+void xts_task(void *arg, size_t task)
+{
+    xts_job const *job = arg;
+    size_t first = task * job->units_per_task;
+    size_t last = first + job->units_per_task < job->units ? first + job->units_per_task : job->units;
+    for (size_t unit = first; unit < last; unit++)
+        xts_unit(job->xts, job->first_unit + unit, job->input + unit * job->unit_length, job->output + unit * job->unit_length,
+                 job->unit_length, job->decrypt);
+}
+
+// Encrypts (or decrypts) the given no. of data units of unit_length bytes each, one after the other in the buffers and numbered from
+// first_unit on, using at most the given no. of threads (0 for all cores). The input and output can be the same buffer.
+// Returns 0, or -1 if a unit is shorter than one block.
+int xts_units(xts_ctx const *xts, uint64_t first_unit, uint8_t const *input, uint8_t *output, size_t unit_length, size_t units, unsigned threads, uint8_t decrypt)
+{
+    if (unit_length < 16)
+        return -1;
+    // About CTR_CHUNK bytes per task, so small sectors do not make a task each
+    size_t units_per_task = unit_length < CTR_CHUNK ? CTR_CHUNK / unit_length : 1;
+    xts_job job = { xts, first_unit, input, output, unit_length, units, units_per_task, decrypt };
+    size_t tasks = (units + units_per_task - 1) / units_per_task;
+    if (tasks <= 1)
+        xts_task(&job, 0);
+    else
+        parallel_for(tasks, threads, xts_task, &job);
+    return 0;
+}
+
+int aes_xts_encrypt(xts_ctx const *xts, uint64_t first_unit, uint8_t const *input, uint8_t *output, size_t unit_length, size_t units, unsigned threads)
+{
+    return xts_units(xts, first_unit, input, output, unit_length, units, threads, 0);
+}
+
+int aes_xts_decrypt(xts_ctx const *xts, uint64_t first_unit, uint8_t const *input, uint8_t *output, size_t unit_length, size_t units, unsigned threads)
+{
+    return xts_units(xts, first_unit, input, output, unit_length, units, threads, 1);
+}
+
+// Cipher block chaining (CBC, NIST SP 800-38A section 6.2)
+// Every plaintext block is XORed with the ciphertext block before it (the IV for the first one) and then encrypted. The data has to be
+// a whole no. of blocks, padding is up to the caller. Encrypting one stream is serial, a block can only start once the one before it is
+// done, which leaves the pipeline of the AES unit (or the parallel lanes of the bitsliced and vector kernels) mostly idle. So many
+// independent streams are encrypted together instead: as many of them at a time as the kernel has lanes, one block of each per step
+// through its "lanes" function, and a stream that ends gives its lane to the next one. Decryption has no such problem, block n is
+// D(C(n)) + C(n - 1), so it is done in parallel within the stream, with the multi block functions and on the thread pool.
+typedef struct
+{
+    aes_ctx const *ctx;
+    uint8_t iv[16];         // The last ciphertext block when done, so that the stream can be continued
+    uint8_t const *input;
+    uint8_t *output;
+    size_t blocks;
+} cbc_stream;
+
+// One stream on its own, iv is updated like in cbc_stream
+void aes_cbc_encrypt(aes_ctx const *ctx, uint8_t *iv, uint8_t const *input, uint8_t *output, size_t blocks)
+{
+    for (size_t itr = 0; itr < blocks; itr++)
+    {
+        xor_bytes(output + 16*itr, input + 16*itr, iv, 16);
+        aes_encrypt_block(output + 16*itr, output + 16*itr, ctx->round_keys, ctx->rounds);
+        memcpy(iv, output + 16*itr, 16);
+    }
+}
+
+// All the streams with the given no. of rounds, a lane function call only works with one key size. The streams in progress are kept in
+// the first lanes: one that ends is replaced by the next stream, or by the stream of the last lane when there are no more. The no. of
+// lanes is rounded up to a multiple of 8 with left over blocks and the first lane's key, which costs as much as leaving them empty.
+void cbc_encrypt_lanes(cbc_stream *streams, size_t count, uint8_t rounds)
+{
+    uint8_t blocks[MULTI_LANES][16] __attribute__((aligned(16)));
+    uint8_t const (*keys[MULTI_LANES]) [16];
+    cbc_stream *lanes[MULTI_LANES];
+    size_t done[MULTI_LANES], next = 0, active = 0;
+    while (1)
+    {
+        for (; active < aes_lane_count && next < count; next++)
+            if (streams[next].ctx->rounds == rounds && streams[next].blocks > 0)
+            {
+                lanes[active] = &streams[next];
+                keys[active] = streams[next].ctx->round_keys;
+                done[active++] = 0;
+            }
+        if (active == 0)
+            return;
+        size_t used = (active + 7) & ~(size_t)7;
+        for (size_t lane = 0; lane < active; lane++)
+            xor_bytes(blocks[lane], lanes[lane]->input + 16*done[lane], lanes[lane]->iv, 16);
+        for (size_t lane = active; lane < used; lane++)
+            keys[lane] = keys[0];
+
+        aes_encrypt_lanes(blocks, keys, used, rounds);
+
+        for (size_t lane = 0; lane < active; lane++)
+        {
+            memcpy(lanes[lane]->output + 16*done[lane], blocks[lane], 16);
+            memcpy(lanes[lane]->iv, blocks[lane], 16);
+            done[lane]++;
+        }
+        for (size_t lane = 0; lane < active;)
+        {
+            if (done[lane] < lanes[lane]->blocks)
+            {
+                lane++;
+                continue;
+            }
+            for (; next < count; next++)
+                if (streams[next].ctx->rounds == rounds && streams[next].blocks > 0)
+                    break;
+            if (next < count)
+            {
+                lanes[lane] = &streams[next++];
+                done[lane] = 0;
+            }
+            else
+            {
+                active--;
+                lanes[lane] = lanes[active];
+                done[lane] = done[active];
+            }
+            keys[lane] = lanes[lane]->ctx->round_keys;
+        }
+    }
+}
+
+#define CBC_STREAMS_PER_TASK 256
+
+typedef struct
+{
+    cbc_stream *streams;
+    size_t count;
+} cbc_multi_job;
+
+void cbc_multi_task(void *arg, size_t task)
+{
+    cbc_multi_job const *job = arg;
+    size_t first = task * CBC_STREAMS_PER_TASK;
+    size_t count = job->count - first < CBC_STREAMS_PER_TASK ? job->count - first : CBC_STREAMS_PER_TASK;
+    cbc_encrypt_lanes(job->streams + first, count, 10);
+    cbc_encrypt_lanes(job->streams + first, count, 12);
+    cbc_encrypt_lanes(job->streams + first, count, 14);
+}
+
+// Encrypts count independent streams, each with its own key, IV and length. Groups of CBC_STREAMS_PER_TASK streams are spread over
+// at most the given no. of threads (0 for all cores). The input and output of a stream can be the same buffer.
+void aes_cbc_encrypt_multi(cbc_stream *streams, size_t count, unsigned threads)
+{
+    cbc_multi_job job = { streams, count };
+    size_t tasks = (count + CBC_STREAMS_PER_TASK - 1) / CBC_STREAMS_PER_TASK;
+    if (tasks <= 1)
+        cbc_multi_task(&job, 0);
+    else
+        parallel_for(tasks, threads, cbc_multi_task, &job);
+}
+
+// Decryption of one part of the stream, chain is the ciphertext block before it. The blocks of a batch are decrypted together and
+// then XORed with the ciphertext from the last block to the first, so that working in place never overwrites a ciphertext block that
+// is still needed. The last one of the batch is kept for the next batch.
+void cbc_decrypt_range(aes_ctx const *ctx, uint8_t const *chain, uint8_t const *input, uint8_t *output, size_t blocks)
+{
+    uint8_t buffer[CTR_BATCH][16] __attribute__((aligned(16)));
+    uint8_t previous[16], next_previous[16];
+    memcpy(previous, chain, 16);
+    while (blocks > 0)
+    {
+        size_t batch = blocks < CTR_BATCH ? blocks : CTR_BATCH;
+        aes_decrypt_blocks(input, buffer[0], batch, ctx->round_keys, ctx->rounds);
+        memcpy(next_previous, input + 16*(batch - 1), 16);
+        for (size_t itr = batch - 1; itr > 0; itr--)
+            xor_bytes(output + 16*itr, buffer[itr], input + 16*(itr - 1), 16);
+        xor_bytes(output, buffer[0], previous, 16);
+        memcpy(previous, next_previous, 16);
+        input += 16*batch;
+        output += 16*batch;
+        blocks -= batch;
+    }
+}
+
+// At most this many tasks, so that the ciphertext blocks at their borders can be saved on the stack before any of them is overwritten
+#define CBC_MAX_TASKS 256
+
+typedef struct
+{
+    aes_ctx const *ctx;
+    uint8_t const *input;
+    uint8_t *output;
+    size_t blocks, tasks;
+    uint8_t chains[CBC_MAX_TASKS][16];
+} cbc_decrypt_job;
+
+void cbc_decrypt_task(void *arg, size_t task)
+{
+    cbc_decrypt_job const *job = arg;
+    size_t start = job->blocks * task / job->tasks, end = job->blocks * (task + 1) / job->tasks;
+    cbc_decrypt_range(job->ctx, job->chains[task], job->input + 16*start, job->output + 16*start, end - start);
+}
+
+// Decrypts one stream of the given no. of blocks using at most the given no. of threads (0 for all cores), iv is updated to the last
+// ciphertext block. The input and output can be the same buffer.
+void aes_cbc_decrypt(aes_ctx const *ctx, uint8_t *iv, uint8_t const *input, uint8_t *output, size_t blocks, unsigned threads)
+{
+    if (blocks == 0)
+        return;
+    cbc_decrypt_job job;
+    job.ctx = ctx;
+    job.input = input;
+    job.output = output;
+    job.blocks = blocks;
+    job.tasks = (16*blocks + CTR_CHUNK - 1) / CTR_CHUNK;
+    if (job.tasks > CBC_MAX_TASKS)
+        job.tasks = CBC_MAX_TASKS;
+    for (size_t task = 0; task < job.tasks; task++)
+    {
+        size_t start = blocks * task / job.tasks;
+        memcpy(job.chains[task], start ? input + 16*(start - 1) : iv, 16);
+    }
+    memcpy(iv, input + 16*(blocks - 1), 16);
+    if (job.tasks <= 1)
+        cbc_decrypt_task(&job, 0);
+    else
+        parallel_for(job.tasks, threads, cbc_decrypt_task, &job);
+}
+
+// Batched key expansion
+// In a service where nearly every request has its own key, expanding the key can take longer than encrypting the one or two blocks of
+// the request. Every word of the expansion needs the word before it, so one key at a time leaves the CPU waiting on that chain;
+// expanding KEY_LANES keys side by side lets the steps of one key overlap with the steps of the others. The schedules are the same as
+// the ones of key_expansion(), decryption keys included, which stays as the easy to follow version.
+#define KEY_LANES 4
+#define KEY_BATCH 64
+
+typedef void (*keys_fun)(aes_ctx * const *ctxs, uint8_t const * const *keys, uint8_t key_length, size_t count);
+
+// Word by word like key_expansion() but with the S_BOX indexed by the byte directly, without any unpacking into arrays. Inverse
+// mixcolumn of the decryption keys uses the decryption T-tables: DEC_TABLE[row][Subbytes(b)] is inverse mixcolumn of a column that
+// only has b, in the given row, and inverse mixcolumn is linear so the four of them XORed give it for the whole column.
+void expand_keys_software(aes_ctx * const *ctxs, uint8_t const * const *keys, uint8_t key_length, size_t count)
+{
+    uint8_t const *sbox = &S_BOX[0][0];
+    uint8_t nk = key_length / 4, rounds = aes_rounds(key_length);
+    uint8_t word_count = 4 * (rounds + 1);
+    uint32_t words[KEY_LANES][4 * (AES_MAX_ROUNDS + 1)];
+    for (size_t first = 0; first < count; first += KEY_LANES)
+    {
+        uint8_t lanes = count - first < KEY_LANES ? count - first : KEY_LANES;
+        for (uint8_t lane = 0; lane < lanes; lane++)
+            for (uint8_t itr = 0; itr < nk; itr++)
+                words[lane][itr] = load_word(keys[first + lane] + 4*itr);
+        for (uint8_t itr = nk; itr < word_count; itr++)
+        {
+            for (uint8_t lane = 0; lane < lanes; lane++)
+            {
+                uint32_t temp = words[lane][itr - 1];
+                // Subword(Rotword(temp)) is the S_BOX of the bytes taken one place further
+                if (itr % nk == 0)
+                    temp = (((uint32_t)sbox[(temp >> 16) & 0xff] << 24) | ((uint32_t)sbox[(temp >> 8) & 0xff] << 16) |
+                            ((uint32_t)sbox[temp & 0xff] << 8) | sbox[temp >> 24]) ^ Rcon[(itr / nk) - 1];
+                else if (nk == 8 && itr % nk == 4)
+                    temp = ((uint32_t)sbox[temp >> 24] << 24) | ((uint32_t)sbox[(temp >> 16) & 0xff] << 16) |
+                           ((uint32_t)sbox[(temp >> 8) & 0xff] << 8) | sbox[temp & 0xff];
+                words[lane][itr] = words[lane][itr - nk] ^ temp;
+            }
+        }
+
+        for (uint8_t lane = 0; lane < lanes; lane++)
+        {
+            aes_ctx *ctx = ctxs[first + lane];
+            uint8_t (*dec_keys) [16] = ctx->round_keys + DEC_KEYS;
+            ctx->rounds = rounds;
+            for (uint8_t itr = 0; itr < word_count; itr++)
+                store_word(ctx->round_keys[itr / 4] + 4 * (itr % 4), words[lane][itr]);
+            for (uint8_t col = 0; col < 4; col++)
+            {
+                store_word(dec_keys[0] + 4*col, words[lane][4*rounds + col]);
+                store_word(dec_keys[rounds] + 4*col, words[lane][col]);
+            }
+            for (uint8_t round = 1; round < rounds; round++)
+                for (uint8_t col = 0; col < 4; col++)
+                {
+                    uint32_t word = words[lane][4 * (rounds - round) + col];
+                    store_word(dec_keys[round] + 4*col, DEC_TABLE[0][sbox[word >> 24]] ^ DEC_TABLE[1][sbox[(word >> 16) & 0xff]] ^
+                                                        DEC_TABLE[2][sbox[(word >> 8) & 0xff]] ^ DEC_TABLE[3][sbox[word & 0xff]]);
+                }
+        }
+    }
+}
+
+#ifdef AES_X86
+// AESENCLAST on a register that holds the same word in all four columns gives Subword of that word (shiftrows only moves bytes between
+// equal columns) XORed with the round key. With the word rotated by PSHUFB and the round constant as the round key that is
+// Subword(Rotword(w)) ^ rcon. AESKEYGENASSIST is made for this, but it only starts one every several cycles on many CPUs and the
+// batch measured about three times faster without it. The rest of a step is XORs: every new word is the word one step back XORed with
+// all the words before it in the step and with the Subword word, which aesni_key_mix() does with two shifts. The decryption keys are
+// made with AESIMC, which is inverse mixcolumn. A last short group repeats its last key.
+__attribute__((target("aes"))) static inline __m128i aesni_key_mix(__m128i key, __m128i word)
+{
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 8));
+    return _mm_xor_si128(key, word);
+}
+
+__attribute__((target("aes"))) static inline void aesni_store_schedule(aes_ctx *ctx, __m128i const *schedule, uint8_t rounds)
+{
+    uint8_t (*dec_keys) [16] = ctx->round_keys + DEC_KEYS;
+    ctx->rounds = rounds;
+    for (uint8_t round = 0; round <= rounds; round++)
+        _mm_store_si128((__m128i*)ctx->round_keys[round], schedule[round]);
+    _mm_store_si128((__m128i*)dec_keys[0], schedule[rounds]);
+    for (uint8_t round = 1; round < rounds; round++)
+        _mm_store_si128((__m128i*)dec_keys[round], _mm_aesimc_si128(schedule[rounds - round]));
+    _mm_store_si128((__m128i*)dec_keys[rounds], schedule[0]);
+}
+
+__attribute__((target("aes,ssse3"))) void aesni_expand_keys(aes_ctx * const *ctxs, uint8_t const * const *keys, uint8_t key_length, size_t count)
+{
+    // Rotword of word 3 and of word 1, and word 3 as it is, in all four columns
+    __m128i const rotate_3 = _mm_setr_epi8(13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15, 12);
+    __m128i const rotate_1 = _mm_setr_epi8(5, 6, 7, 4, 5, 6, 7, 4, 5, 6, 7, 4, 5, 6, 7, 4);
+    __m128i const word_3 = _mm_setr_epi8(12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15);
+    __m128i schedule[KEY_LANES][AES_MAX_ROUNDS + 1];
+    uint8_t rounds = aes_rounds(key_length);
+    for (size_t first = 0; first < count; first += KEY_LANES)
+    {
+        uint8_t lanes = count - first < KEY_LANES ? count - first : KEY_LANES;
+        uint8_t const *lane_keys[KEY_LANES];
+        for (uint8_t lane = 0; lane < KEY_LANES; lane++)
+            lane_keys[lane] = keys[first + (lane < lanes ? lane : lanes - 1)];
+
+        if (rounds == 10)
+        {
+            // 4 new words per step from the last 4
+            for (uint8_t lane = 0; lane < KEY_LANES; lane++)
+                schedule[lane][0] = _mm_loadu_si128((__m128i const*)lane_keys[lane]);
+            for (uint8_t step = 1; step <= 10; step++)
+            {
+                __m128i rcon = _mm_set1_epi32(Rcon[step - 1] >> 24);
+                for (uint8_t lane = 0; lane < KEY_LANES; lane++)
+                    schedule[lane][step] = aesni_key_mix(schedule[lane][step - 1], _mm_aesenclast_si128(_mm_shuffle_epi8(schedule[lane][step - 1], rotate_3), rcon));
+            }
+        }
+        else if (rounds == 12)
+        {
+            // 6 new words per step, 4 in low and 2 in the bottom of high (the top of high is left over), written one after another
+            // into words. 8 steps give 54 words for the 52 of 13 round keys.
+            uint8_t words[KEY_LANES][24 * 9];
+            __m128i low[KEY_LANES], high[KEY_LANES];
+            for (uint8_t lane = 0; lane < KEY_LANES; lane++)
+            {
+                low[lane] = _mm_loadu_si128((__m128i const*)lane_keys[lane]);
+                high[lane] = _mm_loadl_epi64((__m128i const*)(lane_keys[lane] + 16));
+                memcpy(words[lane], lane_keys[lane], 24);
+            }
+            for (uint8_t step = 1; step <= 8; step++)
+            {
+                __m128i rcon = _mm_set1_epi32(Rcon[step - 1] >> 24);
+                for (uint8_t lane = 0; lane < KEY_LANES; lane++)
+                {
+                    low[lane] = aesni_key_mix(low[lane], _mm_aesenclast_si128(_mm_shuffle_epi8(high[lane], rotate_1), rcon));
+                    high[lane] = _mm_xor_si128(_mm_xor_si128(high[lane], _mm_slli_si128(high[lane], 4)), _mm_shuffle_epi32(low[lane], 0xff));
+                    _mm_storeu_si128((__m128i*)(words[lane] + 24*step), low[lane]);
+                    _mm_storel_epi64((__m128i*)(words[lane] + 24*step + 16), high[lane]);
+                }
+            }
+            for (uint8_t lane = 0; lane < KEY_LANES; lane++)
+                for (uint8_t round = 0; round <= 12; round++)
+                    schedule[lane][round] = _mm_loadu_si128((__m128i const*)(words[lane] + 16*round));
+        }
+        else
+        {
+            // 8 new words per step, the second 4 with Subword only
+            for (uint8_t lane = 0; lane < KEY_LANES; lane++)
+            {
+                schedule[lane][0] = _mm_loadu_si128((__m128i const*)lane_keys[lane]);
+                schedule[lane][1] = _mm_loadu_si128((__m128i const*)(lane_keys[lane] + 16));
+            }
+            for (uint8_t step = 1; step <= 7; step++)
+            {
+                __m128i rcon = _mm_set1_epi32(Rcon[step - 1] >> 24);
+                for (uint8_t lane = 0; lane < KEY_LANES; lane++)
+                {
+                    schedule[lane][2*step] = aesni_key_mix(schedule[lane][2*step - 2], _mm_aesenclast_si128(_mm_shuffle_epi8(schedule[lane][2*step - 1], rotate_3), rcon));
+                    if (step < 7)
+                        schedule[lane][2*step + 1] = aesni_key_mix(schedule[lane][2*step - 1], _mm_aesenclast_si128(_mm_shuffle_epi8(schedule[lane][2*step], word_3), _mm_setzero_si128()));
+                }
+            }
+        }
+
+        for (uint8_t lane = 0; lane < lanes; lane++)
+            aesni_store_schedule(ctxs[first + lane], schedule[lane], rounds);
+    }
+}
+#endif
+
+// The key expansion in use, aesni_expand_keys() when the CPU has AES-NI (chosen by aes_init())
+keys_fun expand_keys = expand_keys_software;
+
+void use_best_key_expansion()
+{
+#ifdef AES_X86
+    expand_keys = aesni_available ? aesni_expand_keys : expand_keys_software;
+#endif
+}
+
+// Expands count keys of key_length bytes (16, 24 or 32), keys[n] into ctxs[n]. Returns 0, or -1 if the key length is not one of those.
+int aes_ctx_init_many(aes_ctx *ctxs, uint8_t const * const *keys, size_t key_length, size_t count)
+{
+    if (!aes_rounds(key_length))
+        return -1;
+    uint64_t stage_start = profile_begin();
+    aes_ctx *targets[KEY_BATCH];
+    for (size_t first = 0; first < count; first += KEY_BATCH)
+    {
+        size_t batch = count - first < KEY_BATCH ? count - first : KEY_BATCH;
+        for (size_t itr = 0; itr < batch; itr++)
+            targets[itr] = &ctxs[first + itr];
+        expand_keys(targets, keys + first, key_length, batch);
+    }
+    profile_end(STAGE_KEY_EXPANSION, stage_start);
+    return 0;
+}
+
+// Key cache
+// Keys that come back are kept expanded in a cache of a fixed no. of entries, the least recently used one making room for a new key.
+// Like aes_ctx the cache never allocates, the entries are given by the caller. A key is found by a 64-bit fingerprint (the bucket is
+// the fingerprint modulo the no. of entries, every entry also holds the first entry of one bucket) and then compared in full, in
+// constant time. One mutex protects the lists, it is only held for the lookup: a key that is not there is given the oldest entry,
+// which is marked as not ready, and expanded after the mutex is let go, in a batch with the other new keys of the same call.
+// Whoever finds an entry that is not ready yet waits for it. An acquired entry is pinned until it is released, and never evicted
+// while pinned, so the schedule can be used without holding any lock.
+#define KEY_CACHE_NONE UINT32_MAX
+
+typedef struct
+{
+    aes_ctx ctx;                // first, so that the entry can be found from the pointer given to the caller
+    uint8_t key[32];
+    uint8_t key_length;
+    atomic_uchar ready;         // set once ctx is expanded
+    atomic_uint pins;           // acquires without their release yet
+    uint64_t fingerprint;
+    uint32_t newer, older;      // the LRU list, from the newest entry to the oldest
+    uint32_t next;              // the next entry in the same bucket
+    uint32_t bucket;            // the first entry of the bucket with this entry's index
+} key_cache_entry;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    key_cache_entry *entries;
+    uint32_t capacity, used;
+    uint32_t newest, oldest;
+    uint64_t hits, misses, evictions;
+} key_cache;
+
+typedef struct
+{
+    uint64_t hits, misses, evictions;
+    size_t entries;
+} key_cache_stats;
+
+// Sets up a cache over the given array of capacity entries, returns 0 or -1 for a capacity of 0 or 2^32 - 1 and more
+int aes_key_cache_init(key_cache *cache, key_cache_entry *entries, size_t capacity)
+{
+    if (capacity == 0 || capacity >= KEY_CACHE_NONE)
+        return -1;
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->entries = entries;
+    cache->capacity = capacity;
+    cache->used = 0;
+    cache->newest = cache->oldest = KEY_CACHE_NONE;
+    cache->hits = cache->misses = cache->evictions = 0;
+    for (size_t itr = 0; itr < capacity; itr++)
+        entries[itr].bucket = KEY_CACHE_NONE;
+    return 0;
+}
+
+// Clears the keys and schedules out of the entries, nothing may be acquired any more
+void aes_key_cache_destroy(key_cache *cache)
+{
+    pthread_mutex_destroy(&cache->lock);
+    memset(cache->entries, 0, cache->capacity * sizeof(key_cache_entry));
+}
+
+static inline uint64_t key_fingerprint(uint8_t const *key, uint8_t key_length)
+{
+    uint64_t hash = key_length;
+    for (uint8_t itr = 0; itr < key_length; itr += 8)
+    {
+        hash = (hash ^ load_big64(key + itr)) * 0x9e3779b97f4a7c15;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+// Takes the entry out of the LRU list, or puts it in as the newest one
+void key_cache_unlink(key_cache *cache, uint32_t index)
+{
+    key_cache_entry *entry = &cache->entries[index];
+    if (entry->newer != KEY_CACHE_NONE)
+        cache->entries[entry->newer].older = entry->older;
+    else
+        cache->newest = entry->older;
+    if (entry->older != KEY_CACHE_NONE)
+        cache->entries[entry->older].newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+}
+
+void key_cache_push(key_cache *cache, uint32_t index)
+{
+    key_cache_entry *entry = &cache->entries[index];
+    entry->newer = KEY_CACHE_NONE;
+    entry->older = cache->newest;
+    if (cache->newest != KEY_CACHE_NONE)
+        cache->entries[cache->newest].newer = index;
+    else
+        cache->oldest = index;
+    cache->newest = index;
+}
+
+// With the lock held: the pinned entry of the key, found or newly taken (then missed is set), or KEY_CACHE_NONE when every entry is
+// pinned and none can be taken
+uint32_t key_cache_find(key_cache *cache, uint8_t const *key, uint8_t key_length, uint8_t *missed)
+{
+    key_cache_entry *entries = cache->entries;
+    uint64_t fingerprint = key_fingerprint(key, key_length);
+    uint32_t bucket = fingerprint % cache->capacity, index;
+    for (index = entries[bucket].bucket; index != KEY_CACHE_NONE; index = entries[index].next)
+        if (entries[index].fingerprint == fingerprint && entries[index].key_length == key_length && tags_equal(entries[index].key, key, key_length))
+        {
+            atomic_fetch_add(&entries[index].pins, 1);
+            key_cache_unlink(cache, index);
+            key_cache_push(cache, index);
+            cache->hits++;
+            *missed = 0;
+            return index;
+        }
+
+    cache->misses++;
+    if (cache->used < cache->capacity)
+        index = cache->used++;
+    else
+    {
+        for (index = cache->oldest; index != KEY_CACHE_NONE && atomic_load(&entries[index].pins) != 0; index = entries[index].newer)
+            ;
+        if (index == KEY_CACHE_NONE)
+            return KEY_CACHE_NONE;
+        uint32_t *link = &entries[entries[index].fingerprint % cache->capacity].bucket;
+        while (*link != index)
+            link = &entries[*link].next;
+        *link = entries[index].next;
+        key_cache_unlink(cache, index);
+        cache->evictions++;
+    }
+    key_cache_entry *entry = &entries[index];
+    memcpy(entry->key, key, key_length);
+    entry->key_length = key_length;
+    entry->fingerprint = fingerprint;
+    atomic_store(&entry->ready, 0);
+    atomic_store(&entry->pins, 1);
+    entry->next = entries[bucket].bucket;
+    entries[bucket].bucket = index;
+    key_cache_push(cache, index);
+    *missed = 1;
+    return index;
+}
+
+// Gets the expanded schedules of count keys of key_length bytes into ctxs, all pinned until given to aes_key_cache_release().
+// Returns 0, or -1 if the key length is wrong or some keys found every entry pinned (their ctxs are NULL then, the others are valid).
+int aes_key_cache_acquire_many(key_cache *cache, uint8_t const * const *keys, size_t key_length, size_t count, aes_ctx const **ctxs)
+{
+    if (!aes_rounds(key_length))
+        return -1;
+    int result = 0;
+    for (size_t first = 0; first < count; first += KEY_BATCH)
+    {
+        size_t batch = count - first < KEY_BATCH ? count - first : KEY_BATCH, misses = 0;
+        uint32_t found[KEY_BATCH], cold[KEY_BATCH];
+        aes_ctx *cold_ctxs[KEY_BATCH];
+        uint8_t const *cold_keys[KEY_BATCH];
+        pthread_mutex_lock(&cache->lock);
+        for (size_t itr = 0; itr < batch; itr++)
+        {
+            uint8_t missed;
+            found[itr] = key_cache_find(cache, keys[first + itr], key_length, &missed);
+            ctxs[first + itr] = found[itr] == KEY_CACHE_NONE ? NULL : &cache->entries[found[itr]].ctx;
+            if (found[itr] == KEY_CACHE_NONE)
+                result = -1;
+            else if (missed)
+            {
+                cold[misses] = found[itr];
+                cold_ctxs[misses] = &cache->entries[found[itr]].ctx;
+                cold_keys[misses++] = keys[first + itr];
+            }
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        if (misses > 0)
+        {
+            uint64_t stage_start = profile_begin();
+            expand_keys(cold_ctxs, cold_keys, key_length, misses);
+            profile_end(STAGE_KEY_EXPANSION, stage_start);
+            for (size_t itr = 0; itr < misses; itr++)
+                atomic_store_explicit(&cache->entries[cold[itr]].ready, 1, memory_order_release);
+        }
+        // Another thread may still be expanding a key it has just missed. Its own misses are ready before it waits for anything
+        // itself, so two threads can never wait for each other.
+        for (size_t itr = 0; itr < batch; itr++)
+            if (found[itr] != KEY_CACHE_NONE)
+                while (!atomic_load_explicit(&cache->entries[found[itr]].ready, memory_order_acquire))
+                    sched_yield();
+    }
+    return result;
+}
+
+// The schedule of one key, or NULL if every entry is pinned (or the key length is wrong)
+aes_ctx const *aes_key_cache_acquire(key_cache *cache, uint8_t const *key, size_t key_length)
+{
+    aes_ctx const *ctx;
+    return aes_key_cache_acquire_many(cache, &key, key_length, 1, &ctx) ? NULL : ctx;
+}
+
+// Unpins a schedule given by the acquire functions, it may be evicted from then on
+void aes_key_cache_release(aes_ctx const *ctx)
+{
+    atomic_fetch_sub(&((key_cache_entry*)ctx)->pins, 1);
+}
+
+void aes_key_cache_stats(key_cache *cache, key_cache_stats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->used;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Job queue
+// Request handlers that each encrypt a few blocks with their own key get little out of the multi block kernels on their own. Instead
+// they can submit jobs (a key schedule, a mode and the buffers) to a queue and go on. Worker threads take the jobs off in batches of
+// up to QUEUE_BATCH and run them together: CBC encryptions as multi-buffer streams, and the blocks of small ECB and CTR encryptions
+// (each job with its own key) through the "lanes" function of the kernel, so that even one block jobs keep it busy. Larger jobs and
+// the decryptions go through the multi block functions one job at a time. A finished job is given to its callback (on the worker
+// thread), or put in a completion ring for aes_queue_poll().
+// Both rings are the bounded queue of Dmitry Vyukov: every cell has a sequence no. that says whether it is free for the producer
+// of a given round or holds a job for the consumer, so a push or pop is one compare and swap on the position and never takes a lock.
+// Any no. of threads can submit, and any no. of workers take the jobs off. Idle workers sleep on a condition variable, and a submit
+// only touches the mutex when some worker is asleep. In the same way a worker that finds the completion ring full sleeps on another
+// one until aes_queue_poll() has made room.
+#define QUEUE_BATCH 64
+#define QUEUE_SMALL (16 * CTR_BATCH)       // ECB and CTR jobs shorter than this go through the lanes with the other small jobs
+
+enum { AES_MODE_ECB, AES_MODE_CTR, AES_MODE_CBC };
+
+typedef struct aes_job aes_job;
+struct aes_job
+{
+    aes_ctx const *ctx;
+    uint8_t mode;               // AES_MODE_ECB, AES_MODE_CTR or AES_MODE_CBC
+    uint8_t decrypt;            // CTR decrypts by encrypting
+    uint8_t iv[16];             // The first counter block for CTR, the IV for CBC (updated to the last ciphertext block)
+    uint8_t const *input;
+    uint8_t *output;            // Can be the same as input
+    size_t length;              // A multiple of 16 for ECB and CBC, any length for CTR
+    void (*done)(aes_job *job); // Called when the job is finished, or NULL to put the job in the completion ring
+    void *user;                 // For the caller
+    int status;                 // 0 when done, -1 if the length was wrong
+};
+
+typedef struct
+{
+    atomic_size_t sequence;
+    aes_job *job;
+} ring_cell;
+
+typedef struct
+{
+    ring_cell *cells;
+    size_t mask;
+    atomic_size_t head __attribute__((aligned(64)));     // the next cell to push into
+    atomic_size_t tail __attribute__((aligned(64)));     // the next cell to pop from
+} job_ring;
+
+typedef struct
+{
+    job_ring submitted, completed;
+    pthread_t *workers;
+    unsigned worker_count;
+    atomic_uint sleeping;               // workers waiting for jobs
+    atomic_uint blocked;                // workers waiting for room in the completion ring
+    atomic_size_t dropped;              // finished jobs that never got into it, because the queue was destroyed first
+    atomic_uchar stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, room;
+} aes_queue;
+
+// A cell at position p is free for the push of position p when its sequence is p, and holds the job for the pop of position p when
+// it is p + 1. The pop then sets it to p + capacity, which is the next round's push.
+int ring_init(job_ring *ring, size_t capacity)
+{
+    ring->cells = malloc(capacity * sizeof(ring_cell));
+    if (ring->cells == NULL)
+        return -1;
+    for (size_t itr = 0; itr < capacity; itr++)
+        atomic_init(&ring->cells[itr].sequence, itr);
+    ring->mask = capacity - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+// Returns 0, or -1 if the ring is full
+int ring_push(job_ring *ring, aes_job *job)
+{
+    size_t position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (1)
+    {
+        ring_cell *cell = &ring->cells[position & ring->mask];
+        intptr_t diff = (intptr_t)atomic_load_explicit(&cell->sequence, memory_order_acquire) - (intptr_t)position;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                cell->job = job;
+                atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+                return 0;
+            }
+        }
+        else if (diff < 0)
+            return -1;
+        else
+            position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    }
+}
+
+// Returns the oldest job, or NULL if the ring is empty
+aes_job *ring_pop(job_ring *ring)
+{
+    size_t position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (1)
+    {
+        ring_cell *cell = &ring->cells[position & ring->mask];
+        intptr_t diff = (intptr_t)atomic_load_explicit(&cell->sequence, memory_order_acquire) - (intptr_t)(position + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                aes_job *job = cell->job;
+                atomic_store_explicit(&cell->sequence, position + ring->mask + 1, memory_order_release);
+                return job;
+            }
+        }
+        else if (diff < 0)
+            return NULL;
+        else
+            position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+}
+
+static inline uint8_t queue_small(aes_job const *job)
+{
+    return job->status == 0 && job->length < QUEUE_SMALL && (job->mode == AES_MODE_CTR || (job->mode == AES_MODE_ECB && !job->decrypt));
+}
+
+// Runs the blocks gathered from the small jobs, one lane each. Lanes are added up to a multiple of 8 like in cbc_encrypt_lanes().
+void queue_flush_lanes(uint8_t (*blocks) [16], uint8_t const (**keys) [16], aes_job **owners, size_t *indexes, size_t used, uint8_t rounds)
+{
+    size_t lanes = (used + 7) & ~(size_t)7;
+    for (size_t lane = used; lane < lanes; lane++)
+        keys[lane] = keys[0];
+    aes_encrypt_lanes(blocks, keys, lanes, rounds);
+    for (size_t lane = 0; lane < used; lane++)
+    {
+        aes_job *job = owners[lane];
+        size_t offset = 16 * indexes[lane];
+        if (job->mode == AES_MODE_ECB)
+            memcpy(job->output + offset, blocks[lane], 16);
+        else
+            xor_bytes(job->output + offset, job->input + offset, blocks[lane], job->length - offset < 16 ? job->length - offset : 16);
+    }
+}
+
+// The blocks of all the small jobs with the given no. of rounds: the plaintext blocks for ECB, the counter blocks for CTR
+void queue_small_jobs(aes_job **jobs, size_t count, uint8_t rounds)
+{
+    uint8_t blocks[MULTI_LANES][16] __attribute__((aligned(16)));
+    uint8_t const (*keys[MULTI_LANES]) [16];
+    aes_job *owners[MULTI_LANES];
+    size_t indexes[MULTI_LANES], used = 0;
+    for (size_t itr = 0; itr < count; itr++)
+    {
+        aes_job *job = jobs[itr];
+        if (!queue_small(job) || job->ctx->rounds != rounds)
+            continue;
+        for (size_t block = 0; block < (job->length + 15) / 16; block++)
+        {
+            if (job->mode == AES_MODE_ECB)
+                memcpy(blocks[used], job->input + 16*block, 16);
+            else
+            {
+                memcpy(blocks[used], job->iv, 16);
+                counter_add(blocks[used], block);
+            }
+            keys[used] = job->ctx->round_keys;
+            owners[used] = job;
+            indexes[used] = block;
+            if (++used == aes_lane_count)
+            {
+                queue_flush_lanes(blocks, keys, owners, indexes, used, rounds);
+                used = 0;
+            }
+        }
+    }
+    if (used > 0)
+        queue_flush_lanes(blocks, keys, owners, indexes, used, rounds);
+}
+
+// The completion ring is full: sleep until a poll takes jobs out of it. As for an idle worker, the ring is tried again after saying
+// so in blocked, and a poll checks blocked after its pop. A job that still has no room when the queue is destroyed is dropped.
+void queue_wait_for_room(aes_queue *queue, aes_job *job)
+{
+    int full;
+    pthread_mutex_lock(&queue->lock);
+    atomic_fetch_add(&queue->blocked, 1);
+    while ((full = ring_push(&queue->completed, job) != 0) && !atomic_load(&queue->stopping))
+        pthread_cond_wait(&queue->room, &queue->lock);
+    atomic_fetch_sub(&queue->blocked, 1);
+    pthread_mutex_unlock(&queue->lock);
+    if (full)
+        atomic_fetch_add(&queue->dropped, 1);
+}
+
+void queue_run_jobs(aes_queue *queue, aes_job **jobs, size_t count)
+{
+    cbc_stream streams[QUEUE_BATCH];
+    aes_job *stream_jobs[QUEUE_BATCH];
+    size_t stream_count = 0;
+    for (size_t itr = 0; itr < count; itr++)
+    {
+        aes_job *job = jobs[itr];
+        job->status = job->mode != AES_MODE_CTR && job->length % 16 ? -1 : 0;
+        if (job->status != 0 || queue_small(job))
+            continue;
+        if (job->mode == AES_MODE_CBC && !job->decrypt)
+        {
+            streams[stream_count] = (cbc_stream){ job->ctx, { 0 }, job->input, job->output, job->length / 16 };
+            memcpy(streams[stream_count].iv, job->iv, 16);
+            stream_jobs[stream_count++] = job;
+        }
+        else if (job->mode == AES_MODE_CBC)
+            aes_cbc_decrypt(job->ctx, job->iv, job->input, job->output, job->length / 16, 1);
+        else if (job->mode == AES_MODE_CTR)
+            ctr_range(job->ctx, job->iv, 0, job->input, job->output, job->length);
+        else if (job->decrypt)
+            aes_ctx_decrypt(job->ctx, job->input, job->output, job->length / 16);
+        else
+            aes_ctx_encrypt(job->ctx, job->input, job->output, job->length / 16);
+    }
+    if (stream_count > 0)
+    {
+        aes_cbc_encrypt_multi(streams, stream_count, 1);
+        for (size_t itr = 0; itr < stream_count; itr++)
+            memcpy(stream_jobs[itr]->iv, streams[itr].iv, 16);
+    }
+    queue_small_jobs(jobs, count, 10);
+    queue_small_jobs(jobs, count, 12);
+    queue_small_jobs(jobs, count, 14);
+
+    for (size_t itr = 0; itr < count; itr++)
+    {
+        if (jobs[itr]->done != NULL)
+            jobs[itr]->done(jobs[itr]);
+        else if (ring_push(&queue->completed, jobs[itr]) != 0)
+            queue_wait_for_room(queue, jobs[itr]);
+    }
+}
+
+// Adds submitted jobs to the batch until it is full or the ring is empty, returns the new no. of jobs in it
+size_t queue_take(aes_queue *queue, aes_job **jobs, size_t count)
+{
+    while (count < QUEUE_BATCH && (jobs[count] = ring_pop(&queue->submitted)) != NULL)
+        count++;
+    return count;
+}
+
+void *queue_worker(void *arg)
+{
+    aes_queue *queue = arg;
+    aes_job *jobs[QUEUE_BATCH];
+    while (1)
+    {
+        size_t count = queue_take(queue, jobs, 0);
+        if (count == 0)
+        {
+            // Nothing to do: sleep until a submit wakes us. The ring is checked again after saying so in sleeping, and a submit
+            // checks sleeping after its push, so one of the two always sees the other.
+            pthread_mutex_lock(&queue->lock);
+            atomic_fetch_add(&queue->sleeping, 1);
+            while ((jobs[0] = ring_pop(&queue->submitted)) == NULL && !atomic_load(&queue->stopping))
+                pthread_cond_wait(&queue->wake, &queue->lock);
+            atomic_fetch_sub(&queue->sleeping, 1);
+            pthread_mutex_unlock(&queue->lock);
+            if (jobs[0] == NULL)
+                return NULL;
+            count = queue_take(queue, jobs, 1);
+        }
+        queue_run_jobs(queue, jobs, count);
+    }
+}
+
+size_t aes_queue_destroy(aes_queue *queue);
+
+// Makes the rings for capacity jobs (a power of 2) and starts the given no. of workers (0 for one per core). Returns 0 or -1.
+int aes_queue_init(aes_queue *queue, size_t capacity, unsigned workers)
+{
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+        return -1;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers == 0)
+        workers = cores > 0 ? cores : 1;
+    queue->submitted.cells = queue->completed.cells = NULL;
+    queue->workers = malloc(workers * sizeof(pthread_t));
+    if (queue->workers == NULL || ring_init(&queue->submitted, capacity) != 0 || ring_init(&queue->completed, capacity) != 0)
+    {
+        free(queue->workers);
+        free(queue->submitted.cells);
+        return -1;
+    }
+    atomic_init(&queue->sleeping, 0);
+    atomic_init(&queue->blocked, 0);
+    atomic_init(&queue->dropped, 0);
+    atomic_init(&queue->stopping, 0);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->wake, NULL);
+    pthread_cond_init(&queue->room, NULL);
+    for (queue->worker_count = 0; queue->worker_count < workers; queue->worker_count++)
+        if (pthread_create(&queue->workers[queue->worker_count], NULL, queue_worker, queue) != 0)
+            break;
+    if (queue->worker_count == 0)
+    {
+        aes_queue_destroy(queue);
+        return -1;
+    }
+    return 0;
+}
+
+// Queues a job, which has to stay where it is until it is finished. Returns 0, or -1 if the queue is full (then finished jobs have
+// to be taken out of the completion ring, or the workers given time, before trying again).
+int aes_queue_submit(aes_queue *queue, aes_job *job)
+{
+    if (ring_push(&queue->submitted, job) != 0)
+        return -1;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&queue->sleeping) > 0)
+    {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_signal(&queue->wake);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return 0;
+}
+
+// Takes up to max finished jobs (the ones without a callback) out of the completion ring, returns how many
+size_t aes_queue_poll(aes_queue *queue, aes_job **jobs, size_t max)
+{
+    size_t count = 0;
+    while (count < max && (jobs[count] = ring_pop(&queue->completed)) != NULL)
+        count++;
+    if (count == 0)
+        return 0;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&queue->blocked) > 0)
+    {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_broadcast(&queue->room);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return count;
+}
+
+// Finishes the jobs already submitted, stops the workers and frees the rings. Returns the no. of finished jobs without a callback
+// that were never taken out with aes_queue_poll() and are now dropped: the ones left in the completion ring and the ones that found
+// it full. It is 0 when the caller has polled for all its jobs before.
+size_t aes_queue_destroy(aes_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    atomic_store(&queue->stopping, 1);
+    pthread_cond_broadcast(&queue->wake);
+    pthread_cond_broadcast(&queue->room);
+    pthread_mutex_unlock(&queue->lock);
+    for (unsigned itr = 0; itr < queue->worker_count; itr++)
+        pthread_join(queue->workers[itr], NULL);
+    size_t dropped = atomic_load(&queue->dropped);
+    while (ring_pop(&queue->completed) != NULL)
+        dropped++;
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->wake);
+    pthread_cond_destroy(&queue->room);
+    free(queue->workers);
+    free(queue->submitted.cells);
+    free(queue->completed.cells);
+    return dropped;
+}
+
+// Random numbers (CTR_DRBG, NIST SP 800-90A section 10.2)
+// The generator is AES-256 in counter mode: its state is a key and a counter block V, the output is the encryption of V + 1, V + 2,
+// ... and after every request the state is replaced with more of the same keystream (the update function), so that output already
+// given cannot be worked out from a later state. It is used without the derivation function: the 48 byte seed (the size of the key
+// plus V) comes straight from getentropy() and is used as it is.
+// get_random_bytes() keeps one generator per thread with DRBG_BUFFER bytes of output made in advance, so it is usually a memcpy out of
+// the thread's buffer, with no lock and no system call. The buffer is filled with one request through the multi block functions and
+// the bytes are cleared as they are handed out. The thread reseeds after DRBG_RESEED_INTERVAL requests (SP 800-90A allows up to 2^48),
+// and after a fork(): the child has a copy of its parent's state and would give the same bytes.
+#define DRBG_SEED_LENGTH 48
+#define DRBG_MAX_REQUEST ((size_t)1 << 16)         // 2^19 bits, the most one request may give
+#define DRBG_BUFFER ((size_t)16 * 1024)
+#define DRBG_RESEED_INTERVAL ((uint64_t)1 << 20)
+
+typedef struct
+{
+    aes_ctx key;
+    uint8_t v[16];
+    uint64_t reseed_counter;
+} ctr_drbg;
+
+// The update function: the next 48 bytes of keystream, XORed with the provided data (48 bytes, or NULL for zeros), are the new key and V
+void drbg_update(ctr_drbg *drbg, uint8_t const *provided)
+{
+    uint8_t temp[DRBG_SEED_LENGTH];
+    for (uint8_t itr = 0; itr < DRBG_SEED_LENGTH / 16; itr++)
+    {
+        counter_add(drbg->v, 1);
+        aes_encrypt_block(drbg->v, temp + 16*itr, drbg->key.round_keys, drbg->key.rounds);
+    }
+    if (provided != NULL)
+        xor_bytes(temp, temp, provided, DRBG_SEED_LENGTH);
+    aes_ctx_init(&drbg->key, temp, 32);
+    memcpy(drbg->v, temp + 32, 16);
+    memset(temp, 0, sizeof(temp));
+}
+
+// Without the derivation function the personalization string and the additional input are at most 48 bytes, padded with zeros
+static inline void drbg_pad(uint8_t *padded, uint8_t const *data, size_t length)
+{
+    memset(padded, 0, DRBG_SEED_LENGTH);
+    if (data != NULL)
+        memcpy(padded, data, length < DRBG_SEED_LENGTH ? length : DRBG_SEED_LENGTH);
+}
+
+// Starts the generator from 48 bytes of entropy and an optional personalization string
+void ctr_drbg_instantiate(ctr_drbg *drbg, uint8_t const *entropy, uint8_t const *personalization, size_t personalization_length)
+{
+    uint8_t seed[DRBG_SEED_LENGTH], zero_key[32] = { 0 };
+    drbg_pad(seed, personalization, personalization_length);
+    xor_bytes(seed, seed, entropy, DRBG_SEED_LENGTH);
+    aes_ctx_init(&drbg->key, zero_key, 32);
+    memset(drbg->v, 0, 16);
+    drbg_update(drbg, seed);
+    drbg->reseed_counter = 1;
+    memset(seed, 0, sizeof(seed));
+}
+
+// Mixes 48 bytes of new entropy (and optional additional input) into the state
+void ctr_drbg_reseed(ctr_drbg *drbg, uint8_t const *entropy, uint8_t const *additional, size_t additional_length)
+{
+    uint8_t seed[DRBG_SEED_LENGTH];
+    drbg_pad(seed, additional, additional_length);
+    xor_bytes(seed, seed, entropy, DRBG_SEED_LENGTH);
+    drbg_update(drbg, seed);
+    drbg->reseed_counter = 1;
+    memset(seed, 0, sizeof(seed));
+}
+
+// Writes length bytes (at most DRBG_MAX_REQUEST) of output. Returns 0, or -1 if the length is too big or a reseed is due.
+int ctr_drbg_generate(ctr_drbg *drbg, uint8_t *output, size_t length, uint8_t const *additional, size_t additional_length)
+{
+    if (length > DRBG_MAX_REQUEST || drbg->reseed_counter > DRBG_RESEED_INTERVAL)
+        return -1;
+    uint8_t padded[DRBG_SEED_LENGTH], start[16];
+    if (additional != NULL && additional_length > 0)
+    {
+        drbg_pad(padded, additional, additional_length);
+        drbg_update(drbg, padded);
+    }
+    else
+        memset(padded, 0, DRBG_SEED_LENGTH);
+    // The output is counter mode over zeros from V + 1 on
+    memcpy(start, drbg->v, 16);
+    counter_add(start, 1);
+    memset(output, 0, length);
+    ctr_range(&drbg->key, start, 0, output, output, length);
+    counter_add(drbg->v, (length + 15) / 16);
+    drbg_update(drbg, padded);
+    drbg->reseed_counter++;
+    return 0;
+}
+
+// The state of each thread, and the no. of fork() calls made by the process (counted in the child)
+_Thread_local struct
+{
+    ctr_drbg drbg;
+    uint8_t buffer[DRBG_BUFFER];
+    size_t available;           // the bytes not handed out yet, at the end of the buffer
+    unsigned forks;             // the value of drbg_forks when the thread seeded
+    uint8_t seeded;
+} thread_drbg;
+
+atomic_uint drbg_forks;
+pthread_once_t drbg_fork_handler = PTHREAD_ONCE_INIT;
+
+void drbg_count_fork()
+{
+    atomic_fetch_add(&drbg_forks, 1);
+}
+
+void drbg_register_fork_handler()
+{
+    pthread_atfork(NULL, NULL, drbg_count_fork);
+}
+
+// Seeds (or reseeds) the generator of the calling thread, returns 0 or -1 if the system has no entropy to give
+int drbg_thread_seed()
+{
+    uint8_t entropy[DRBG_SEED_LENGTH];
+    pthread_once(&drbg_fork_handler, drbg_register_fork_handler);
+    if (getentropy(entropy, sizeof(entropy)) != 0)
+        return -1;
+    // The thread's address tells the instances of different threads apart even if the entropy did not
+    void *self = &thread_drbg;
+    if (thread_drbg.seeded && thread_drbg.forks == atomic_load(&drbg_forks))
+        ctr_drbg_reseed(&thread_drbg.drbg, entropy, NULL, 0);
+    else
+    {
+        ctr_drbg_instantiate(&thread_drbg.drbg, entropy, (uint8_t const*)&self, sizeof(self));
+        memset(thread_drbg.buffer, 0, DRBG_BUFFER);
+        thread_drbg.available = 0;
+    }
+    thread_drbg.forks = atomic_load(&drbg_forks);
+    thread_drbg.seeded = 1;
+    memset(entropy, 0, sizeof(entropy));
+    return 0;
+}
+
+// Fills output with length random bytes. Returns 0, or -1 if the generator could not be seeded or refused a request.
+int get_random_bytes(uint8_t *output, size_t length)
+{
+    if (!thread_drbg.seeded || thread_drbg.forks != atomic_load_explicit(&drbg_forks, memory_order_relaxed))
+        if (drbg_thread_seed() != 0)
+            return -1;
+    while (length > 0)
+    {
+        if (thread_drbg.available == 0)
+        {
+            if (thread_drbg.drbg.reseed_counter > DRBG_RESEED_INTERVAL && drbg_thread_seed() != 0)
+                return -1;
+            // A request larger than the buffer is written straight into the output
+            if (length >= DRBG_BUFFER)
+            {
+                size_t bytes = length < DRBG_MAX_REQUEST ? length : DRBG_MAX_REQUEST;
+                if (ctr_drbg_generate(&thread_drbg.drbg, output, bytes, NULL, 0) != 0)
+                    return -1;
+                output += bytes;
+                length -= bytes;
+                continue;
+            }
+            if (ctr_drbg_generate(&thread_drbg.drbg, thread_drbg.buffer, DRBG_BUFFER, NULL, 0) != 0)
+                return -1;
+            thread_drbg.available = DRBG_BUFFER;
+        }
+        size_t bytes = length < thread_drbg.available ? length : thread_drbg.available;
+        uint8_t *start = thread_drbg.buffer + DRBG_BUFFER - thread_drbg.available;
+        memcpy(output, start, bytes);
+        memset(start, 0, bytes);
+        thread_drbg.available -= bytes;
+        output += bytes;
+        length -= bytes;
+    }
+    return 0;
+}
+
+// Message authentication (CMAC, NIST SP 800-38B, and PMAC)
+// CMAC is CBC encryption of the message with a zero IV where only the last ciphertext block is kept as the tag. Before the last block
+// is encrypted one of two subkeys is XORed into it: K1 if the block is full, K2 if it had to be padded with a 1 bit and zeros, so a
+// message cannot be extended or padded into another with the same tag. K1 is E(K, 0) times x and K2 is K1 times x in GF(2^128),
+// here with the first byte holding the highest powers and the polynomial x^128 + x^7 + x^2 + x + 1 (the same doubling as XTS, with
+// the bytes the other way round). Like any CBC encryption it is serial: every block waits for the one before it.
+// PMAC (Black and Rogaway) gives a tag of the same size without that chain. Every block but the last is XORed with its own offset and
+// encrypted on its own, the results are XORed together, the last block is XORed in and the sum encrypted once more. The offset of
+// block i is the XOR of L(j) = E(K, 0) x^j for each bit j set in the Gray code of i, so going from one block to the next is a single
+// XOR with L(no. of trailing zeros of i), and any range of blocks can start from its own first offset. The blocks go through the
+// multi block functions CTR_BATCH at a time and a long message is cut into tasks for the thread pool, each adding its part of the sum.
+// Both keep at most one block of a message in their state, which is held back by update() until it is known whether it is the last.
+#define PMAC_LEVELS 64          // L(0) to L(63), enough for 2^64 blocks
+#define MAC_MIN_TAG 8           // the shortest tag the verify functions accept, 64 bits as SP 800-38B recommends
+
+typedef struct
+{
+    aes_ctx aes;
+    uint8_t k1[16], k2[16];
+} cmac_ctx;
+
+typedef struct
+{
+    cmac_ctx const *cmac;
+    uint8_t chain[16];          // the CBC state, the encryption of the blocks so far
+    uint8_t block[16];          // the last block given, not yet in the chain
+    uint8_t used;               // the no. of bytes in it
+} cmac_state;
+
+typedef struct
+{
+    aes_ctx aes;
+    uint8_t l[PMAC_LEVELS][16];
+    uint8_t l_inverse[16];      // L(0) divided by x, for a full last block
+} pmac_ctx;
+
+typedef struct
+{
+    pmac_ctx const *pmac;
+    uint8_t sum[16];
+    uint8_t block[16];
+    uint8_t used;
+    uint64_t blocks;            // the no. of blocks already in the sum
+} pmac_state;
+
+// value * x in GF(2^128), without a branch on the bit that falls off
+static inline void mac_double(uint8_t *output, uint8_t const *value)
+{
+    uint64_t high = load_big64(value), low = load_big64(value + 8);
+    uint64_t carry = high >> 63;
+    store_big64(output, (high << 1) | (low >> 63));
+    store_big64(output + 8, (low << 1) ^ (0x87 & (0 - carry)));
+}
+
+// value / x, the same backwards: x^-1 is x^127 + x^6 + x + 1, which is added when the lowest bit is shifted out
+static inline void mac_halve(uint8_t *output, uint8_t const *value)
+{
+    uint64_t high = load_big64(value), low = load_big64(value + 8);
+    uint64_t carry = 0 - (low & 1);
+    store_big64(output, (high >> 1) ^ (carry & 0x8000000000000000ULL));
+    store_big64(output + 8, ((low >> 1) | (high << 63)) ^ (carry & 0x43));
+}
+
+// Makes K1 and K2 from the expanded key already in the context
+void cmac_make_subkeys(cmac_ctx *cmac)
+{
+    uint8_t zero[16] = { 0 };
+    aes_encrypt_block(zero, cmac->k1, cmac->aes.round_keys, cmac->aes.rounds);
+    mac_double(cmac->k1, cmac->k1);
+    mac_double(cmac->k2, cmac->k1);
+}
+
+// Returns 0, or -1 if the key length is not 16, 24 or 32
+int aes_cmac_init(cmac_ctx *cmac, uint8_t const *key, size_t key_length)
+{
+    if (aes_ctx_init(&cmac->aes, key, key_length) != 0)
+        return -1;
+    cmac_make_subkeys(cmac);
+    return 0;
+}
+
+void aes_cmac_start(cmac_state *state, cmac_ctx const *cmac)
+{
+    state->cmac = cmac;
+    memset(state->chain, 0, 16);
+    state->used = 0;
+}
+
+// Adds the next length bytes of the message, the pieces can have any length
+void aes_cmac_update(cmac_state *state, uint8_t const *data, size_t length)
+{
+    aes_ctx const *aes = &state->cmac->aes;
+    size_t room = 16 - (size_t)state->used;
+    size_t fill = room < length ? room : length;
+    memcpy(state->block + state->used, data, fill);
+    state->used += fill;
+    data += fill;
+    length -= fill;
+    if (length == 0)
+        return;
+    // More data follows, so the held block was not the last one
+    xor_bytes(state->chain, state->chain, state->block, 16);
+    aes_encrypt_block(state->chain, state->chain, aes->round_keys, aes->rounds);
+    for (; length > 16; data += 16, length -= 16)
+    {
+        xor_bytes(state->chain, state->chain, data, 16);
+        aes_encrypt_block(state->chain, state->chain, aes->round_keys, aes->rounds);
+    }
+    memcpy(state->block, data, length);
+    state->used = length;
+}
+
+// Writes the 16 byte tag, the state has to be started again for another message
+void aes_cmac_finish(cmac_state *state, uint8_t *tag)
+{
+    cmac_ctx const *cmac = state->cmac;
+    if (state->used == 16)
+        xor_bytes(state->block, state->block, cmac->k1, 16);
+    else
+    {
+        memset(state->block + state->used, 0, 16 - state->used);
+        state->block[state->used] = 0x80;
+        xor_bytes(state->block, state->block, cmac->k2, 16);
+    }
+    xor_bytes(state->chain, state->chain, state->block, 16);
+    aes_encrypt_block(state->chain, tag, cmac->aes.round_keys, cmac->aes.rounds);
+    memset(state, 0, sizeof(*state));
+}
+
+void aes_cmac(cmac_ctx const *cmac, uint8_t const *data, size_t length, uint8_t *tag)
+{
+    cmac_state state;
+    aes_cmac_start(&state, cmac);
+    aes_cmac_update(&state, data, length);
+    aes_cmac_finish(&state, tag);
+}
+
+// Returns 0 if tag (tag_length bytes, from MAC_MIN_TAG to 16) is the tag of the message, and -1 if not or if its length is outside
+// that range: a tag of a few bytes could simply be guessed.
+int aes_cmac_verify(cmac_ctx const *cmac, uint8_t const *data, size_t length, uint8_t const *tag, size_t tag_length)
+{
+    uint8_t expected[16];
+    aes_cmac(cmac, data, length, expected);
+    return tag_length >= MAC_MIN_TAG && tag_length <= 16 && tags_equal(expected, tag, tag_length) ? 0 : -1;
+}
+
+// Makes the L(j) from the expanded key already in the context
+void pmac_make_offsets(pmac_ctx *pmac)
+{
+    memset(pmac->l[0], 0, 16);
+    aes_encrypt_block(pmac->l[0], pmac->l[0], pmac->aes.round_keys, pmac->aes.rounds);
+    for (uint8_t itr = 1; itr < PMAC_LEVELS; itr++)
+        mac_double(pmac->l[itr], pmac->l[itr - 1]);
+    mac_halve(pmac->l_inverse, pmac->l[0]);
+}
+
+int aes_pmac_init(pmac_ctx *pmac, uint8_t const *key, size_t key_length)
+{
+    if (aes_ctx_init(&pmac->aes, key, key_length) != 0)
+        return -1;
+    pmac_make_offsets(pmac);
+    return 0;
+}
+
+// XORs into sum the encryptions of the given no. of blocks, the first of them being block no. first (counting from 1)
+void pmac_range(pmac_ctx const *pmac, uint64_t first, uint8_t const *data, size_t blocks, uint8_t *sum)
+{
+    uint8_t buffer[CTR_BATCH][16] __attribute__((aligned(16)));
+    uint8_t offset[16] = { 0 }, total[16] = { 0 };
+    uint64_t gray = (first - 1) ^ ((first - 1) >> 1);
+    for (uint8_t bit = 0; bit < PMAC_LEVELS; bit++)
+        if (gray >> bit & 1)
+            xor_bytes(offset, offset, pmac->l[bit], 16);
+
+    uint64_t index = first;
+    while (blocks > 0)
+    {
+        size_t batch = blocks < CTR_BATCH ? blocks : CTR_BATCH;
+        for (size_t itr = 0; itr < batch; itr++, index++)
+        {
+            xor_bytes(offset, offset, pmac->l[__builtin_ctzll(index)], 16);
+            xor_bytes(buffer[itr], data + 16*itr, offset, 16);
+        }
+        aes_encrypt_blocks(buffer[0], buffer[0], batch, pmac->aes.round_keys, pmac->aes.rounds);
+        for (size_t itr = 0; itr < batch; itr++)
+            xor_bytes(total, total, buffer[itr], 16);
+        data += 16*batch;
+        blocks -= batch;
+    }
+    xor_bytes(sum, sum, total, 16);
+}
+
+// The tasks of one call add their parts into the sum with atomic XORs, in any order
+typedef struct
+{
+    pmac_ctx const *pmac;
+    uint64_t first;
+    uint8_t const *data;
+    size_t blocks;
+    _Atomic uint64_t sum[2];
+} pmac_job;
+
+void pmac_task(void *arg, size_t task)
+{
+    pmac_job *job = arg;
+    size_t per_task = CTR_CHUNK / 16, start = task * per_task;
+    size_t blocks = job->blocks - start < per_task ? job->blocks - start : per_task;
+    uint8_t part[16] = { 0 };
+    pmac_range(job->pmac, job->first + start, job->data + 16*start, blocks, part);
+    atomic_fetch_xor(&job->sum[0], load_big64(part));
+    atomic_fetch_xor(&job->sum[1], load_big64(part + 8));
+}
+
+void pmac_blocks(pmac_state *state, uint8_t const *data, size_t blocks, unsigned threads)
+{
+    size_t tasks = (blocks + CTR_CHUNK / 16 - 1) / (CTR_CHUNK / 16);
+    if (tasks <= 1)
+        pmac_range(state->pmac, state->blocks + 1, data, blocks, state->sum);
+    else
+    {
+        pmac_job job = { state->pmac, state->blocks + 1, data, blocks, { 0, 0 } };
+        uint8_t part[16];
+        parallel_for(tasks, threads, pmac_task, &job);
+        store_big64(part, atomic_load(&job.sum[0]));
+        store_big64(part + 8, atomic_load(&job.sum[1]));
+        xor_bytes(state->sum, state->sum, part, 16);
+    }
+    state->blocks += blocks;
+}
+
+void aes_pmac_start(pmac_state *state, pmac_ctx const *pmac)
+{
+    state->pmac = pmac;
+    memset(state->sum, 0, 16);
+    state->used = 0;
+    state->blocks = 0;
+}
+
+// Adds the next length bytes of the message using at most the given no. of threads (0 for all cores), the pieces can have any length
+void aes_pmac_update(pmac_state *state, uint8_t const *data, size_t length, unsigned threads)
+{
+    size_t room = 16 - (size_t)state->used;
+    size_t fill = room < length ? room : length;
+    memcpy(state->block + state->used, data, fill);
+    state->used += fill;
+    data += fill;
+    length -= fill;
+    if (length == 0)
+        return;
+    pmac_blocks(state, state->block, 1, 1);
+    // Everything but the last block, even if that one is full
+    size_t blocks = (length - 1) / 16;
+    pmac_blocks(state, data, blocks, threads);
+    memcpy(state->block, data + 16*blocks, length - 16*blocks);
+    state->used = length - 16*blocks;
+}
+
+void aes_pmac_finish(pmac_state *state, uint8_t *tag)
+{
+    pmac_ctx const *pmac = state->pmac;
+    if (state->used == 16)
+        xor_bytes(state->block, state->block, pmac->l_inverse, 16);
+    else
+    {
+        memset(state->block + state->used, 0, 16 - state->used);
+        state->block[state->used] = 0x80;
+    }
+    xor_bytes(state->sum, state->sum, state->block, 16);
+    aes_encrypt_block(state->sum, tag, pmac->aes.round_keys, pmac->aes.rounds);
+    memset(state, 0, sizeof(*state));
+}
+
+void aes_pmac(pmac_ctx const *pmac, uint8_t const *data, size_t length, uint8_t *tag, unsigned threads)
+{
+    pmac_state state;
+    aes_pmac_start(&state, pmac);
+    aes_pmac_update(&state, data, length, threads);
+    aes_pmac_finish(&state, tag);
+}
+
+// The same for PMAC
+int aes_pmac_verify(pmac_ctx const *pmac, uint8_t const *data, size_t length, uint8_t const *tag, size_t tag_length, unsigned threads)
+{
+    uint8_t expected[16];
+    aes_pmac(pmac, data, length, expected, threads);
+    return tag_length >= MAC_MIN_TAG && tag_length <= 16 && tags_equal(expected, tag, tag_length) ? 0 : -1;
+}
+
+// Known answer tests
+// Every implementation has to give the ciphertexts published with the standards. The vectors are kept as hex strings, exactly as they
+// are printed in FIPS-197 and NIST SP 800-38A, so they can be checked against the documents by eye.
+typedef struct
+{
+    char const *source;
+    char const *key;
+    char const *plaintext;
+    char const *ciphertext;
+} block_vector;
+
+block_vector const BLOCK_VECTORS[] = {
+    { "FIPS-197 Appendix B", "2b7e151628aed2a6abf7158809cf4f3c", "3243f6a8885a308d313198a2e0370734", "3925841d02dc09fbdc118597196a0b32" },
+    { "FIPS-197 Appendix C.1", "000102030405060708090a0b0c0d0e0f", "00112233445566778899aabbccddeeff", "69c4e0d86a7b0430d8cdb78070b4c55a" },
+    { "FIPS-197 Appendix C.2", "000102030405060708090a0b0c0d0e0f1011121314151617", "00112233445566778899aabbccddeeff", "dda97ca4864cdfe06eaf70a0ec0d7191" },
+    { "FIPS-197 Appendix C.3", "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", "00112233445566778899aabbccddeeff",
+      "8ea2b7ca516745bfeafc49904b496089" },
+    { "SP 800-38A F.1.1 ECB-AES128", "2b7e151628aed2a6abf7158809cf4f3c",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+      "3ad77bb40d7a3660a89ecaf32466ef97f5d3d58503b9699de785895a96fdbaaf43b1cd7f598ece23881b00e3ed0306887b0c785e27e8ad3f8223207104725dd4" },
+    { "SP 800-38A F.1.3 ECB-AES192", "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+      "bd334f1d6e45f25ff712a214571fa5cc974104846d0ad3ad7734ecb3ecee4eefef7afd2270e2e60adce0ba2face6444e9a4b41ba738d6c72fb16691603c18e0e" },
+    { "SP 800-38A F.1.5 ECB-AES256", "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+      "f3eed1bdb5d2a03c064b5a7e3db181f8591ccb10d410ed26dc5ba74a31362870b6ed21b99ca6f4f9f153e7b1beafed1d23304b7a39f9f3ff067d8d8f9e24ecc7" },
+};
+#define BLOCK_VECTOR_COUNT (sizeof(BLOCK_VECTORS) / sizeof(BLOCK_VECTORS[0]))
+
+// The vectors of the modes of operation also have an IV (or initial counter block)
+typedef struct
+{
+    char const *source;
+    char const *key;
+    char const *iv;
+    char const *plaintext;
+    char const *ciphertext;
+} mode_vector;
+
+mode_vector const CTR_VECTORS[] = {
+    { "SP 800-38A F.5.1 CTR-AES128", "2b7e151628aed2a6abf7158809cf4f3c", "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+      "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee" },
+    { "SP 800-38A F.5.3 CTR-AES192", "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b", "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+      "1abc932417521ca24f2b0459fe7e6e0b090339ec0aa6faefd5ccc2c6f4ce8e941e36b26bd1ebc670d1bd1d665620abf74f78a7f6d29809585a97daec58c6b050" },
+    { "SP 800-38A F.5.5 CTR-AES256", "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4", "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+      "601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c52b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6" },
+};
+#define CTR_VECTOR_COUNT (sizeof(CTR_VECTORS) / sizeof(CTR_VECTORS[0]))
+
+mode_vector const CBC_VECTORS[] = {
+    { "SP 800-38A F.2.1 CBC-AES128", "2b7e151628aed2a6abf7158809cf4f3c", "000102030405060708090a0b0c0d0e0f",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+      "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b273bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7" },
+    { "SP 800-38A F.2.3 CBC-AES192", "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b", "000102030405060708090a0b0c0d0e0f",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+      "4f021db243bc633d7178183a9fa071e8b4d9ada9ad7dedf4e5e738763f69145a571b242012fb7ae07fa9baac3df102e008b0e27988598881d920a9e64f5615cd" },
+    { "SP 800-38A F.2.5 CBC-AES256", "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4", "000102030405060708090a0b0c0d0e0f",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+      "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b" },
+};
+#define CBC_VECTOR_COUNT (sizeof(CBC_VECTORS) / sizeof(CBC_VECTORS[0]))
+
+// The GCM vectors of McGrew and Viega's "The Galois/Counter Mode of Operation", test cases 1 to 6 (AES-128), 10 (AES-192), 14 and 16 (AES-256)
+typedef struct
+{
+    char const *source;
+    char const *key;
+    char const *iv;
+    char const *aad;
+    char const *plaintext;
+    char const *ciphertext;
+    char const *tag;
+} gcm_vector;
+
+gcm_vector const GCM_VECTORS[] = {
+    { "GCM test case 1", "00000000000000000000000000000000", "000000000000000000000000", "", "", "", "58e2fccefa7e3061367f1d57a4e7455a" },
+    { "GCM test case 2", "00000000000000000000000000000000", "000000000000000000000000", "", "00000000000000000000000000000000",
+      "0388dace60b6a392f328c2b971b2fe78", "ab6e47d42cec13bdf53a67b21257bddf" },
+    { "GCM test case 3", "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+      "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+      "4d5c2af327cd64a62cf35abd2ba6fab4" },
+    { "GCM test case 4", "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+      "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+      "5bc94fbc3221a5db94fae95ae7121a47" },
+    { "GCM test case 5", "feffe9928665731c6d6a8f9467308308", "cafebabefacedbad", "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+      "61353b4c2806934a777ff51fa22a4755699b2a714fcdc6f83766e5f97b6c742373806900e49f24b22b097544d4896b424989b5e1ebac0f07c23f4598",
+      "3612d2e79e3b0785561be14aaca2fccb" },
+    { "GCM test case 6", "feffe9928665731c6d6a8f9467308308",
+      "9313225df88406e555909c5aff5269aa6a7a9538534f7da1e4c303d2a318a728c3c0c95156809539fcf0e2429a6b525416aedbf5a0de6a57a637b39b",
+      "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+      "8ce24998625615b603a033aca13fb894be9112a5c3a211a8ba262a3cca7e2ca701e4a9a4fba43c90ccdcb281d48c7c6fd62875d2aca417034c34aee5",
+      "619cc5aefffe0bfa462af43c1699d050" },
+    { "GCM test case 10", "feffe9928665731c6d6a8f9467308308feffe9928665731c", "cafebabefacedbaddecaf888", "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+      "3980ca0b3c00e841eb06fac4872a2757859e1ceaa6efd984628593b40ca1e19c7d773d00c144c525ac619d18c84a3f4718e2448b2fe324d9ccda2710",
+      "2519498e80f1478f37ba55bd6d27618c" },
+    { "GCM test case 14", "0000000000000000000000000000000000000000000000000000000000000000", "000000000000000000000000", "",
+      "00000000000000000000000000000000", "cea7403d4d606b6e074ec5d3baf39d18", "d0d1c8a799996bf0265b98b5d48ab919" },
+    { "GCM test case 16", "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888",
+      "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+      "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+      "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+      "76fc6ece0f4e1768cddf8853bb2d551b" },
+};
+#define GCM_VECTOR_COUNT (sizeof(GCM_VECTORS) / sizeof(GCM_VECTORS[0]))
+
+// The XTS vectors of IEEE 1619 Annex B: 1 to 3 (AES-128), the first two blocks of 10 (AES-256), and 15 and 16 with ciphertext stealing
+typedef struct
+{
+    char const *source;
+    char const *key;
+    uint64_t unit;
+    char const *plaintext;
+    char const *ciphertext;
+} xts_vector;
+
+xts_vector const XTS_VECTORS[] = {
+    { "IEEE 1619 XTS vector 1", "0000000000000000000000000000000000000000000000000000000000000000", 0,
+      "0000000000000000000000000000000000000000000000000000000000000000", "917cf69ebd68b2ec9b9fe9a3eadda692cd43d2f59598ed858c02c2652fbf922e" },
+    { "IEEE 1619 XTS vector 2", "1111111111111111111111111111111122222222222222222222222222222222", 0x3333333333,
+      "4444444444444444444444444444444444444444444444444444444444444444", "c454185e6a16936e39334038acef838bfb186fff7480adc4289382ecd6d394f0" },
+    { "IEEE 1619 XTS vector 3", "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f022222222222222222222222222222222", 0x3333333333,
+      "4444444444444444444444444444444444444444444444444444444444444444", "af85336b597afc1a900b2eb21ec949d292df4c047e0b21532186a5971a227a89" },
+    { "IEEE 1619 XTS vector 10", "27182818284590452353602874713526624977572470936999595749669676273141592653589793238462643383279502884197169399375105820974944592",
+      0xff, "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", "1c3b3a102f770386e4836c99e370cf9bea00803f5e482357a4ae12d414a3e63b" },
+    { "IEEE 1619 XTS vector 15", "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0", 0x123456789a,
+      "000102030405060708090a0b0c0d0e0f10", "6c1625db4671522d3d7599601de7ca09ed" },
+    { "IEEE 1619 XTS vector 16", "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0", 0x123456789a,
+      "000102030405060708090a0b0c0d0e0f1011", "d069444b7a7e0cab09e24447d24deb1fedbf" },
+};
+#define XTS_VECTOR_COUNT (sizeof(XTS_VECTORS) / sizeof(XTS_VECTORS[0]))
+
+// The vectors of the MACs, the messages of the PMAC ones count up from 00 like their keys
+typedef struct
+{
+    char const *source;
+    char const *key;
+    char const *message;
+    char const *tag;
+} mac_vector;
+
+mac_vector const CMAC_VECTORS[] = {
+    { "SP 800-38B D.1 AES-128, 0 bytes", "2b7e151628aed2a6abf7158809cf4f3c", "", "bb1d6929e95937287fa37d129b756746" },
+    { "SP 800-38B D.1 AES-128, 16 bytes", "2b7e151628aed2a6abf7158809cf4f3c",
+      "6bc1bee22e409f96e93d7e117393172a", "070a16b46b4d4144f79bdd9dd04a287c" },
+    { "SP 800-38B D.1 AES-128, 40 bytes", "2b7e151628aed2a6abf7158809cf4f3c",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411", "dfa66747de9ae63030ca32611497c827" },
+    { "SP 800-38B D.1 AES-128, 64 bytes", "2b7e151628aed2a6abf7158809cf4f3c",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", "51f0bebf7e3b9d92fc49741779363cfe" },
+    { "SP 800-38B D.2 AES-192, 0 bytes", "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b", "", "d17ddf46adaacde531cac483de7a9367" },
+    { "SP 800-38B D.2 AES-192, 16 bytes", "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+      "6bc1bee22e409f96e93d7e117393172a", "9e99a7bf31e710900662f65e617c5184" },
+    { "SP 800-38B D.2 AES-192, 40 bytes", "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411", "8a1de5be2eb31aad089a82e6ee908b0e" },
+    { "SP 800-38B D.2 AES-192, 64 bytes", "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", "a1d5df0eed790f794d77589659f39a11" },
+    { "SP 800-38B D.3 AES-256, 0 bytes", "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+      "", "028962f61b7bf89efc6b551f4667d983" },
+    { "SP 800-38B D.3 AES-256, 16 bytes", "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+      "6bc1bee22e409f96e93d7e117393172a", "28a7023f452e8f82bd4bf28d8c37c35c" },
+    { "SP 800-38B D.3 AES-256, 40 bytes", "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411", "aaf3d8f1de5640c232f5b169b9c911e6" },
+    { "SP 800-38B D.3 AES-256, 64 bytes", "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+      "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", "e1992190549f6ed5696a2c056c315410" },
+};
+#define CMAC_VECTOR_COUNT (sizeof(CMAC_VECTORS) / sizeof(CMAC_VECTORS[0]))
+
+mac_vector const PMAC_VECTORS[] = {
+    { "PMAC AES-128, 0 bytes", "000102030405060708090a0b0c0d0e0f", "", "4399572cd6ea5341b8d35876a7098af7" },
+    { "PMAC AES-128, 3 bytes", "000102030405060708090a0b0c0d0e0f", "000102", "256ba5193c1b991b4df0c51f388a9e27" },
+    { "PMAC AES-128, 16 bytes", "000102030405060708090a0b0c0d0e0f",
+      "000102030405060708090a0b0c0d0e0f", "ebbd822fa458daf6dfdad7c27da76338" },
+    { "PMAC AES-128, 20 bytes", "000102030405060708090a0b0c0d0e0f",
+      "000102030405060708090a0b0c0d0e0f10111213", "0412ca150bbf79058d8c75a58c993f55" },
+    { "PMAC AES-128, 48 bytes", "000102030405060708090a0b0c0d0e0f",
+      "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f202122232425262728292a2b2c2d2e2f", "ead66e4106e402cc5a11b375eed392d4" },
+    { "PMAC AES-192, 34 bytes", "000102030405060708090a0b0c0d0e0f1011121314151617",
+      "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f2021", "b5ff2016878e834438aa1ff624bfa09c" },
+    { "PMAC AES-256, 34 bytes", "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+      "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f2021", "edd8a05f4b66761f9eee4feb4ed0c3a1" },
+};
+#define PMAC_VECTOR_COUNT (sizeof(PMAC_VECTORS) / sizeof(PMAC_VECTORS[0]))
+
+// A small utility function to turn a hex string into bytes, it returns the no. of bytes
+size_t hex_to_bytes(char const *hex, uint8_t *bytes)
+{
+    size_t length = strlen(hex) / 2;
+    for (size_t itr = 0; itr < length; itr++)
+        sscanf(hex + 2*itr, "%2" SCNx8, &bytes[itr]);
+    return length;
+}
+
+// Prints one result line of the known answer tests and returns 1 if it failed
+int kat_result(char const *kernel, char const *what, char const *source, uint8_t const *got, uint8_t const *expected, size_t length, uint8_t verbose)
+{
+    int failed = memcmp(got, expected, length) != 0;
+    if (failed || verbose)
+        printf("%-4s  %-10s %-16s %s\n", failed ? "FAIL" : "ok", kernel, what, source);
+    return failed;
+}
+
+// Checks the block functions currently in use against the block vectors
+int kat_block(char const *kernel, uint8_t has_decrypt, uint8_t verbose)
+{
+    int failures = 0;
+    uint8_t key[32], plaintext[64], ciphertext[64], buffer[64];
+    aes_ctx ctx;
+    for (size_t itr = 0; itr < BLOCK_VECTOR_COUNT; itr++)
+    {
+        block_vector const *vector = &BLOCK_VECTORS[itr];
+        size_t key_length = hex_to_bytes(vector->key, key);
+        size_t length = hex_to_bytes(vector->plaintext, plaintext);
+        hex_to_bytes(vector->ciphertext, ciphertext);
+        aes_ctx_init(&ctx, key, key_length);
+
+        aes_ctx_encrypt(&ctx, plaintext, buffer, length / 16);
+        failures += kat_result(kernel, "encrypt", vector->source, buffer, ciphertext, length, verbose);
+        if (!has_decrypt)
+            continue;
+        aes_ctx_decrypt(&ctx, ciphertext, buffer, length / 16);
+        failures += kat_result(kernel, "decrypt", vector->source, buffer, plaintext, length, verbose);
+    }
+    return failures;
+}
+
+// Checks counter mode with the block functions currently in use. Besides the published vectors, a buffer of several chunks
+// (not a multiple of 16) must come out the same with the thread pool as in one go, and the counter must carry from the low
+// 64 bits into the high ones like a real 128-bit counter.
+int kat_ctr(char const *kernel, uint8_t verbose)
+{
+    int failures = 0;
+    uint8_t key[32], counter[16], plaintext[64], ciphertext[64], buffer[64];
+    aes_ctx ctx;
+    for (size_t itr = 0; itr < CTR_VECTOR_COUNT; itr++)
+    {
+        mode_vector const *vector = &CTR_VECTORS[itr];
+        size_t key_length = hex_to_bytes(vector->key, key);
+        hex_to_bytes(vector->iv, counter);
+        size_t length = hex_to_bytes(vector->plaintext, plaintext);
+        hex_to_bytes(vector->ciphertext, ciphertext);
+        aes_ctx_init(&ctx, key, key_length);
+
+        aes_ctr(&ctx, counter, plaintext, buffer, length, 0);
+        failures += kat_result(kernel, "ctr encrypt", vector->source, buffer, ciphertext, length, verbose);
+        aes_ctr(&ctx, counter, ciphertext, buffer, length, 0);
+        failures += kat_result(kernel, "ctr decrypt", vector->source, buffer, plaintext, length, verbose);
+    }
+
+    size_t length = 4 * CTR_CHUNK + 5;
+    uint8_t *input = malloc(length), *serial = malloc(length), *parallel = malloc(length);
+    for (size_t itr = 0; itr < length; itr++)
+        input[itr] = (uint8_t)(itr * 7);
+    hex_to_bytes("000102030405060708090a0b0c0d0e0f", key);
+    hex_to_bytes("00000000000000fffffffffffffffff0", counter);     // the low half overflows after 16 blocks
+    aes_ctx_init(&ctx, key, 16);
+    ctr_range(&ctx, counter, 0, input, serial, length);
+    aes_ctr(&ctx, counter, input, parallel, length, 0);
+    failures += kat_result(kernel, "ctr threads", "same output as one thread", parallel, serial, length, verbose);
+
+    // The first 32 blocks again, this time one by one with counter_add() doing the carries
+    uint8_t block[16];
+    for (size_t itr = 0; itr < 32; itr++)
+    {
+        memcpy(block, counter, 16);
+        counter_add(block, itr);
+        aes_encrypt_block(block, block, ctx.round_keys, ctx.rounds);
+        xor_bytes(parallel + 16*itr, input + 16*itr, block, 16);
+    }
+    failures += kat_result(kernel, "ctr carry", "128-bit counter", parallel, serial, 32 * 16, verbose);
+    free(input);
+    free(serial);
+    free(parallel);
+    return failures;
+}
+
+// Checks CBC with the block functions currently in use. Besides the vectors, streams of all key sizes and of different lengths
+// encrypted together must give the same as one by one, and a stream of several chunks must decrypt in place on the thread pool.
+int kat_cbc(char const *kernel, uint8_t verbose)
+{
+    int failures = 0;
+    uint8_t key[32], iv[16], plaintext[64], ciphertext[64], buffer[64];
+    aes_ctx ctx;
+    for (size_t itr = 0; itr < CBC_VECTOR_COUNT; itr++)
+    {
+        mode_vector const *vector = &CBC_VECTORS[itr];
+        size_t key_length = hex_to_bytes(vector->key, key);
+        size_t length = hex_to_bytes(vector->plaintext, plaintext);
+        hex_to_bytes(vector->ciphertext, ciphertext);
+        aes_ctx_init(&ctx, key, key_length);
+
+        cbc_stream stream = { &ctx, { 0 }, plaintext, buffer, length / 16 };
+        hex_to_bytes(vector->iv, stream.iv);
+        aes_cbc_encrypt_multi(&stream, 1, 0);
+        failures += kat_result(kernel, "cbc encrypt", vector->source, buffer, ciphertext, length, verbose);
+        hex_to_bytes(vector->iv, iv);
+        aes_cbc_decrypt(&ctx, iv, ciphertext, buffer, length / 16, 0);
+        failures += kat_result(kernel, "cbc decrypt", vector->source, buffer, plaintext, length, verbose);
+    }
+
+    // 20 streams of 0 to 19 blocks, the key size changing from one to the next
+    enum { STREAMS = 20 };
+    aes_ctx contexts[STREAMS];
+    cbc_stream streams[STREAMS];
+    uint8_t input[STREAMS * 19 * 16], together[STREAMS * 19 * 16], one_by_one[STREAMS * 19 * 16];
+    for (size_t itr = 0; itr < sizeof(input); itr++)
+        input[itr] = (uint8_t)(itr * 7);
+    for (uint8_t stream = 0; stream < STREAMS; stream++)
+    {
+        aes_ctx_init(&contexts[stream], input + stream, 16 + 8 * (stream % 3));
+        streams[stream] = (cbc_stream){ &contexts[stream], { stream }, input + stream * 19 * 16, together + stream * 19 * 16, stream };
+        memset(iv, 0, 16);
+        iv[0] = stream;
+        aes_cbc_encrypt(&contexts[stream], iv, input + stream * 19 * 16, one_by_one + stream * 19 * 16, stream);
+        memset(together + stream * 19 * 16 + 16 * stream, 0, 16 * (19 - stream));
+        memset(one_by_one + stream * 19 * 16 + 16 * stream, 0, 16 * (19 - stream));
+    }
+    aes_cbc_encrypt_multi(streams, STREAMS, 0);
+    failures += kat_result(kernel, "cbc multi", "same as one by one", together, one_by_one, sizeof(together), verbose);
+
+    size_t blocks = 4 * CTR_CHUNK / 16 + 3;
+    uint8_t *plain = malloc(16 * blocks), *data = malloc(16 * blocks);
+    for (size_t itr = 0; itr < 16 * blocks; itr++)
+        plain[itr] = (uint8_t)(itr * 7);
+    aes_ctx_init(&ctx, plain, 32);
+    memset(iv, 0, 16);
+    aes_cbc_encrypt(&ctx, iv, plain, data, blocks);
+    memset(iv, 0, 16);
+    aes_cbc_decrypt(&ctx, iv, data, data, blocks, 0);
+    failures += kat_result(kernel, "cbc threads", "decrypts in place", data, plain, 16 * blocks, verbose);
+    free(plain);
+    free(data);
+    return failures;
+}
+
+// Checks XTS with the block functions currently in use. Besides the vectors, sectors that need stealing must come out the same with
+// the thread pool as one by one, and decrypt back in place.
+int kat_xts(char const *kernel, uint8_t verbose)
+{
+    int failures = 0;
+    uint8_t key[64], plaintext[32], ciphertext[32], buffer[32];
+    xts_ctx xts;
+    for (size_t itr = 0; itr < XTS_VECTOR_COUNT; itr++)
+    {
+        xts_vector const *vector = &XTS_VECTORS[itr];
+        size_t key_length = hex_to_bytes(vector->key, key);
+        size_t length = hex_to_bytes(vector->plaintext, plaintext);
+        hex_to_bytes(vector->ciphertext, ciphertext);
+        // Some IEEE 1619 vectors have equal halves, which aes_xts_init() refuses, so the two keys are expanded here directly
+        aes_ctx_init(&xts.data, key, key_length / 2);
+        aes_ctx_init(&xts.tweak, key + key_length / 2, key_length / 2);
+
+        aes_xts_encrypt(&xts, vector->unit, plaintext, buffer, length, 1, 0);
+        failures += kat_result(kernel, "xts encrypt", vector->source, buffer, ciphertext, length, verbose);
+        aes_xts_decrypt(&xts, vector->unit, ciphertext, buffer, length, 1, 0);
+        failures += kat_result(kernel, "xts decrypt", vector->source, buffer, plaintext, length, verbose);
+    }
+
+    size_t unit_length = 4096 + 5, units = 2 * (CTR_CHUNK / unit_length) + 1, length = unit_length * units;
+    uint8_t *input = malloc(length), *serial = malloc(length), *parallel = malloc(length);
+    for (size_t itr = 0; itr < length; itr++)
+        input[itr] = (uint8_t)(itr * 7);
+    memset(key, 0x5a, 64);
+    uint8_t refused = aes_xts_init(&xts, key, 64) == -1 && aes_xts_init(&xts, key, 32) == -1, yes = 1;
+    failures += kat_result(kernel, "xts key", "equal halves refused", &refused, &yes, 1, verbose);
+    aes_xts_init(&xts, (uint8_t const*)"0123456789abcdef0123456789abcdeffedcba9876543210fedcba9876543210", 64);
+    for (size_t unit = 0; unit < units; unit++)
+        xts_unit(&xts, 1000 + unit, input + unit * unit_length, serial + unit * unit_length, unit_length, 0);
+    aes_xts_encrypt(&xts, 1000, input, parallel, unit_length, units, 0);
+    failures += kat_result(kernel, "xts threads", "same output as one by one", parallel, serial, length, verbose);
+    aes_xts_decrypt(&xts, 1000, parallel, parallel, unit_length, units, 0);
+    failures += kat_result(kernel, "xts threads", "decrypts in place", parallel, input, length, verbose);
+    free(input);
+    free(serial);
+    free(parallel);
+    return failures;
+}
+
+// Checks GCM with the block functions currently in use and every GHASH this CPU has. Besides the vectors, a message given in
+// uneven pieces must give the same ciphertext and tag as in one go, and a changed tag must be refused.
+int kat_gcm(char const *kernel, uint8_t verbose)
+{
+    ghash_fun const ghashes[] = { ghash_software,
+#ifdef AES_X86
+                                  pclmul_available ? ghash_pclmul : NULL,
+#endif
+    };
+    int failures = 0;
+    uint8_t key[32], iv[64], aad[32], plaintext[64], ciphertext[64], tag[16], buffer[64], buffer_tag[16];
+    gcm_ctx gcm;
+    for (size_t ghash = 0; ghash < sizeof(ghashes) / sizeof(ghashes[0]); ghash++)
+    {
+        if (!ghashes[ghash])
+            continue;
+        ghash_blocks = ghashes[ghash];
+        for (size_t itr = 0; itr < GCM_VECTOR_COUNT; itr++)
+        {
+            gcm_vector const *vector = &GCM_VECTORS[itr];
+            size_t key_length = hex_to_bytes(vector->key, key);
+            size_t iv_length = hex_to_bytes(vector->iv, iv);
+            size_t aad_length = hex_to_bytes(vector->aad, aad);
+            size_t length = hex_to_bytes(vector->plaintext, plaintext);
+            hex_to_bytes(vector->ciphertext, ciphertext);
+            hex_to_bytes(vector->tag, tag);
+            aes_gcm_init(&gcm, key, key_length);
+
+            aes_gcm_encrypt(&gcm, iv, iv_length, aad, aad_length, plaintext, buffer, length, buffer_tag);
+            failures += kat_result(kernel, "gcm encrypt", vector->source, buffer, ciphertext, length, verbose);
+            failures += kat_result(kernel, "gcm tag", vector->source, buffer_tag, tag, 16, verbose);
+            int status = aes_gcm_decrypt(&gcm, iv, iv_length, aad, aad_length, ciphertext, buffer, length, tag, 16);
+            failures += kat_result(kernel, "gcm decrypt", vector->source, buffer, plaintext, length, verbose) || status != 0;
+        }
+    }
+    use_best_ghash();
+
+    size_t length = 1000;
+    uint8_t *input = malloc(length), *whole = malloc(length), *pieces = malloc(length);
+    for (size_t itr = 0; itr < length; itr++)
+        input[itr] = (uint8_t)(itr * 7);
+    hex_to_bytes("000102030405060708090a0b0c0d0e0f", key);
+    aes_gcm_init(&gcm, key, 16);
+    aes_gcm_encrypt(&gcm, key, 12, key, 5, input, whole, length, tag);
+    gcm_state state;
+    aes_gcm_start(&state, &gcm, key, 12, key, 5);
+    for (size_t done = 0, piece = 1; done < length; done += piece, piece = piece * 3 % 200)
+        aes_gcm_update(&state, input + done, pieces + done, done + piece < length ? piece : length - done, 0);
+    aes_gcm_finish(&state, buffer_tag);
+    failures += kat_result(kernel, "gcm pieces", "same as in one go", pieces, whole, length, verbose);
+    failures += kat_result(kernel, "gcm pieces", "same tag as in one go", buffer_tag, tag, 16, verbose);
+    tag[15] ^= 1;
+    int refused = aes_gcm_decrypt(&gcm, key, 12, key, 5, whole, pieces, length, tag, 16) == -1 && pieces[0] == 0 && pieces[length - 1] == 0;
+    if (!refused || verbose)
+        printf("%-4s  %-10s %-16s %s\n", refused ? "ok" : "FAIL", kernel, "gcm forgery", "changed tag refused");
+    failures += !refused;
+    // The first byte of the tag is still right, but one byte is not a tag length that can be trusted
+    refused = aes_gcm_decrypt(&gcm, key, 12, key, 5, whole, pieces, length, tag, 1) == -1;
+    refused &= aes_gcm_encrypt(&gcm, key, 0, key, 5, input, pieces, length, buffer_tag) == -1;
+    if (!refused || verbose)
+        printf("%-4s  %-10s %-16s %s\n", refused ? "ok" : "FAIL", kernel, "gcm forgery", "short tag, empty IV refused");
+    failures += !refused;
+    // A message that already holds all but the last block SP 800-38D allows takes that block, and not one byte more
+    aes_gcm_start(&state, &gcm, key, 12, key, 5);
+    state.text_length = GCM_MAX_TEXT - 16;
+    refused = aes_gcm_update(&state, input, pieces, 16, 0) == 0 && aes_gcm_update(&state, input, pieces, 1, 0) == -1;
+    if (!refused || verbose)
+        printf("%-4s  %-10s %-16s %s\n", refused ? "ok" : "FAIL", kernel, "gcm limit", "2^36 - 32 bytes per message");
+    failures += !refused;
+    free(input);
+    free(whole);
+    free(pieces);
+    return failures;
+}
+
+// The bitsliced S-box circuits against S_BOX and INV_S_BOX for all 256 inputs, AES_BITSLICE_LANES inputs at a time
+int kat_bitslice_sbox(uint8_t verbose)
+{
+    uint8_t forward[256], inverse[256];
+    for (unsigned start = 0; start < 256; start += AES_BITSLICE_LANES)
+    {
+        lane_t q[8] = { 0 }, r[8];
+        for (unsigned lane = 0; lane < AES_BITSLICE_LANES; lane++)
+            for (uint8_t bit = 0; bit < 8; bit++)
+                q[bit] |= (lane_t)(((start + lane) >> bit) & 1) << lane;
+        memcpy(r, q, sizeof(q));
+        bitslice_sbox(q);
+        bitslice_inverse_sbox(r);
+        for (unsigned lane = 0; lane < AES_BITSLICE_LANES; lane++)
+        {
+            forward[start + lane] = inverse[start + lane] = 0;
+            for (uint8_t bit = 0; bit < 8; bit++)
+            {
+                forward[start + lane] |= ((q[bit] >> lane) & 1) << bit;
+                inverse[start + lane] |= ((r[bit] >> lane) & 1) << bit;
+            }
+        }
+    }
+    return kat_result("bitslice", "sbox", "all 256 inputs", forward, &S_BOX[0][0], 256, verbose) +
+           kat_result("bitslice", "inverse sbox", "all 256 inputs", inverse, &INV_S_BOX[0][0], 256, verbose);
+}
+
+// The batched key expansions (the software one, and AES-NI when the CPU has it) against key_expansion() for 9 keys of every size, so
+// that a last short group is checked too. Then the key cache on a fixed sequence of keys: the schedules must be right, the counters
+// must show that the least recently used entry was evicted, and a key must get no entry while all of them are pinned.
+int kat_keys(uint8_t verbose)
+{
+    struct
+    {
+        char const *name;
+        keys_fun fun;
+        uint8_t available;
+    } const expanders[] = {
+        { "software", expand_keys_software, 1 },
+#ifdef AES_X86
+        { "aesni", aesni_expand_keys, aesni_available },
+#endif
+    };
+    char const *const sources[3] = { "128-bit keys", "192-bit keys", "256-bit keys" };
+    enum { KEYS = 9 };
+    int failures = 0;
+    uint8_t material[KEYS][32];
+    uint8_t const *keys[KEYS];
+    aes_ctx expected[KEYS], got[KEYS];
+    aes_ctx *targets[KEYS];
+    for (uint8_t key = 0; key < KEYS; key++)
+    {
+        for (uint8_t itr = 0; itr < 32; itr++)
+            material[key][itr] = (uint8_t)(key * 31 + itr * 7);
+        keys[key] = material[key];
+        targets[key] = &got[key];
+    }
+    for (uint8_t size = 0; size < 3; size++)
+    {
+        uint8_t key_length = 16 + 8 * size;
+        memset(expected, 0, sizeof(expected));
+        for (uint8_t key = 0; key < KEYS; key++)
+            expected[key].rounds = key_expansion(keys[key], key_length, expected[key].round_keys);
+        for (size_t itr = 0; itr < sizeof(expanders) / sizeof(expanders[0]); itr++)
+        {
+            if (!expanders[itr].available)
+                continue;
+            memset(got, 0, sizeof(got));
+            expanders[itr].fun(targets, keys, key_length, KEYS);
+            failures += kat_result(expanders[itr].name, "key expansion", sources[size], (uint8_t const*)got, (uint8_t const*)expected, sizeof(got), verbose);
+        }
+    }
+
+    key_cache_entry entries[4];
+    key_cache cache;
+    key_cache_stats stats;
+    aes_ctx const *pinned[4];
+    uint8_t const sequence[] = { 0, 1, 2, 3, 0, 4, 1 };
+    uint8_t schedules[sizeof(sequence)], all_right[sizeof(sequence)];
+    aes_key_cache_init(&cache, entries, 4);
+    for (uint8_t itr = 0; itr < sizeof(sequence); itr++)
+    {
+        aes_ctx const *ctx = aes_key_cache_acquire(&cache, keys[sequence[itr]], 32);
+        aes_ctx_init(&expected[0], keys[sequence[itr]], 32);
+        schedules[itr] = ctx != NULL && memcmp(ctx->round_keys, expected[0].round_keys, sizeof(expected[0].round_keys)) == 0;
+        all_right[itr] = 1;
+        if (ctx != NULL)
+            aes_key_cache_release(ctx);
+    }
+    failures += kat_result("cache", "schedules", "same as aes_ctx_init", schedules, all_right, sizeof(schedules), verbose);
+    aes_key_cache_stats(&cache, &stats);
+    uint64_t counters[3] = { stats.hits, stats.misses, stats.evictions }, expected_counters[3] = { 1, 6, 2 };
+    failures += kat_result("cache", "counters", "1 hit, 6 misses, 2 evictions", (uint8_t const*)counters, (uint8_t const*)expected_counters, sizeof(counters), verbose);
+    aes_key_cache_acquire_many(&cache, keys + 5, 32, 4, pinned);
+    uint8_t refused = aes_key_cache_acquire(&cache, keys[0], 32) == NULL, yes = 1;
+    failures += kat_result("cache", "all pinned", "no entry to evict", &refused, &yes, 1, verbose);
+    for (uint8_t itr = 0; itr < 4; itr++)
+        if (pinned[itr] != NULL)
+            aes_key_cache_release(pinned[itr]);
+    aes_key_cache_destroy(&cache);
+    return failures;
+}
+
+void kat_queue_done(aes_job *job)
+{
+    atomic_fetch_add((atomic_uint*)job->user, 1);
+}
+
+// Checks the job queue with the block functions currently in use: jobs of every mode, direction and key size, from empty to larger
+// than QUEUE_SMALL, all in place and half of them with a callback, must give the same as the direct functions. A CBC job of a length
+// that is not a multiple of 16 must come back with status -1.
+int kat_queue(char const *kernel, uint8_t verbose)
+{
+    enum { JOBS = 300, LONGEST = 2 * QUEUE_SMALL + 48 };
+    static uint8_t data[JOBS][LONGEST], expected[JOBS][LONGEST];
+    static aes_job jobs[JOBS];
+    aes_ctx contexts[3];
+    // The keys start at key, key + 1 and key + 2, so the longest one ends 2 bytes after 32
+    uint8_t key[34], iv[16], right[JOBS], all_right[JOBS];
+    atomic_uint callbacks = 0;
+    aes_queue queue;
+    for (uint8_t itr = 0; itr < sizeof(key); itr++)
+        key[itr] = itr * 11;
+    for (uint8_t size = 0; size < 3; size++)
+        aes_ctx_init(&contexts[size], key + size, 16 + 8 * size);
+    if (aes_queue_init(&queue, 64, 2) != 0)
+        return kat_result(kernel, "queue", "could not start", (uint8_t const*)"", (uint8_t const*)"x", 1, verbose);
+
+    size_t submitted = 0, finished = 0;
+    for (size_t job = 0; job < JOBS; job++)
+    {
+        aes_ctx const *ctx = &contexts[job % 3];
+        uint8_t mode = (job / 3) % 3, decrypt = (job / 9) % 2;
+        size_t length = job % 7 == 0 ? LONGEST - 16 * (job % 2) : 16 * ((job * 5) % 12) + (mode == AES_MODE_CTR ? job % 16 : 0);
+        for (size_t itr = 0; itr < length; itr++)
+            data[job][itr] = (uint8_t)(job + itr * 3);
+        memset(iv, (uint8_t)job, 16);
+        if (mode == AES_MODE_ECB && decrypt)
+            aes_ctx_decrypt(ctx, data[job], expected[job], length / 16);
+        else if (mode == AES_MODE_ECB)
+            aes_ctx_encrypt(ctx, data[job], expected[job], length / 16);
+        else if (mode == AES_MODE_CTR)
+            aes_ctr(ctx, iv, data[job], expected[job], length, 1);
+        else if (decrypt)
+            aes_cbc_decrypt(ctx, iv, data[job], expected[job], length / 16, 1);
+        else
+            aes_cbc_encrypt(ctx, iv, data[job], expected[job], length / 16);
+        jobs[job] = (aes_job){ ctx, mode, decrypt, { 0 }, data[job], data[job], length, job % 2 ? kat_queue_done : NULL, &callbacks, 1 };
+        memset(jobs[job].iv, (uint8_t)job, 16);
+    }
+    jobs[JOBS - 1].mode = AES_MODE_CBC;
+    jobs[JOBS - 1].length = 17;
+
+    aes_job *done[16];
+    while (finished < JOBS - JOBS / 2 || atomic_load(&callbacks) < JOBS / 2)
+    {
+        while (submitted < JOBS && aes_queue_submit(&queue, &jobs[submitted]) == 0)
+            submitted++;
+        size_t polled = aes_queue_poll(&queue, done, 16);
+        finished += polled;
+        if (polled == 0)
+            sched_yield();
+    }
+    uint8_t reported = aes_queue_destroy(&queue) == 0, yes = 1;
+
+    for (size_t job = 0; job < JOBS - 1; job++)
+    {
+        right[job] = jobs[job].status == 0 && memcmp(data[job], expected[job], jobs[job].length) == 0;
+        all_right[job] = 1;
+    }
+    right[JOBS - 1] = jobs[JOBS - 1].status == -1;
+    all_right[JOBS - 1] = 1;
+    int failures = kat_result(kernel, "queue", "same as direct calls", right, all_right, JOBS, verbose);
+
+    // Nobody polls here: two jobs fill the completion ring and the third finds no room, all three have to be reported as dropped
+    if (aes_queue_init(&queue, 2, 1) == 0)
+    {
+        for (size_t job = 0; job < 3; job++)
+        {
+            jobs[job] = (aes_job){ &contexts[0], AES_MODE_ECB, 0, { 0 }, data[job], data[job], 16, NULL, NULL, 1 };
+            while (aes_queue_submit(&queue, &jobs[job]) != 0)
+                sched_yield();
+        }
+        reported &= aes_queue_destroy(&queue) == 3;
+    }
+    else
+        reported = 0;
+    failures += kat_result(kernel, "queue", "uncollected jobs reported", &reported, &yes, 1, verbose);
+    return failures;
+}
+
+// Checks the CTR_DRBG with the block functions currently in use against answers from the CTR-DRBG of OpenSSL 3 (AES-256, no
+// derivation function) for fixed entropy: a generate with additional input, and one after a reseed. get_random_bytes() must not give
+// the same bytes twice, also across the end of its buffer, and a child process after fork() must not give the bytes of its parent.
+int kat_drbg(char const *kernel, uint8_t verbose)
+{
+    static uint8_t const AFTER_ADDITIONAL[64] = {
+        0x4b, 0xaa, 0xc3, 0xc9, 0xf5, 0xb1, 0xfa, 0x7b, 0x0f, 0xed, 0xf5, 0x30, 0xad, 0x0c, 0xb9, 0xe0,
+        0x1f, 0x9c, 0x7f, 0x8d, 0x9e, 0xa9, 0x65, 0x41, 0x24, 0x8e, 0x5d, 0x97, 0x7c, 0x7e, 0xf1, 0x84,
+        0x3b, 0x92, 0x0f, 0xe4, 0xf8, 0xec, 0x7c, 0x0b, 0x20, 0x78, 0xf1, 0x58, 0x14, 0x0d, 0x74, 0x10,
+        0xe3, 0x1d, 0xb5, 0x4f, 0x62, 0xc9, 0xd5, 0xd3, 0x35, 0x0b, 0x40, 0x73, 0x9a, 0x51, 0xda, 0x22 };
+    static uint8_t const AFTER_RESEED[64] = {
+        0x34, 0x87, 0xf3, 0xe3, 0x8d, 0xec, 0x5e, 0x25, 0x58, 0x19, 0x17, 0x0b, 0x0e, 0xf6, 0x50, 0x83,
+        0x71, 0xc8, 0xef, 0x8c, 0x64, 0xec, 0x8d, 0x0a, 0x4c, 0xc0, 0x99, 0x66, 0xa1, 0x12, 0x42, 0x8b,
+        0x0c, 0xa8, 0xaf, 0x5d, 0xca, 0xda, 0xed, 0xed, 0xb1, 0xef, 0xee, 0xd0, 0xeb, 0xac, 0xa5, 0x8e,
+        0x09, 0x63, 0xbf, 0x3a, 0xcb, 0xc5, 0x6b, 0x96, 0x83, 0x32, 0xe0, 0x32, 0xf1, 0x9c, 0x0d, 0x59 };
+    uint8_t entropy[DRBG_SEED_LENGTH], additional[DRBG_SEED_LENGTH], personalization[16], output[64];
+    for (uint8_t itr = 0; itr < DRBG_SEED_LENGTH; itr++)
+    {
+        entropy[itr] = itr;
+        additional[itr] = 0xa0 + itr;
+    }
+    for (uint8_t itr = 0; itr < 16; itr++)
+        personalization[itr] = 0x40 + itr;
+    ctr_drbg drbg;
+    ctr_drbg_instantiate(&drbg, entropy, personalization, 16);
+    ctr_drbg_generate(&drbg, output, 64, NULL, 0);
+    ctr_drbg_generate(&drbg, output, 64, additional, DRBG_SEED_LENGTH);
+    int failures = kat_result(kernel, "CTR_DRBG", "additional input", output, AFTER_ADDITIONAL, 64, verbose);
+    ctr_drbg_reseed(&drbg, entropy, NULL, 0);
+    ctr_drbg_generate(&drbg, output, 64, NULL, 0);
+    failures += kat_result(kernel, "CTR_DRBG", "after reseed", output, AFTER_RESEED, 64, verbose);
+
+    // Two requests that end past the end of the buffer, and a third one larger than it
+    static uint8_t first[DRBG_BUFFER + 100], second[DRBG_BUFFER + 100];
+    uint8_t distinct = 1, yes = 1;
+    if (get_random_bytes(first, DRBG_BUFFER - 50) != 0 || get_random_bytes(second, 100) != 0)
+        distinct = 0;
+    distinct &= memcmp(first + DRBG_BUFFER - 150, second, 100) != 0;
+    if (get_random_bytes(second, DRBG_BUFFER + 100) != 0)
+        distinct = 0;
+    distinct &= memcmp(first, second, DRBG_BUFFER - 50) != 0 && memcmp(second + DRBG_BUFFER, second + DRBG_BUFFER - 100, 100) != 0;
+    failures += kat_result(kernel, "random bytes", "no repeats", &distinct, &yes, 1, verbose);
+
+    // The child's next bytes are sent back through a pipe
+    int pipe_fds[2];
+    uint8_t parent[32], child[32] = { 0 };
+    distinct = 0;
+    if (pipe(pipe_fds) == 0)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            get_random_bytes(child, 32);
+            _exit(write(pipe_fds[1], child, 32) == 32 ? 0 : 1);
+        }
+        get_random_bytes(parent, 32);
+        if (pid > 0)
+        {
+            distinct = read(pipe_fds[0], child, 32) == 32 && memcmp(parent, child, 32) != 0;
+            waitpid(pid, NULL, 0);
+        }
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    failures += kat_result(kernel, "random bytes", "after fork", &distinct, &yes, 1, verbose);
+    return failures;
+}
+
+// Checks CMAC and PMAC with the block functions currently in use. Besides the vectors, a message of a few tasks (with data i * 7 + 3
+// and the key 30 31 32 ...) must give the tags OpenSSL gives for CMAC and an independent serial PMAC, in one go on the thread pool and
+// in pieces of many lengths, and a changed tag or one shorter than MAC_MIN_TAG must be refused.
+int kat_mac(char const *kernel, uint8_t verbose)
+{
+    uint8_t key[32], message[64], tag[16], expected[16];
+    int failures = 0;
+    cmac_ctx cmac;
+    pmac_ctx pmac;
+    for (size_t itr = 0; itr < CMAC_VECTOR_COUNT + PMAC_VECTOR_COUNT; itr++)
+    {
+        uint8_t is_pmac = itr >= CMAC_VECTOR_COUNT;
+        mac_vector const *vector = is_pmac ? &PMAC_VECTORS[itr - CMAC_VECTOR_COUNT] : &CMAC_VECTORS[itr];
+        size_t key_length = hex_to_bytes(vector->key, key);
+        size_t length = hex_to_bytes(vector->message, message);
+        hex_to_bytes(vector->tag, expected);
+        if (is_pmac)
+        {
+            aes_pmac_init(&pmac, key, key_length);
+            aes_pmac(&pmac, message, length, tag, 1);
+        }
+        else
+        {
+            aes_cmac_init(&cmac, key, key_length);
+            aes_cmac(&cmac, message, length, tag);
+        }
+        failures += kat_result(kernel, is_pmac ? "pmac" : "cmac", vector->source, tag, expected, 16, verbose);
+    }
+
+    static uint8_t const LONG_CMAC[16] = {
+        0xb2, 0x4a, 0xad, 0xce, 0x6d, 0x7e, 0xf3, 0x16, 0xda, 0x8a, 0x50, 0x1c, 0xaf, 0xc8, 0x55, 0x8c };
+    static uint8_t const LONG_PMAC[16] = {
+        0xa3, 0x7a, 0xdd, 0xa0, 0x3a, 0x37, 0xf9, 0xfa, 0xc9, 0xcc, 0x1a, 0x5b, 0x2b, 0xdb, 0x52, 0x2b };
+    size_t length = 3 * CTR_CHUNK + 5;
+    uint8_t *data = malloc(length);
+    for (size_t itr = 0; itr < length; itr++)
+        data[itr] = (uint8_t)(itr * 7 + 3);
+    for (uint8_t itr = 0; itr < 16; itr++)
+        key[itr] = 0x30 + itr;
+    aes_cmac_init(&cmac, key, 16);
+    aes_pmac_init(&pmac, key, 16);
+    aes_pmac(&pmac, data, length, tag, 0);
+    failures += kat_result(kernel, "pmac", "long, thread pool", tag, LONG_PMAC, 16, verbose);
+
+    cmac_state cmac_pieces;
+    pmac_state pmac_pieces;
+    aes_cmac_start(&cmac_pieces, &cmac);
+    aes_pmac_start(&pmac_pieces, &pmac);
+    for (size_t done = 0, piece = 1; done < length; done += piece, piece = (piece * 5 + 1) % (CTR_CHUNK + 37))
+    {
+        if (piece > length - done)
+            piece = length - done;
+        aes_cmac_update(&cmac_pieces, data + done, piece);
+        aes_pmac_update(&pmac_pieces, data + done, piece, 0);
+    }
+    aes_cmac_finish(&cmac_pieces, tag);
+    failures += kat_result(kernel, "cmac", "long, in pieces", tag, LONG_CMAC, 16, verbose);
+    aes_pmac_finish(&pmac_pieces, tag);
+    failures += kat_result(kernel, "pmac", "long, in pieces", tag, LONG_PMAC, 16, verbose);
+
+    memcpy(tag, LONG_CMAC, 16);
+    tag[15] ^= 1;
+    uint8_t refused = aes_cmac_verify(&cmac, data, length, LONG_CMAC, 16) == 0 && aes_cmac_verify(&cmac, data, length, tag, 16) == -1;
+    memcpy(tag, LONG_PMAC, 16);
+    tag[0] ^= 0x80;
+    refused &= aes_pmac_verify(&pmac, data, length, LONG_PMAC, 16, 0) == 0 && aes_pmac_verify(&pmac, data, length, tag, 16, 0) == -1;
+    // Right but too short
+    refused &= aes_cmac_verify(&cmac, data, length, LONG_CMAC, MAC_MIN_TAG) == 0 && aes_cmac_verify(&cmac, data, length, LONG_CMAC, 1) == -1;
+    refused &= aes_pmac_verify(&pmac, data, length, LONG_PMAC, MAC_MIN_TAG, 0) == 0 && aes_pmac_verify(&pmac, data, length, LONG_PMAC, 1, 0) == -1;
+    uint8_t yes = 1;
+    failures += kat_result(kernel, "mac forgery", "changed or short tag refused", &refused, &yes, 1, verbose);
+    free(data);
+    return failures;
+}
+
+// Runs the known answer tests on every implementation this CPU has and returns the no. of failures
+int run_kat(uint8_t verbose)
+{
+    int failures = kat_bitslice_sbox(verbose);
+    failures += kat_keys(verbose);
+    for (size_t itr = 0; itr < KERNEL_COUNT; itr++)
+    {
+        if (!KERNELS[itr].available)
+            continue;
+        use_kernel(&KERNELS[itr]);
+        failures += kat_block(KERNELS[itr].name, KERNELS[itr].decrypt != NULL, verbose);
+        failures += kat_ctr(KERNELS[itr].name, verbose);
+        failures += kat_gcm(KERNELS[itr].name, verbose);
+        failures += kat_xts(KERNELS[itr].name, verbose);
+        failures += kat_cbc(KERNELS[itr].name, verbose);
+        failures += kat_queue(KERNELS[itr].name, verbose);
+        failures += kat_drbg(KERNELS[itr].name, verbose);
+        failures += kat_mac(KERNELS[itr].name, verbose);
+    }
+    use_best_kernels();
+    if (verbose)
+        printf("%d failure(s)\n", failures);
+    return failures;
+}
+
+// Benchmark
+// Every implementation is run over every mode, message size (16 B to 1 GiB by default, growing 4 times each step) and thread count
+// (1, 2, 4, ... up to all cores). Each measurement is repeated until it takes at least min_time seconds. The result is given in
+// cycles per byte (time stamp counter cycles, so at the nominal clock of the CPU, only on x86) and GB/s of wall clock throughput.
+// The output can be a table, CSV or JSON. With --baseline the CSV of an older run is read and every measurement that got slower
+// by more than the tolerance is reported, so throughput regressions between releases are caught.
+#define REFERENCE_MAX_SIZE ((size_t)1 << 20)      // The reference allocates for every block, larger sizes would take minutes
+
+typedef struct
+{
+    char const *name;
+    uint8_t has_decrypt;        // 0 when decryption is the same operation as encryption
+    uint8_t threaded;           // 0 when the mode can only use one thread
+    // Processes length bytes (a multiple of 16) in place with the current block functions, using the given no. of threads
+    void (*run)(aes_ctx const *ctx, uint8_t *buffer, size_t length, uint8_t decrypt, unsigned threads);
+} bench_mode;
+
+typedef struct
+{
+    aes_ctx const *ctx;
+    uint8_t *buffer;
+    size_t blocks;
+    unsigned slices;
+    uint8_t decrypt;
+} ecb_job;
+
+void ecb_task(void *arg, size_t task)
+{
+    ecb_job const *job = arg;
+    size_t start = job->blocks * task / job->slices, end = job->blocks * (task + 1) / job->slices;
+    if (job->decrypt)
+        aes_ctx_decrypt(job->ctx, job->buffer + 16*start, job->buffer + 16*start, end - start);
+    else
+        aes_ctx_encrypt(job->ctx, job->buffer + 16*start, job->buffer + 16*start, end - start);
+}
+
+// Every block on its own, the buffer is cut into one slice per thread
+void bench_ecb(aes_ctx const *ctx, uint8_t *buffer, size_t length, uint8_t decrypt, unsigned threads)
+{
+    ecb_job job = { ctx, buffer, length / 16, threads, decrypt };
+    parallel_for(threads, threads, ecb_task, &job);
+}
+
+void bench_ctr(aes_ctx const *ctx, uint8_t *buffer, size_t length, uint8_t decrypt, unsigned threads)
+{
+    (void)decrypt;
+    uint8_t counter[16] = { 0 };
+    aes_ctr(ctx, counter, buffer, buffer, length, threads);
+}
+
+// The tag check is left out of decryption, the benchmark buffer never has the right tag. The GHASH tables are made once per
+// key and not on every call, as a real user would keep them.
+void bench_gcm(aes_ctx const *ctx, uint8_t *buffer, size_t length, uint8_t decrypt, unsigned threads)
+{
+    (void)threads;
+    static gcm_ctx gcm;
+    static aes_ctx const *made_for = NULL;
+    if (made_for != ctx)
+    {
+        gcm.aes = *ctx;
+        gcm_make_hash_key(&gcm);
+        made_for = ctx;
+    }
+    uint8_t iv[12] = { 0 }, tag[16];
+    gcm_state state;
+    aes_gcm_start(&state, &gcm, iv, sizeof(iv), NULL, 0);
+    aes_gcm_update(&state, buffer, buffer, length, decrypt);
+    aes_gcm_finish(&state, tag);
+}
+
+// 4 KiB sectors, or a single sector of the whole buffer when it is smaller
+void bench_xts(aes_ctx const *ctx, uint8_t *buffer, size_t length, uint8_t decrypt, unsigned threads)
+{
+    xts_ctx xts = { *ctx, *ctx };
+    size_t unit_length = length < 4096 ? length : 4096;
+    if (decrypt)
+        aes_xts_decrypt(&xts, 0, buffer, buffer, unit_length, length / unit_length, threads);
+    else
+        aes_xts_encrypt(&xts, 0, buffer, buffer, unit_length, length / unit_length, threads);
+}
+
+// Encryption is the multi-buffer case: the buffer is cut into streams of 1 KiB (or one stream when it is smaller), all with the same
+// key. Decryption is one stream over the whole buffer.
+void bench_cbc(aes_ctx const *ctx, uint8_t *buffer, size_t length, uint8_t decrypt, unsigned threads)
+{
+    static cbc_stream *streams = NULL;
+    static size_t allocated = 0;
+    uint8_t iv[16] = { 0 };
+    if (decrypt)
+    {
+        aes_cbc_decrypt(ctx, iv, buffer, buffer, length / 16, threads);
+        return;
+    }
+    size_t stream_length = length < 1024 ? length : 1024, count = length / stream_length;
+    if (count > allocated)
+    {
+        free(streams);
+        streams = malloc(count * sizeof(cbc_stream));
+        allocated = count;
+    }
+    for (size_t itr = 0; itr < count; itr++)
+        streams[itr] = (cbc_stream){ ctx, { 0 }, buffer + itr * stream_length, buffer + itr * stream_length, stream_length / 16 };
+    aes_cbc_encrypt_multi(streams, count, threads);
+}
+
+// A new key for every block, as in a service that sees most keys only once: the keys (as long as the key size measured) are made
+// from the blocks themselves, expanded in batches, and each one encrypts its own block
+void bench_keys(aes_ctx const *ctx, uint8_t *buffer, size_t length, uint8_t decrypt, unsigned threads)
+{
+    (void)decrypt;
+    (void)threads;
+    static aes_ctx ctxs[KEY_BATCH];
+    uint8_t material[KEY_BATCH][32];
+    uint8_t const *keys[KEY_BATCH];
+    size_t key_length = 4 * (ctx->rounds - 6), blocks = length / 16;
+    for (size_t first = 0; first < blocks; first += KEY_BATCH)
+    {
+        size_t batch = blocks - first < KEY_BATCH ? blocks - first : KEY_BATCH;
+        for (size_t itr = 0; itr < batch; itr++)
+        {
+            memcpy(material[itr], buffer + 16 * (first + itr), 16);
+            memcpy(material[itr] + 16, buffer + 16 * (first + itr), 16);
+            keys[itr] = material[itr];
+        }
+        aes_ctx_init_many(ctxs, keys, key_length, batch);
+        for (size_t itr = 0; itr < batch; itr++)
+            aes_encrypt_block(buffer + 16 * (first + itr), buffer + 16 * (first + itr), ctxs[itr].round_keys, ctxs[itr].rounds);
+    }
+}
+
+// Many small requests: the buffer is cut into jobs of 64 bytes in counter mode, submitted to a queue with one worker per thread and
+// collected from its completion ring by the calling thread. The queue is kept from one call to the next.
+void bench_queue(aes_ctx const *ctx, uint8_t *buffer, size_t length, uint8_t decrypt, unsigned threads)
+{
+    (void)decrypt;
+    static aes_queue queue;
+    static unsigned workers = 0;
+    static aes_job *jobs = NULL;
+    static size_t allocated = 0;
+    if (workers != threads)
+    {
+        if (workers != 0)
+            aes_queue_destroy(&queue);
+        workers = aes_queue_init(&queue, 4096, threads) == 0 ? threads : 0;
+    }
+    size_t job_length = length < 64 ? length : 64, count = length / job_length, submitted = 0, finished = 0;
+    if (count > allocated)
+    {
+        free(jobs);
+        jobs = malloc(count * sizeof(aes_job));
+        allocated = count;
+    }
+    aes_job *done[QUEUE_BATCH];
+    while (finished < count)
+    {
+        for (; submitted < count; submitted++)
+        {
+            jobs[submitted] = (aes_job){ ctx, AES_MODE_CTR, 0, { 0 }, buffer + submitted * job_length, buffer + submitted * job_length, job_length, NULL, NULL, 0 };
+            if (aes_queue_submit(&queue, &jobs[submitted]) != 0)
+                break;
+        }
+        size_t polled = aes_queue_poll(&queue, done, QUEUE_BATCH);
+        finished += polled;
+        if (polled == 0)
+            sched_yield();
+    }
+}
+
+// Nonces and tokens: the buffer is filled with random bytes 32 at a time. The key is not used, the generator has its own.
+void bench_drbg(aes_ctx const *ctx, uint8_t *buffer, size_t length, uint8_t decrypt, unsigned threads)
+{
+    (void)ctx, (void)decrypt, (void)threads;
+    for (size_t offset = 0; offset < length; offset += 32)
+        get_random_bytes(buffer + offset, length - offset < 32 ? length - offset : 32);
+}
+
+// A tag over the whole buffer, CMAC on one thread and PMAC on the thread pool
+void bench_cmac(aes_ctx const *ctx, uint8_t *buffer, size_t length, uint8_t decrypt, unsigned threads)
+{
+    (void)decrypt, (void)threads;
+    static cmac_ctx cmac;
+    static aes_ctx const *made_for = NULL;
+    if (made_for != ctx)
+    {
+        cmac.aes = *ctx;
+        cmac_make_subkeys(&cmac);
+        made_for = ctx;
+    }
+    uint8_t tag[16];
+    aes_cmac(&cmac, buffer, length, tag);
+}
+
+void bench_pmac(aes_ctx const *ctx, uint8_t *buffer, size_t length, uint8_t decrypt, unsigned threads)
+{
+    (void)decrypt;
+    static pmac_ctx pmac;
+    static aes_ctx const *made_for = NULL;
+    if (made_for != ctx)
+    {
+        pmac.aes = *ctx;
+        pmac_make_offsets(&pmac);
+        made_for = ctx;
+    }
+    uint8_t tag[16];
+    aes_pmac(&pmac, buffer, length, tag, threads);
+}
+
+bench_mode const BENCH_MODES[] = {
+    { "ecb", 1, 1, bench_ecb },
+    { "ctr", 0, 1, bench_ctr },
+    { "gcm", 1, 0, bench_gcm },
+    { "xts", 1, 1, bench_xts },
+    { "cbc", 1, 1, bench_cbc },
+    { "keys", 0, 0, bench_keys },
+    { "queue", 0, 1, bench_queue },
+    { "drbg", 0, 0, bench_drbg },
+    { "cmac", 0, 0, bench_cmac },
+    { "pmac", 0, 1, bench_pmac },
+};
+#define BENCH_MODE_COUNT (sizeof(BENCH_MODES) / sizeof(BENCH_MODES[0]))
+
+typedef struct
+{
+    char kernel[16], mode[16], direction[16];
+    unsigned key_bits;
+    size_t size;
+    unsigned threads;
+    uint64_t iterations;
+    double seconds, cycles_per_byte, gb_per_s;
+} bench_result;
+
+double now_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// A small utility function to read sizes like 4096, 64K, 16M or 1G
+size_t parse_size(char const *text)
+{
+    char *end;
+    size_t size = strtoull(text, &end, 10);
+    if (*end == 'K' || *end == 'k')
+        size <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        size <<= 20;
+    else if (*end == 'G' || *end == 'g')
+        size <<= 30;
+    return size;
+}
+
+void bench_measure(bench_mode const *mode, aes_ctx const *ctx, uint8_t *buffer, size_t size, uint8_t decrypt, unsigned threads, double min_time, bench_result *result)
+{
+    mode->run(ctx, buffer, size, decrypt, threads);       // warm up the caches and the branch predictors
+    uint64_t iterations = 1;
+    double seconds;
+    uint64_t ticks;
+    while (1)
+    {
+        double start = now_seconds();
+        uint64_t start_ticks = read_ticks();
+        for (uint64_t itr = 0; itr < iterations; itr++)
+            mode->run(ctx, buffer, size, decrypt, threads);
+        ticks = read_ticks() - start_ticks;
+        seconds = now_seconds() - start;
+        if (seconds >= min_time)
+            break;
+        // Aim a bit above min_time from what this run took, but at least double
+        double scale = seconds > 0 ? 1.2 * min_time / seconds : 1000;
+        iterations = (uint64_t)(iterations * (scale < 2 ? 2 : scale)) + 1;
+    }
+    double bytes = (double)size * iterations;
+    result->size = size;
+    result->threads = threads;
+    result->iterations = iterations;
+    result->seconds = seconds;
+#ifdef AES_X86
+    result->cycles_per_byte = ticks / bytes;
+#else
+    (void)ticks;
+    result->cycles_per_byte = 0.0 / 0.0;        // no cycle counter, only the GB/s is meaningful
+#endif
+    result->gb_per_s = bytes / seconds / 1e9;
+}
+
+void bench_print(FILE *out, char const *format, bench_result const *result, uint8_t first)
+{
+    if (strcmp(format, "csv") == 0)
+    {
+        if (first)
+            fprintf(out, "kernel,mode,direction,key_bits,bytes,threads,iterations,seconds,cycles_per_byte,gb_per_s\n");
+        fprintf(out, "%s,%s,%s,%u,%zu,%u,%" PRIu64 ",%.6f,%.4f,%.4f\n", result->kernel, result->mode, result->direction,
+                result->key_bits, result->size, result->threads, result->iterations, result->seconds, result->cycles_per_byte, result->gb_per_s);
+    }
+    else if (strcmp(format, "json") == 0)
+    {
+        // JSON has no NaN, so a missing cycle count is written as null
+        char cycles[32] = "null";
+        if (result->cycles_per_byte == result->cycles_per_byte)
+            snprintf(cycles, sizeof(cycles), "%.4f", result->cycles_per_byte);
+        fprintf(out, "%s  {\"kernel\": \"%s\", \"mode\": \"%s\", \"direction\": \"%s\", \"key_bits\": %u, \"bytes\": %zu, \"threads\": %u, "
+                "\"iterations\": %" PRIu64 ", \"seconds\": %.6f, \"cycles_per_byte\": %s, \"gb_per_s\": %.4f}", first ? "[\n" : ",\n", result->kernel,
+                result->mode, result->direction, result->key_bits, result->size, result->threads, result->iterations, result->seconds, cycles, result->gb_per_s);
+    }
+    else
+    {
+        if (first)
+            fprintf(out, "%-10s %-6s %-8s %4s %12s %8s %12s %14s %10s\n", "Kernel", "Mode", "Dir", "Key", "Bytes", "Threads", "Iterations",
+                    "Cycles/byte", "GB/s");
+        fprintf(out, "%-10s %-6s %-8s %4u %12zu %8u %12" PRIu64 " %14.2f %10.3f\n", result->kernel, result->mode, result->direction,
+                result->key_bits, result->size, result->threads, result->iterations, result->cycles_per_byte, result->gb_per_s);
+    }
+    fflush(out);
+}
+
+// Reads the results of an older run from its CSV output, returns the no. of rows read (they are allocated in *rows)
+size_t bench_load_baseline(char const *path, bench_result **rows)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 0;
+    size_t count = 0, capacity = 64;
+    *rows = malloc(capacity * sizeof(bench_result));
+    char line[512];
+    while (fgets(line, sizeof(line), file))
+    {
+        if (count == capacity)
+            *rows = realloc(*rows, (capacity *= 2) * sizeof(bench_result));
+        bench_result *row = &(*rows)[count];
+        if (sscanf(line, "%15[^,],%15[^,],%15[^,],%u,%zu,%u,%" SCNu64 ",%lf,%lf,%lf", row->kernel, row->mode, row->direction, &row->key_bits,
+                   &row->size, &row->threads, &row->iterations, &row->seconds, &row->cycles_per_byte, &row->gb_per_s) == 10)
+            count++;
+    }
+    fclose(file);
+    return count;
+}
+
+// Runs the benchmark with the options given on the command line, returns the exit status of the program
+int bench(int argc, char **argv)
+{
+    char const *format = "text", *only_kernel = NULL, *only_mode = NULL, *baseline_path = NULL;
+    size_t min_size = 16, max_size = (size_t)1 << 30;
+    unsigned max_threads = pool_threads(), key_bits = 128;
+    double min_time = 0.2, tolerance = 10;
+    for (int itr = 1; itr < argc; itr++)
+    {
+        char const *value = itr + 1 < argc ? argv[itr + 1] : NULL;
+        if (!value)
+        {
+            fprintf(stderr, "Missing value for %s\n", argv[itr]);
+            return 1;
+        }
+        if (strcmp(argv[itr], "--format") == 0)
+            format = value;
+        else if (strcmp(argv[itr], "--min-size") == 0)
+            min_size = parse_size(value);
+        else if (strcmp(argv[itr], "--max-size") == 0)
+            max_size = parse_size(value);
+        else if (strcmp(argv[itr], "--threads") == 0)
+            max_threads = atoi(value);
+        else if (strcmp(argv[itr], "--kernel") == 0)
+            only_kernel = value;
+        else if (strcmp(argv[itr], "--mode") == 0)
+            only_mode = value;
+        else if (strcmp(argv[itr], "--min-time") == 0)
+            min_time = atof(value);
+        else if (strcmp(argv[itr], "--baseline") == 0)
+            baseline_path = value;
+        else if (strcmp(argv[itr], "--tolerance") == 0)
+            tolerance = atof(value);
+        else if (strcmp(argv[itr], "--key-bits") == 0)
+            key_bits = atoi(value);
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[itr]);
+            return 1;
+        }
+        itr++;
+    }
+    if (min_size < 16 || max_size < min_size || max_threads < 1 || !aes_rounds(key_bits / 8))
+    {
+        fprintf(stderr, "Sizes must be at least 16 bytes, there must be at least one thread and the key must have 128, 192 or 256 bits\n");
+        return 1;
+    }
+
+    bench_result *baseline = NULL;
+    size_t baseline_count = baseline_path ? bench_load_baseline(baseline_path, &baseline) : 0;
+    if (baseline_path && baseline_count == 0)
+        fprintf(stderr, "Nothing could be read from the baseline %s\n", baseline_path);
+
+    // One buffer for the largest size, every smaller size uses the start of it. The pages are touched before measuring.
+    size_t buffer_size = (max_size + 63) & ~(size_t)63;
+    uint8_t *buffer = aligned_alloc(64, buffer_size);
+    if (!buffer)
+    {
+        fprintf(stderr, "Could not allocate %zu bytes\n", buffer_size);
+        return 1;
+    }
+    for (size_t itr = 0; itr < buffer_size; itr++)
+        buffer[itr] = (uint8_t)itr;
+
+    aes_ctx ctx;
+    uint8_t key[32];
+    hex_to_bytes("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", key);
+    aes_ctx_init(&ctx, key, key_bits / 8);
+
+    // 1, 2, 4, ... threads and finally all of them
+    unsigned thread_counts[64], thread_count_no = 0;
+    for (unsigned threads = 1; threads < max_threads && thread_count_no < 63; threads *= 2)
+        thread_counts[thread_count_no++] = threads;
+    thread_counts[thread_count_no++] = max_threads;
+
+    uint8_t first = 1;
+    int regressions = 0;
+    for (size_t kernel = 0; kernel < KERNEL_COUNT; kernel++)
+    {
+        if (!KERNELS[kernel].available || (only_kernel && strcmp(only_kernel, KERNELS[kernel].name) != 0))
+            continue;
+        use_kernel(&KERNELS[kernel]);
+        for (size_t mode = 0; mode < BENCH_MODE_COUNT; mode++)
+        {
+            if (only_mode && strcmp(only_mode, BENCH_MODES[mode].name) != 0)
+                continue;
+            for (uint8_t decrypt = 0; decrypt < 2; decrypt++)
+            {
+                if (decrypt && (!KERNELS[kernel].decrypt || !BENCH_MODES[mode].has_decrypt))
+                    continue;
+                for (size_t size = min_size; size <= max_size; size *= 4)
+                {
+                    if (KERNELS[kernel].encrypt == aes_encrypt_reference && size > REFERENCE_MAX_SIZE)
+                        break;
+                    for (unsigned count = 0; count < thread_count_no; count++)
+                    {
+                        unsigned threads = thread_counts[count];
+                        if (threads > size / 16 || (threads > 1 && !BENCH_MODES[mode].threaded))
+                            break;
+                        bench_result result;
+                        snprintf(result.kernel, sizeof(result.kernel), "%s", KERNELS[kernel].name);
+                        snprintf(result.mode, sizeof(result.mode), "%s", BENCH_MODES[mode].name);
+                        snprintf(result.direction, sizeof(result.direction), "%s", decrypt ? "decrypt" : "encrypt");
+                        result.key_bits = key_bits;
+                        bench_measure(&BENCH_MODES[mode], &ctx, buffer, size & ~(size_t)15, decrypt, threads, min_time, &result);
+                        bench_print(stdout, format, &result, first);
+                        first = 0;
+
+                        for (size_t row = 0; row < baseline_count; row++)
+                        {
+                            bench_result const *old = &baseline[row];
+                            if (strcmp(old->kernel, result.kernel) || strcmp(old->mode, result.mode) || strcmp(old->direction, result.direction) ||
+                                old->key_bits != result.key_bits || old->size != result.size || old->threads != result.threads)
+                                continue;
+                            if (result.gb_per_s < old->gb_per_s * (1 - tolerance / 100))
+                            {
+                                fprintf(stderr, "REGRESSION %s %s %s %u-bit key %zu bytes %u threads: %.3f GB/s, was %.3f GB/s\n", result.kernel,
+                                        result.mode, result.direction, result.key_bits, result.size, result.threads, result.gb_per_s, old->gb_per_s);
+                                regressions++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (strcmp(format, "json") == 0)
+        printf(first ? "[]\n" : "\n]\n");
+
+    use_best_kernels();
+    free(buffer);
+    free(baseline);
+    return regressions ? 2 : 0;
+}
+
+// File encryption
+// "aes encrypt" and "aes decrypt" work on files and pipes of any size in a fixed amount of memory. The data is cut into FILE_CHUNK
+// sized chunks and every chunk is sealed with GCM on its own, so decryption checks each chunk before any of it is written out.
+// The format is the header (the magic "AESGCM01" and a random 12 byte salt) followed by the chunks, each being its ciphertext and then
+// its 16 byte tag. Every file is encrypted with its own key, derived from the given key and the salt (see file_key()), so files never
+// share a GCM key even though their nonces follow the same pattern: 7 zero bytes, n as a 32-bit big-endian no. for chunk n and a last
+// byte that is 1 for the final chunk and 0 otherwise. A random nonce prefix under the one long-term key would not do, two files that
+// drew the same prefix would reuse keystream. The header is the additional data of every chunk. Only the final chunk is shorter
+// than FILE_CHUNK (a file that is an exact multiple ends with an empty one), so chunks that are cut off, reordered or moved between
+// files all fail the check.
+// A regular file is memory mapped and read in place. Anything else (a pipe, stdin) is read by a second thread into two buffers in
+// turn, so one chunk is read while the one before it is being encrypted, and the encryption is done in place in that buffer.
+#define FILE_CHUNK ((size_t)1 << 20)
+#define FILE_MAGIC "AESGCM01"
+#define FILE_SALT_SIZE 12
+#define FILE_HEADER_SIZE (8 + FILE_SALT_SIZE)
+
+// Reads until the buffer is full or the input ends, returns the no. of bytes read or -1 on an error
+ssize_t read_full(int fd, uint8_t *buffer, size_t length)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t got = read(fd, buffer + done, length - done);
+        if (got == 0)
+            break;
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += got;
+    }
+    return done;
+}
+
+int write_all(int fd, uint8_t const *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t put = write(fd, buffer, length);
+        if (put < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += put;
+        length -= put;
+    }
+    return 0;
+}
+
+// The double buffered reader. The reading thread fills slot 0, 1, 0, ... each as soon as the encryption has given it back.
+typedef struct
+{
+    int fd;
+    size_t chunk;
+    uint8_t *buffers[2];
+    ssize_t lengths[2];
+    uint8_t full[2];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+} chunk_reader;
+
+// source_close() cancels the reader when the work stops early. It may then be in pthread_cond_wait(), which takes the lock again
+// before the thread ends, so the lock is given back by this cleanup handler.
+void chunk_reader_unlock(void *arg)
+{
+    pthread_mutex_unlock(&((chunk_reader *)arg)->lock);
+}
+
+// Waits until the slot has been given back
+void chunk_reader_wait(chunk_reader *reader, uint8_t slot)
+{
+    pthread_mutex_lock(&reader->lock);
+    pthread_cleanup_push(chunk_reader_unlock, reader);
+    while (reader->full[slot])
+        pthread_cond_wait(&reader->changed, &reader->lock);
+    pthread_cleanup_pop(1);
+}
+
+void *chunk_reader_thread(void *arg)
+{
+    chunk_reader *reader = arg;
+    for (uint8_t slot = 0; ; slot ^= 1)
+    {
+        chunk_reader_wait(reader, slot);
+
+        ssize_t length = read_full(reader->fd, reader->buffers[slot], reader->chunk);
+
+        pthread_mutex_lock(&reader->lock);
+        reader->lengths[slot] = length;
+        reader->full[slot] = 1;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        // A short chunk is the end of the input (or an error), nothing more will be asked for
+        if (length < (ssize_t)reader->chunk)
+            return NULL;
+    }
+}
+
+// A chunk comes either from the mapped file or from the reader, whichever the input allows
+typedef struct
+{
+    uint8_t const *map;         // the whole input when it is mapped, NULL otherwise
+    size_t map_size, offset;
+    chunk_reader reader;
+    uint8_t slot;
+    uint8_t started;            // the reader thread is running
+} chunk_source;
+
+// Gives the next chunk of at most chunk bytes, its length is -1 on a read error
+uint8_t *source_next(chunk_source *source, size_t chunk, ssize_t *length)
+{
+    if (source->map)
+    {
+        size_t left = source->map_size - source->offset;
+        *length = left < chunk ? left : chunk;
+        return (uint8_t *)source->map + source->offset;
+    }
+    chunk_reader *reader = &source->reader;
+    pthread_mutex_lock(&reader->lock);
+    while (!reader->full[source->slot])
+        pthread_cond_wait(&reader->changed, &reader->lock);
+    pthread_mutex_unlock(&reader->lock);
+    *length = reader->lengths[source->slot];
+    return reader->buffers[source->slot];
+}
+
+// Hands the chunk back once it is written out. Mapped pages that are done with are dropped, so a file of many GB does not stay in memory.
+void source_release(chunk_source *source, size_t length)
+{
+    if (source->map)
+    {
+        size_t start = source->offset & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+        source->offset += length;
+        madvise((uint8_t *)source->map + start, source->offset - start, MADV_DONTNEED);
+        return;
+    }
+    chunk_reader *reader = &source->reader;
+    pthread_mutex_lock(&reader->lock);
+    reader->full[source->slot] = 0;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+    source->slot ^= 1;
+}
+
+// Maps the input if it is a regular file, otherwise starts the reader with buffers of chunk bytes (and room for a tag after them)
+int source_open(chunk_source *source, int fd, size_t chunk)
+{
+    memset(source, 0, sizeof(*source));
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, info.st_size, MADV_SEQUENTIAL);
+            source->map = map;
+            source->map_size = info.st_size;
+            // The header was already read through the descriptor
+            source->offset = lseek(fd, 0, SEEK_CUR);
+            return 0;
+        }
+    }
+    chunk_reader *reader = &source->reader;
+    reader->fd = fd;
+    reader->chunk = chunk;
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+    for (uint8_t slot = 0; slot < 2; slot++)
+        if (!(reader->buffers[slot] = malloc(chunk + 16)))
+            return -1;
+    if (pthread_create(&reader->thread, NULL, chunk_reader_thread, reader) != 0)
+        return -1;
+    source->started = 1;
+    return 0;
+}
+
+void source_close(chunk_source *source)
+{
+    if (source->map)
+    {
+        munmap((void *)source->map, source->map_size);
+        return;
+    }
+    chunk_reader *reader = &source->reader;
+    if (source->started)
+    {
+        // When the work stopped early the reader may still be waiting for a slot or blocked in read() on the input
+        pthread_cancel(reader->thread);
+        pthread_join(reader->thread, NULL);
+    }
+    if (reader->chunk)
+    {
+        pthread_mutex_destroy(&reader->lock);
+        pthread_cond_destroy(&reader->changed);
+    }
+    free(reader->buffers[0]);
+    free(reader->buffers[1]);
+}
+
+// Reads a key given as hex digits (32, 48 or 64 of them), returns its length in bytes or 0 if it is not a valid key
+size_t parse_key(char const *hex, uint8_t *key)
+{
+    size_t digits = strlen(hex);
+    while (digits > 0 && (hex[digits - 1] == '\n' || hex[digits - 1] == '\r'))
+        digits--;
+    if (!aes_rounds(digits / 2) || digits % 2 || strspn(hex, "0123456789abcdefABCDEF") < digits)
+        return 0;
+    for (size_t itr = 0; itr < digits / 2; itr++)
+        sscanf(hex + 2*itr, "%2" SCNx8, &key[itr]);
+    return digits / 2;
+}
+
+// The key of one file, derived from the given key and the salt the way AES-GCM-SIV derives the keys of a message from its nonce
+// (RFC 8452 section 4): block i is E(key, [i]_32 little-endian || salt) and the file key is the first 8 bytes of each block in turn,
+// as many blocks as it takes to make a key of the same length as the given one.
+void file_key(uint8_t const *key, size_t key_length, uint8_t const *salt, uint8_t *derived)
+{
+    uint8_t blocks[4][16];
+    aes_ctx ctx;
+    aes_ctx_init(&ctx, key, key_length);
+    for (uint8_t itr = 0; itr < key_length / 8; itr++)
+    {
+        memset(blocks[itr], 0, 4);
+        blocks[itr][0] = itr;
+        memcpy(blocks[itr] + 4, salt, FILE_SALT_SIZE);
+    }
+    aes_ctx_encrypt(&ctx, blocks[0], blocks[0], key_length / 8);
+    for (uint8_t itr = 0; itr < key_length / 8; itr++)
+        memcpy(derived + 8*itr, blocks[itr], 8);
+    memset(blocks, 0, sizeof(blocks));
+    memset(&ctx, 0, sizeof(ctx));
+}
+
+// Encrypts or decrypts input_fd into output_fd, returns 0 when done and 1 on an error (which has been reported)
+int crypt_stream(uint8_t const *key, size_t key_length, int input_fd, int output_fd, uint8_t decrypt)
+{
+    uint8_t header[FILE_HEADER_SIZE], nonce[12] = { 0 }, derived[32];
+    if (decrypt)
+    {
+        if (read_full(input_fd, header, FILE_HEADER_SIZE) != FILE_HEADER_SIZE || memcmp(header, FILE_MAGIC, 8) != 0)
+        {
+            fprintf(stderr, "The input is not an encrypted file\n");
+            return 1;
+        }
+    }
+    else
+    {
+        memcpy(header, FILE_MAGIC, 8);
+        if (getentropy(header + 8, FILE_SALT_SIZE) != 0 || write_all(output_fd, header, FILE_HEADER_SIZE) != 0)
+        {
+            perror("aes");
+            return 1;
+        }
+    }
+    file_key(key, key_length, header + 8, derived);
+
+    gcm_ctx gcm;
+    int failed = aes_gcm_init(&gcm, derived, key_length);
+    memset(derived, 0, sizeof(derived));
+    if (failed)
+    {
+        fprintf(stderr, "The key has to be 16, 24 or 32 bytes\n");
+        return 1;
+    }
+    // Decryption reads a chunk and its tag together
+    size_t chunk = decrypt ? FILE_CHUNK + 16 : FILE_CHUNK;
+    chunk_source source;
+    // When the input is mapped the result goes to this buffer, otherwise it is written over the input in the reader's buffer
+    uint8_t *out_buffer = NULL;
+    if (source_open(&source, input_fd, chunk) != 0)
+    {
+        perror("aes");
+        source_close(&source);
+        return 1;
+    }
+    if (source.map && !(out_buffer = malloc(FILE_CHUNK + 16)))
+    {
+        perror("aes");
+        source_close(&source);
+        return 1;
+    }
+
+    int status = 0;
+    for (uint32_t index = 0; ; index++)
+    {
+        ssize_t length;
+        uint8_t *input = source_next(&source, chunk, &length);
+        if (length < 0)
+        {
+            perror("aes");
+            status = 1;
+            break;
+        }
+        uint8_t last = (size_t)length < chunk;
+        store_word(nonce + 7, index);
+        nonce[11] = last;
+        uint8_t *output = out_buffer ? out_buffer : input;
+        size_t output_length;
+        if (decrypt)
+        {
+            if (length < 16)
+            {
+                fprintf(stderr, "The encrypted file is cut short\n");
+                status = 1;
+                break;
+            }
+            output_length = length - 16;
+            if (aes_gcm_decrypt(&gcm, nonce, 12, header, FILE_HEADER_SIZE, input, output, output_length, input + output_length, 16) != 0)
+            {
+                fprintf(stderr, "Chunk %" PRIu32 " failed the authentication, wrong key or the file was changed\n", index);
+                status = 1;
+                break;
+            }
+        }
+        else
+        {
+            aes_gcm_encrypt(&gcm, nonce, 12, header, FILE_HEADER_SIZE, input, output, length, output + length);
+            output_length = length + 16;
+        }
+        if (write_all(output_fd, output, output_length) != 0)
+        {
+            perror("aes");
+            status = 1;
+            break;
+        }
+        source_release(&source, length);
+        if (last)
+            break;
+        if (index == UINT32_MAX)
+        {
+            fprintf(stderr, "The input is too large\n");
+            status = 1;
+            break;
+        }
+    }
+    source_close(&source);
+    free(out_buffer);
+    memset(&gcm, 0, sizeof(gcm));
+    return status;
+}
+
+// aes encrypt|decrypt -k HEXKEY | -K KEYFILE [-i INPUT] [-o OUTPUT], stdin and stdout when no files are given
+int crypt_command(int argc, char **argv, uint8_t decrypt)
+{
+    char const *key_hex = NULL, *key_path = NULL, *input_path = NULL, *output_path = NULL;
+    for (int itr = 1; itr < argc; itr++)
+    {
+        char const *value = itr + 1 < argc ? argv[itr + 1] : NULL;
+        if (!value)
+        {
+            fprintf(stderr, "Missing value for %s\n", argv[itr]);
+            return 1;
+        }
+        if (strcmp(argv[itr], "-k") == 0)
+            key_hex = value;
+        else if (strcmp(argv[itr], "-K") == 0)
+            key_path = value;
+        else if (strcmp(argv[itr], "-i") == 0)
+            input_path = value;
+        else if (strcmp(argv[itr], "-o") == 0)
+            output_path = value;
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[itr]);
+            return 1;
+        }
+        itr++;
+    }
+
+    // A key file keeps the key out of the process list
+    char key_text[130] = "";
+    if (key_path)
+    {
+        FILE *file = fopen(key_path, "r");
+        if (!file || !fgets(key_text, sizeof(key_text), file))
+        {
+            fprintf(stderr, "Could not read the key from %s\n", key_path);
+            if (file)
+                fclose(file);
+            return 1;
+        }
+        fclose(file);
+        key_hex = key_text;
+    }
+    uint8_t key[32];
+    size_t key_length = key_hex ? parse_key(key_hex, key) : 0;
+    if (!key_length)
+    {
+        fprintf(stderr, "A key of 32, 48 or 64 hex digits (AES-128, 192 or 256) has to be given with -k or -K\n");
+        return 1;
+    }
+
+    int input_fd = input_path ? open(input_path, O_RDONLY) : STDIN_FILENO;
+    if (input_fd < 0)
+    {
+        perror(input_path);
+        return 1;
+    }
+    int output_fd = output_path ? open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0600) : STDOUT_FILENO;
+    if (output_fd < 0)
+    {
+        perror(output_path);
+        if (input_path)
+            close(input_fd);
+        return 1;
+    }
+    int status = crypt_stream(key, key_length, input_fd, output_fd, decrypt);
+    memset(key, 0, sizeof(key));
+    memset(key_text, 0, sizeof(key_text));
+    // An output file left by a failed run (a chunk that was not authentic, a read or write error) would look like a whole result, so
+    // it is removed. Other outputs (a pipe, a device) cannot be taken back, what went out before the error stays there.
+    struct stat info;
+    uint8_t remove_output = status != 0 && output_path && fstat(output_fd, &info) == 0 && S_ISREG(info.st_mode);
+    if (output_path && close(output_fd) != 0)
+    {
+        perror(output_path);
+        status = 1;
+    }
+    if (remove_output)
+        unlink(output_path);
+    if (input_path)
+        close(input_fd);
+    return status;
+}
+
+// The interactive walk through one block, as the program originally worked. Build with -DAES_TRACE to see every round.
+void demo()
+{
+    // This line can be uncommented to see if 128 bit is defined in the system or not.
+    // Since its not defined in my system it printed zero.
+    // printf("%" PRIu8 "\n", check128);
+
+    // Since C doesn't have 128-bit data type, the secret key is first scanned as a string.
+    printf("Enter secret key in chars like - \"This is cool\", \nAlso restrict string length to 16\n");
+    // Since we cannot have 128bit integers, we will instead divide 128-bit into 16 8-bit parts which are stored in the char array.
+    // The array size is 17 to include the NULL character.
+    char secret_key[17]; // = "Thats my Kung Fu";
+    scanf("%16[^\n]", secret_key);
+    printf("Enter plaintext similar to secret_key\n");
+    char plaintext[17]; // = "Two One Nine Two";
+    scanf(" %16[^\n]", plaintext);
+    uint8_t (*round_keys) [16] = key_scheduling_fun(secret_key, 16);
+    printf("Round Keys - \n");
+    for (uint8_t itr = 0; itr < 11; itr++)
+    {
+        printf("Round %2d - ",itr);
+        for (uint8_t itr2 = 0; itr2 < 16; itr2++)
+        {
+            printf("%02X ",round_keys[itr][itr2]);
+        }
+        printf("\n");
+    }
+
+    // Encryption       ------------------------------------------------------
+    char *ciphertext = aes(plaintext, round_keys, 10);
+    print("\nCiphertext", ciphertext, "   ");
+
+    // Decrytpion      ------------------------------------------------------
+    char *decrypttext = aes_decrypt(ciphertext, round_keys, 10);
+
+    // Just printing
+    print("\nCiphertext", ciphertext, "   ");
+    printf("\n\t\t\t OR \n\n");
+    printf("\t\t  %s\n",ciphertext);
+    print("\nDecrypted text", decrypttext, "   ");
+    printf("\n\t\t\t OR \n\n");
+    printf("\t\t  %s\n",decrypttext);
+
+#ifdef AES_PROFILE
+    printf("\nTime spent in each stage\n");
+    profile_report(stdout, 1);
+#endif
+
+    // freeing memory
+    free(round_keys);
+    free(ciphertext);
+    free(decrypttext);
+}
+
+void usage()
+{
+    printf("Usage: aes [command] [options]\n"
+           "  bench    Checks the known answers, then measures every implementation (the default command)\n"
+           "           --format text|csv|json   --min-size N   --max-size N (sizes take K, M and G)   --threads N\n"
+           "           --kernel NAME   --mode NAME   --min-time SECONDS   --baseline OLD.csv   --tolerance PERCENT\n"
+           "           --key-bits 128|192|256\n"
+           "  encrypt  Encrypts a file or stdin with AES-GCM in 1 MiB chunks, each with its own tag\n"
+           "           -k HEXKEY | -K KEYFILE   -i INPUT (default stdin)   -o OUTPUT (default stdout)\n"
+           "  decrypt  Decrypts what encrypt made, stopping at the first chunk that is not authentic (same options)\n"
+           "           On an error the output file is removed, output to a pipe may already hold the chunks before it\n"
+           "  kat      Runs the known answer tests on every implementation\n"
+           "  demo     Encrypts and decrypts one block typed in by the user\n");
+}
+
+int main(int argc, char **argv)
+{
+    char const *command = argc > 1 ? argv[1] : "bench";
+    if (strcmp(command, "bench") == 0)
+    {
+        if (run_kat(0))
+        {
+            fprintf(stderr, "The known answer tests failed, run \"aes kat\" to see which\n");
+            return 1;
+        }
+        return bench(argc > 1 ? argc - 1 : 0, argv + 1);
+    }
+    if (strcmp(command, "kat") == 0)
+        return run_kat(1) ? 1 : 0;
+    if (strcmp(command, "encrypt") == 0 || strcmp(command, "decrypt") == 0)
+        return crypt_command(argc - 1, argv + 1, strcmp(command, "decrypt") == 0);
+    if (strcmp(command, "demo") == 0)
+    {
+        demo();
+        return 0;
+    }
+    usage();
+    return strcmp(command, "help") == 0 || strcmp(command, "--help") == 0 ? 0 : 1;
+}